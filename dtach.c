@@ -14,3 +14,136 @@ init_sockaddr_un(struct sockaddr_un *sockun, char *name)
 	}
 	strcpy(sockun->sun_path, name);
 }
+
+/* Connects to a unix domain socket */
+int
+connect_socket(char *name)
+{
+	int s;
+	struct sockaddr_un sockun;
+
+	s = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	init_sockaddr_un(&sockun, name);
+	if (connect(s, (struct sockaddr*)&sockun, sizeof(sockun)) < 0)
+	{
+		close(s);
+
+		/* ECONNREFUSED is also returned for regular files, so make
+		** sure we are trying to connect to a socket. */
+		if (errno == ECONNREFUSED)
+		{
+			struct stat st;
+
+			if (stat(name, &st) < 0)
+				return -1;
+			else if (!S_ISSOCK(st.st_mode) || S_ISREG(st.st_mode))
+				errno = ENOTSOCK;
+		}
+		return -1;
+	}
+	return s;
+}
+
+/* Writes out all of a buffer, unless something goes wrong. */
+int
+write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Reads exactly len bytes, unless something goes wrong. */
+int
+read_all(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Asks the master to switch to frames. Masters that don't know about them
+** ignore the request, so only wait a little while for an answer. Returns
+** the version agreed on, or 0 if we have to stick to packets. */
+int
+negotiate(int s)
+{
+	struct packet pkt;
+	unsigned char ack[FRAME_HDR];
+	struct timeval tv;
+	fd_set readfds;
+	size_t got = 0;
+	ssize_t len;
+
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = MSG_HELLO;
+	pkt.len = PROTOCOL_VERSION;
+	if (write_all(s, &pkt, sizeof(struct packet)) < 0)
+		return 0;
+
+	tv.tv_sec = HELLO_TIMEOUT / 1000;
+	tv.tv_usec = (HELLO_TIMEOUT % 1000) * 1000;
+	while (got < sizeof(ack))
+	{
+		FD_ZERO(&readfds);
+		FD_SET(s, &readfds);
+		if (select(s + 1, &readfds, NULL, NULL, &tv) <= 0)
+			break;
+		len = read(s, ack + got, sizeof(ack) - got);
+		if (len <= 0)
+			break;
+		got += len;
+	}
+
+	if (got == sizeof(ack) && ack[0] == MSG_HELLO && ack[1] > 0 &&
+		ack[2] == 0 && ack[3] == 0)
+		return ack[1];
+	/* Anything else would be output from the program. */
+	else if (got > 0)
+		write_all(1, ack, got);
+	return 0;
+}
+
+/* Asks the master for a session, over a connection that uses frames.
+** Returns the master's answer, or -1 if it went away. */
+int
+request_session(int s, int flags, const void *data, size_t len)
+{
+	unsigned char hdr[FRAME_HDR];
+
+	if (len > FRAME_MAX)
+		return SESSION_FAILED;
+	hdr[0] = MSG_SESSION;
+	hdr[1] = flags;
+	hdr[2] = len >> 8;
+	hdr[3] = len & 0xff;
+	if (write_all(s, hdr, sizeof(hdr)) < 0 ||
+		write_all(s, data, len) < 0 ||
+		read_all(s, hdr, sizeof(hdr)) < 0 || hdr[0] != MSG_SESSION)
+		return -1;
+	return hdr[1];
+}
@@ -23,7 +23,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,12 +70,63 @@
 #include <sys/resource.h>
 #endif
 
+#ifdef HAVE_SYS_FILE_H
+#include <sys/file.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#include <dirent.h>
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
 #ifndef S_ISREG
 #define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
@@ -83,7 +137,7 @@
 #endif
 
 extern char *progname, *sockname;
-extern int detach_char, no_suspend, redraw_method;
+extern int detach_char, no_suspend, redraw_method, overflow_policy;
 extern struct termios orig_term;
 extern int dont_have_tty;
 
@@ -94,6 +148,15 @@ enum
 	MSG_DETACH	= 2,
 	MSG_WINCH	= 3,
 	MSG_REDRAW	= 4,
+	MSG_HELLO	= 5,
+	MSG_OBSERVE	= 6,
+	MSG_SESSION	= 7,
+	MSG_STATS	= 8,
+	MSG_COMPRESS	= 9,
+	MSG_POOL	= 10,
+	MSG_UPGRADE	= 11,
+	MSG_DIRECT	= 12,
+	MSG_RELEASE	= 13,
 };
 
 enum
@@ -102,6 +165,31 @@ enum
 	REDRAW_NONE	= 1,
 	REDRAW_CTRL_L	= 2,
 	REDRAW_WINCH	= 3,
+	REDRAW_SCREEN	= 4,
+};
+
+/* What the master does when a client can't keep up with the output. */
+enum
+{
+	OVERFLOW_UNSPEC		= 0,
+	OVERFLOW_BLOCK		= 1,
+	OVERFLOW_DROP		= 2,
+	OVERFLOW_DISCONNECT	= 3,
+};
+
+/* What the master does with the output while nobody is attached. */
+enum
+{
+	DETACH_DROP	= 0,
+	DETACH_BUFFER	= 1,
+	DETACH_PAUSE	= 2,
+};
+
+/* How the master sizes the window when several clients are attached. */
+enum
+{
+	SIZE_LATEST	= 0,
+	SIZE_SMALLEST	= 1,
 };
 
 /* The client to master protocol. */
@@ -116,6 +204,188 @@ struct packet
 	} u;
 };
 
+/*
+** The packets above are the original protocol, and what a client speaks
+** until the master agrees to something better. A client that knows about
+** framing sends a MSG_HELLO packet with the highest version it speaks in
+** len, and waits up to HELLO_TIMEOUT milliseconds for the master to answer
+** with a MSG_HELLO frame carrying the version to use. Masters that predate
+** framing ignore the packet, and the client carries on with packets.
+**
+** After that, every message from the client is a frame: a FRAME_HDR byte
+** header holding the type, an argument (what len is in a packet), and the
+** length of the payload as a 16-bit big-endian number, followed by the
+** payload itself. MSG_PUSH payloads can be up to FRAME_MAX bytes, and the
+** window size messages carry a struct winsize.
+*/
+#define PROTOCOL_VERSION 10
+#define FRAME_HDR 4
+#define FRAME_MAX 65535
+#define HELLO_TIMEOUT 500
+
+/*
+** A read-only observer sends MSG_OBSERVE, with its redraw method as the
+** argument, instead of attaching. This needs version 2 of the protocol. If
+** the master publishes its output in a shared memory ring, it answers with a
+** MSG_OBSERVE frame whose argument is 1, the ring's file descriptor passed
+** along with SCM_RIGHTS, and a struct observe_reply as the payload. The next
+** snaplen bytes on the socket are a snapshot of the screen, and after that
+** the observer follows the ring from the start offset. Otherwise the
+** argument is 0, and the observer just attaches and ignores the keyboard.
+*/
+
+/*
+** A master started with a session name hosts any number of named sessions,
+** and its clients start out without one. Since version 3, a client picks
+** one by sending MSG_SESSION with the name as the payload, and the master
+** answers with a MSG_SESSION frame whose argument is one of the SESSION_*
+** results below. With SESSION_CREATE in the argument, the name is followed
+** by a NUL, the directory to run the command in, and the command's
+** arguments, each ended by a NUL; the session is started if it doesn't
+** exist yet, and the client isn't attached to it. SESSION_EXCL makes it an
+** error for the session to exist already, and SESSION_WAIT holds up the
+** program's output until a client attaches. Session names are up to
+** SESSION_NAME_MAX printable characters.
+*/
+#define SESSION_CREATE 1
+#define SESSION_EXCL 2
+#define SESSION_WAIT 4
+#define SESSION_NAME_MAX 64
+
+enum
+{
+	SESSION_FAILED	= 0,
+	SESSION_OK	= 1,
+	SESSION_EXISTS	= 2,
+};
+
+/*
+** Since version 4, a client can send MSG_STATS to find out how things are
+** going without attaching. The master answers with MSG_STATS frames holding
+** a struct session_stats for the client's session, or for every session if
+** it hasn't picked one. The argument of every frame but the last is 1.
+** Since version 5, sending it with STATS_METRICS as the argument gets the
+** master's metrics instead, as text in the Prometheus exposition format.
+** Since version 10, sending it with STATS_TRACE gets the most recent events
+** in the master's trace ring, as struct trace_event records, oldest first.
+*/
+#define STATS_METRICS 1
+#define STATS_TRACE 2
+
+struct session_stats
+{
+	/* When the session started, and when its program last took input or
+	** produced output, in seconds since the epoch. */
+	int64_t started;
+	int64_t active;
+	/* How much input the program has taken, and output it produced. */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	/* The program's process id. */
+	uint32_t pid;
+	/* How many clients are attached, and observing. */
+	uint16_t clients;
+	uint16_t observers;
+	/* The window size. */
+	uint16_t rows;
+	uint16_t cols;
+	/* The session's name, if the master hosts named sessions. */
+	char name[SESSION_NAME_MAX + 4];
+};
+
+/* The master keeps the last TRACE_EVENTS of these, whether or not anything
+** is tracing, for looking into a latency spike after the fact. */
+struct trace_event
+{
+	/* When it happened, in microseconds from some fixed point. */
+	uint64_t usec;
+	/* The program's process id or the client's number, and how many
+	** bytes it was about. */
+	uint32_t id;
+	uint32_t len;
+	/* What happened, and for messages, their type. */
+	uint16_t type;
+	uint16_t arg;
+	uint32_t pad;
+};
+#define TRACE_EVENTS 4096
+
+enum
+{
+	TRACE_PTY_READ		= 1,
+	TRACE_CLIENT_WRITE	= 2,
+	TRACE_CLIENT_MSG	= 3,
+	TRACE_ACCEPT		= 4,
+};
+
+/*
+** Since version 6, a client can have its output compressed by sending
+** MSG_COMPRESS before it attaches, with the codecs it can decompress as a
+** mask of COMPRESS_* bits in the argument. The master answers with a
+** MSG_COMPRESS frame whose argument is the codec it picked, or 0 for none.
+** With a codec picked, the output comes as MSG_PUSH frames instead of a
+** plain stream. Each holds at most BUFSIZE bytes of output, compressed on
+** its own with the codec in the frame's argument, or not at all if the
+** argument is 0.
+*/
+#define COMPRESS_ZLIB 1
+#define COMPRESS_LZ4 2
+#define COMPRESS_ZSTD 4
+#define COMPRESS_CODECS 3
+
+/*
+** A pool keeps masters that have everything but a socket and a command
+** ready to go. Since version 7, a client asks the pool for a session by
+** sending MSG_POOL with POOL_* flags in the argument. The payload is the
+** socket to create, the directory to run the command in and the command's
+** arguments, each ended by a NUL. With POOL_TERM, it starts with the
+** struct termios for the pty. The pool answers with a MSG_POOL frame whose
+** argument is SESSION_OK, or SESSION_FAILED with the reason as the payload.
+** The pool and its masters use the same messages, and a master sends an
+** empty MSG_POOL frame once it is ready.
+*/
+#define POOL_WAIT 1
+#define POOL_TERM 2
+#define POOL_MAX 64
+
+/*
+** Since version 8, a client can have the master replace itself with
+** another dtmaster binary, without ending any sessions, by sending
+** MSG_UPGRADE with the path of the binary as the payload. If the upgrade
+** doesn't happen, the master answers with a MSG_UPGRADE frame whose
+** argument is 0, and the reason as the payload. Otherwise the new master
+** answers with an empty MSG_UPGRADE frame whose argument is 1, once it has
+** taken over. Masters save their state for the one that takes over in
+** the format numbered UPGRADE_VERSION, and only upgrade to binaries that
+** print the same number when run with --upgrade-version.
+*/
+#define UPGRADE_VERSION 5
+
+/*
+** Since version 9, a client that would be the only one attached can ask
+** for the pty itself, so that the output and input don't have to go
+** through the master. It sends MSG_DIRECT instead of MSG_ATTACH, with its
+** overflow policy as the argument. The master answers with a MSG_DIRECT
+** frame. If it can't hand the pty over, because someone else is attached or
+** observing, or it has to see the output itself, the argument is 0 and the
+** client attaches as usual. Otherwise the argument has DIRECT_OK set, and
+** DIRECT_PACKET too if the pty is in packet mode, and the pty's descriptor
+** comes with it through SCM_RIGHTS. The client is then attached, and the
+** master stops reading the pty.
+**
+** Either side ends this with MSG_RELEASE. The master sends it when another
+** client wants to attach, and the client answers by closing the pty and
+** sending MSG_RELEASE back. A client that gives the pty back by itself
+** gets the master's MSG_RELEASE in return, unless the master had already
+** sent it. Until the client gets that, the master sends it nothing but
+** these frames, and after it the output comes through the socket as usual.
+** A client that detaches or goes away gives the pty back without any of
+** this, and one that asks again after coming back from a suspend ignores
+** any MSG_RELEASE that comes before the answer.
+*/
+#define DIRECT_OK 1
+#define DIRECT_PACKET 2
+
 /*
 ** The master sends a simple stream of text to the attaching clients, without
 ** any protocol. This might change back to the packet based protocol in the
@@ -125,9 +395,179 @@ struct packet
 */
 #define BUFSIZE 4096
 
+/*
+** Output that an attached client can't take right away is queued for it in
+** the master, up to OUTQ_SIZE bytes by default. What happens past that
+** depends on the client's overflow policy.
+*/
+#define OUTQ_SIZE (256 * 1024)
+
+/*
+** Unless it is thrown away, output produced while nobody is attached is kept
+** for the next client to attach, up to HELD_SIZE bytes by default. This has
+** to fit in a client's output queue.
+*/
+#define HELD_SIZE (64 * 1024)
+
+/*
+** Window size changes and redraws that the clients ask for are held for up
+** to SETTLE_MS milliseconds by default, so that a window being dragged or
+** several clients attaching at once only resize the pty to the last size
+** and redraw the program once. They can be held for up to SETTLE_MAX.
+*/
+#define SETTLE_MS 20
+#define SETTLE_MAX 1000
+
+/*
+** The master reads a flood of output in batches, but stops once it has spent
+** OUTPUT_SLICE microseconds on it, to get back to the clients. Their input
+** goes to the programs before any output is read, so a keystroke waits about
+** that long at most, however much output there is.
+*/
+#define OUTPUT_SLICE 2000
+
+/*
+** Input from the clients is queued for the program in the master, up to
+** INQ_SIZE bytes. This has to be big enough for the largest frame.
+*/
+#define INQ_SIZE (64 * 1024)
+
+/* How many packets the master reads at once from a client that doesn't
+** use frames. */
+#define LEGACY_INSIZE (16 * sizeof(struct packet))
+
 void init_sockaddr_un(struct sockaddr_un *sockun, char *name);
+int connect_socket(char *name);
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+int negotiate(int s);
+int request_session(int s, int flags, const void *data, size_t len);
+
+/* Compressing the output, in dtcompress.c. */
+int compress_codecs(void);
+int compress_pick(int codecs);
+size_t compress_chunk(int codec, const unsigned char *in, size_t len,
+	unsigned char *out, size_t size);
+ssize_t decompress_chunk(int codec, const unsigned char *in, size_t len,
+	unsigned char *out, size_t size);
+
+/* The pool of masters, in dtpool.c, and its masters, in dtmaster.c. */
+int pool_main(int s, int size, int nofork);
+int pool_request(char *pool, char **argv, int waitattach);
+int warm_master(int fd);
+
+/* Asking masters how they are doing without attaching, and having them
+** upgrade, in dtlist.c. */
+int list_main(char *path);
+int metrics_main(char *path);
+int trace_main(char *path);
+int upgrade_main(char *path, char *binary);
+
+/* The master's model of the program's screen, in dtscreen.c. */
+struct screen;
+struct screen *screen_new(int rows, int cols);
+void screen_free(struct screen *scr);
+void screen_resize(struct screen *scr, int rows, int cols);
+void screen_feed(struct screen *scr, const unsigned char *buf, size_t len);
+unsigned char *screen_snapshot(struct screen *scr, size_t *len);
 
 #ifdef sun
 #define BROKEN_MASTER
 #endif
+
+/* Use epoll for the master's event loop if we have it, and select
+** otherwise. */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define USE_EPOLL
+#if defined(HAVE_SYS_SIGNALFD_H) && defined(HAVE_SIGNALFD)
+#define USE_SIGNALFD
+#endif
+#endif
+
+/* Let observers read the output from shared memory, if we can. */
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H) && \
+	defined(HAVE_LINUX_FUTEX_H) && defined(SYS_futex)
+#define USE_OBSERVERS
+#endif
+
+#ifdef USE_OBSERVERS
+struct observe_reply
+{
+	uint64_t start;
+	uint32_t snaplen;
+	uint32_t pad;
+};
+
+/*
+** The header of the ring, which is followed by the data at OBS_DATA. Only
+** the master writes to it. head counts every byte ever published, and seq
+** is bumped after head moves, for observers to wait on with a futex.
+*/
+struct obs_ring
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t size;
+	uint64_t head;
+};
+#define OBS_MAGIC 0x64746f62
+#define OBS_DATA 4096
+#endif
+
+/* Move output from the pty to the clients with splice and tee, so that it
+** doesn't have to be copied through the master, if we can. */
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE) && defined(HAVE_PIPE2)
+#define USE_SPLICE
+#endif
+
+/* Read the pty in packet mode, so that the kernel tells us when the
+** program's output is stopped and started. */
+#if defined(TIOCPKT) && !defined(BROKEN_MASTER)
+#define USE_PACKET
+#endif
+
+/* Hand the pty to a client that has the session to itself, if we can.
+** Where the master holds the slave side open, the pty never says that the
+** program went away, so the client would never give it back. */
+#if defined(SCM_RIGHTS) && !defined(BROKEN_MASTER)
+#define USE_DIRECT
+#endif
+
+/* Static tracepoints for perf and bpftrace, if we have them. Each is a
+** single nop until something attaches to it. */
+#ifdef HAVE_SYS_SDT_H
+#define PROBE1(name, a) DTRACE_PROBE1(dtach, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(dtach, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(dtach, name, a, b, c)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+/* Compress with zlib, LZ4 and zstd, if we have them. */
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define USE_ZLIB
+#endif
+#if defined(HAVE_LZ4_H) && defined(HAVE_LIBLZ4)
+#define USE_LZ4
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD
+#endif
+
+/* Record the sessions from threads of their own, if we have threads. */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#define USE_RECORDING
+
+/* Recordings of the sessions' output, in dtrecord.c. */
+struct recorder;
+struct recorder *rec_open(const char *path, uint64_t limit, int compress,
+	uint64_t now);
+void rec_output(struct recorder *rec, const unsigned char *buf, size_t len,
+	uint64_t now);
+void rec_close(struct recorder *rec);
+void rec_stop(struct recorder *rec);
+void rec_totals(uint64_t *written, uint64_t *dropped, uint64_t *rotations);
+#endif
 #endif
@@ -43,6 +43,8 @@ int detach_char = '\\' - 64;
 int no_suspend;
 /* The default redraw method. Initially set to unspecified. */
 int redraw_method = REDRAW_UNSPEC;
+/* What the master should do if we fall behind. Initially unspecified. */
+int overflow_policy = OVERFLOW_UNSPEC;
 
 /* The original terminal settings, for restoring later. */
 struct termios orig_term;
@@ -54,12 +56,39 @@ struct termios orig_term;
 static struct termios cur_term;
 /* 1 if the window size changed */
 static int win_changed;
+/* The framing version the master agreed to, or 0 to send packets. */
+static int framed;
+/* 1 if we only watch, and never send the program any input. */
+static int observe;
+/* The session to attach to, if the master hosts more than one. */
+static char *session_name;
+/* 1 if we list the sessions instead of attaching, 2 if we print the
+** master's metrics, or 3 if we print its trace. */
+static int list;
+/* 1 if we ask for the output to be compressed, and the codec the master
+** picked. */
+static int want_compress, codec;
+/* Output frames that haven't all arrived yet, when the output is
+** compressed, or while we have the pty. */
+static unsigned char frames[FRAME_HDR + FRAME_MAX];
+static size_t frameslen;
+/* 1 if we ask for the pty to ourselves. */
+static int want_direct;
+/* 1 while the master sends us frames about the pty instead of output. */
+static int direct;
+/* The pty while we have it, and whether it is in packet mode. */
+static int ptyfd = -1, pty_packet;
+/* Input that the program hasn't taken yet, while we have the pty. */
+static unsigned char inq[BUFSIZE];
+static size_t inqlen;
 
 static void
 usage()
 {
 	printf(
 		"Usage: dtattach <socket> <options>\n"
+		"       dtattach <socket|directory> -l\n"
+		"       dtattach <socket> -m\n"
 		"Options:\n"
 		"  -e <char>\tSet the detach character to <char>. Defaults "
 		"to ^\\.\n"
@@ -69,7 +98,30 @@ usage()
 		"\t\t     none: Don't redraw at all.\n"
 		"\t\t   ctrl_l: Send a Ctrl L character to the program.\n"
 		"\t\t    winch: Send a WINCH signal to the program.\n"
+		"\t\t   screen: Have the master send the screen it keeps "
+		"track of.\n"
+		"  -q <policy>\tSet what the master does if we fall behind. "
+		"The valid\n"
+		"\t\t  policies are:\n"
+		"\t\t        block: Stop reading from the program.\n"
+		"\t\t         drop: Discard the backlog and redraw.\n"
+		"\t\t   disconnect: Disconnect.\n"
 		"  -z\t\tDisable processing of the suspend key.\n"
+		"  -O\t\tWatch the program without sending it any input.\n"
+		"  -Z\t\tHave the master compress the output, for slow "
+		"links.\n"
+		"  -x\t\tHave the pty to ourselves while nobody else is "
+		"attached,\n"
+		"\t\t  for the lowest latency.\n"
+		"  -s <name>\tAttach to the session called <name>, if the "
+		"master\n"
+		"\t\t  hosts more than one.\n"
+		"  -l\t\tList the sessions on the socket, or on every "
+		"socket in the\n"
+		"\t\t  directory, instead of attaching.\n"
+		"  -m\t\tPrint the master's metrics instead of attaching.\n"
+		"  -t\t\tPrint the master's recent events instead of "
+		"attaching.\n"
 		"\nReport any bugs to <%s>.\n", PACKAGE_BUGREPORT);
 }
 
@@ -80,37 +132,6 @@ restore_term(void)
 	tcsetattr(0, TCSADRAIN, &orig_term);
 }
 
-/* Connects to a unix domain socket */
-static int
-connect_socket(char *name)
-{
-	int s;
-	struct sockaddr_un sockun;
-
-	s = socket(PF_UNIX, SOCK_STREAM, 0);
-	if (s < 0)
-		return -1;
-	init_sockaddr_un(&sockun, name);
-	if (connect(s, (struct sockaddr*)&sockun, sizeof(sockun)) < 0)
-	{
-		close(s);
-
-		/* ECONNREFUSED is also returned for regular files, so make
-		** sure we are trying to connect to a socket. */
-		if (errno == ECONNREFUSED)
-		{
-			struct stat st;
-
-			if (stat(name, &st) < 0)
-				return -1;
-			else if (!S_ISSOCK(st.st_mode) || S_ISREG(st.st_mode))
-				errno = ENOTSOCK;
-		}
-		return -1;
-	}
-	return s;
-}
-
 /* Signal */
 static RETSIGTYPE
 die(int sig)
@@ -132,16 +153,203 @@ win_change()
 	win_changed = 1;
 }
 
+/* Sends a message to the master, as frames or packets depending on what it
+** understands. Data that doesn't fit in one is split up. */
+static void
+send_msg(int s, int type, int arg, const void *data, size_t len)
+{
+	unsigned char frame[FRAME_HDR + BUFSIZE];
+	const unsigned char *p = data;
+	struct packet pkt;
+	size_t n;
+
+	do
+	{
+		if (framed)
+		{
+			n = len;
+			if (n > BUFSIZE)
+				n = BUFSIZE;
+			frame[0] = type;
+			frame[1] = arg;
+			frame[2] = n >> 8;
+			frame[3] = n & 0xff;
+			memcpy(frame + FRAME_HDR, p, n);
+			write_all(s, frame, FRAME_HDR + n);
+		}
+		else
+		{
+			n = (len < sizeof(pkt.u.buf)) ? len : sizeof(pkt.u.buf);
+			memset(&pkt, 0, sizeof(struct packet));
+			pkt.type = type;
+			pkt.len = (type == MSG_PUSH) ? (int)n : arg;
+			memcpy(pkt.u.buf, p, n);
+			write_all(s, &pkt, sizeof(struct packet));
+		}
+		p += n;
+		len -= n;
+	} while (len > 0);
+}
+
+/* Writes the program's output to the terminal. */
+static void
+term_write(const unsigned char *buf, size_t len)
+{
+	PROBE1(term_write, len);
+	write(1, buf, len);
+}
+
+/* Sends a message carrying the current window size. */
+static void
+send_winsize(int s, int type, int arg)
+{
+	struct winsize ws;
+
+	memset(&ws, 0, sizeof(ws));
+	ioctl(0, TIOCGWINSZ, &ws);
+	send_msg(s, type, arg, &ws, sizeof(ws));
+}
+
+#ifdef USE_DIRECT
+/* Writes out as much of the input as the program will take. */
+static void
+flush_input(void)
+{
+	ssize_t n;
+
+	while (inqlen > 0)
+	{
+		n = write(ptyfd, inq, inqlen);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+			return;
+		/* The program is gone; reading the pty will notice. */
+		else if (n <= 0)
+		{
+			inqlen = 0;
+			return;
+		}
+		inqlen -= n;
+		memmove(inq, inq + n, inqlen);
+	}
+}
+
+/* Gives the pty back to the master with a message of the given type, along
+** with any input that the program hasn't taken yet. */
+static void
+release_pty(int s, int type)
+{
+	if (inqlen > 0)
+		send_msg(s, MSG_PUSH, 0, inq, inqlen);
+	inqlen = 0;
+	close(ptyfd);
+	ptyfd = -1;
+	send_msg(s, type, 0, NULL, 0);
+}
+
+/* Asks the master for the pty to ourselves, instead of attaching. Returns 0
+** if we have it, or -1 if we have to attach as usual. */
+static int
+request_direct(int s)
+{
+	unsigned char hdr[FRAME_HDR];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t n;
+	int fd;
+
+	send_msg(s, MSG_DIRECT, overflow_policy, NULL, 0);
+
+	/* Coming back from a suspend, the master may have asked for the pty
+	** before it knew that we gave it back. */
+	do
+	{
+		fd = -1;
+		iov.iov_base = hdr;
+		iov.iov_len = sizeof(hdr);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		do
+			n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+		while (n < 0 && errno == EINTR);
+		if (n <= 0)
+			break;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+			cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_RIGHTS)
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		if (read_all(s, hdr + n, sizeof(hdr) - n) < 0)
+			n = -1;
+	} while (n > 0 && hdr[0] == MSG_RELEASE && fd < 0);
+
+	direct = 0;
+	if (n <= 0 || hdr[0] != MSG_DIRECT || !(hdr[1] & DIRECT_OK) ||
+		hdr[2] != 0 || hdr[3] != 0 || fd < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	direct = 1;
+	ptyfd = fd;
+	pty_packet = (hdr[1] & DIRECT_PACKET) != 0;
+	return 0;
+}
+#endif
+
+/* Attaches to the session, with the pty to ourselves if we ask for it and
+** the master lets us have it. */
+static void
+attach_session(int s, int ask)
+{
+#ifdef USE_DIRECT
+	if (ask && request_direct(s) == 0)
+		return;
+#else
+	(void)ask;
+#endif
+	send_msg(s, MSG_ATTACH, overflow_policy, NULL, 0);
+}
+
 /* Handles input from the keyboard. */
 static void
-process_kbd(int s, struct packet *pkt)
+process_kbd(int s, unsigned char *buf, size_t len)
 {
+	PROBE1(kbd, len);
+
+	/* Observers only get to detach. */
+	if (observe)
+	{
+		if (buf[0] == detach_char)
+			attached = 0;
+		return;
+	}
+
 	/* Suspend? */
-	if (!no_suspend && (pkt->u.buf[0] == cur_term.c_cc[VSUSP]))
+	if (!no_suspend && (buf[0] == cur_term.c_cc[VSUSP]))
 	{
-		/* Tell the master that we are suspending. */
-		pkt->type = MSG_DETACH;
-		write(s, pkt, sizeof(struct packet));
+		int had_pty = (ptyfd >= 0);
+
+		/* Tell the master that we are suspending, giving it the pty
+		** back if we have it. */
+#ifdef USE_DIRECT
+		if (had_pty)
+			release_pty(s, MSG_DETACH);
+		else
+#endif
+			send_msg(s, MSG_DETACH, 0, NULL, 0);
 
 		/* And suspend... */
 		tcsetattr(0, TCSADRAIN, &orig_term);
@@ -149,35 +357,332 @@ process_kbd(int s, struct packet *pkt)
 		raise(SIGTSTP);
 		tcsetattr(0, TCSADRAIN, &cur_term);
 
-		/* Tell the master that we are returning. */
-		pkt->type = MSG_ATTACH;
-		write(s, pkt, sizeof(struct packet));
+		/* Tell the master that we are returning, and ask for the pty
+		** again if we had it. */
+		attach_session(s, had_pty);
 
 		/* We would like a redraw, too. */
-		pkt->type = MSG_REDRAW;
-		pkt->len = redraw_method;
-		ioctl(0, TIOCGWINSZ, &pkt->u.ws);
-		write(s, pkt, sizeof(struct packet));
+		send_winsize(s, MSG_REDRAW, redraw_method);
 		return;
 	}
 	/* Detach char? */
-	else if (pkt->u.buf[0] == detach_char)
+	else if (buf[0] == detach_char)
 	{
 		attached = 0;
 		return;
 	}
 	/* Just in case something pukes out. */
-	else if (pkt->u.buf[0] == '\f')
+	else if (buf[0] == '\f')
 		win_changed = 1;
 
-	/* Push it out */
-	write(s, pkt, sizeof(struct packet));
+	/* Push it out, straight to the program if we have the pty. This is
+	** only called once it has taken the input we had for it. */
+#ifdef USE_DIRECT
+	if (ptyfd >= 0)
+	{
+		memcpy(inq, buf, len);
+		inqlen = len;
+		flush_input();
+		return;
+	}
+#endif
+	send_msg(s, MSG_PUSH, 0, buf, len);
+}
+
+#ifdef USE_OBSERVERS
+/* Receives the answer to MSG_OBSERVE. Returns the ring's file descriptor,
+** or -1 if the master doesn't have one for us. */
+static int
+recv_observe(int s, struct observe_reply *reply)
+{
+	unsigned char hdr[FRAME_HDR];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t n;
+	int fd = -1;
+
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(hdr);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do
+		n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (read_all(s, hdr + n, sizeof(hdr) - n) < 0 ||
+		hdr[0] != MSG_OBSERVE || hdr[1] != 1 || fd < 0 ||
+		((hdr[2] << 8) | hdr[3]) != sizeof(*reply) ||
+		read_all(s, reply, sizeof(*reply)) < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Copies output from the ring to the terminal as it is published, starting
+** at tail. A reader that falls too far behind skips ahead, and says so. */
+static void
+follow_ring(struct obs_ring *r, uint64_t tail)
+{
+	static const char lost[] = "\r\n[output lost]\r\n";
+	const unsigned char *data = (const unsigned char *)r + OBS_DATA;
+	unsigned char buf[BUFSIZE];
+	uint64_t head;
+	uint32_t seq;
+	size_t n, off, first;
+
+	for (;;)
+	{
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			syscall(SYS_futex, &r->seq, FUTEX_WAIT, seq, NULL,
+				NULL, 0);
+			continue;
+		}
+
+		/* The master may be writing over anything within BUFSIZE
+		** of the oldest output. */
+		if (head - tail <= r->size - BUFSIZE)
+		{
+			n = head - tail;
+			if (n > sizeof(buf))
+				n = sizeof(buf);
+			off = tail % r->size;
+			first = r->size - off;
+			if (first > n)
+				first = n;
+			memcpy(buf, data + off, first);
+			memcpy(buf + first, data, n - first);
+
+			/* Make sure it wasn't written over as we copied it. */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			if (head - tail <= r->size - BUFSIZE)
+			{
+				if (write_all(1, buf, n) < 0)
+					return;
+				tail += n;
+				continue;
+			}
+		}
+
+		/* Pick up again with the newer half of the ring. */
+		if (write_all(1, lost, sizeof(lost) - 1) < 0)
+			return;
+		tail = head - r->size / 2;
+	}
 }
 
+/* Watches the program through the observer ring. A child copies the output
+** to the terminal, while we wait for the detach character or for the master
+** to go away. */
+static int
+observe_main(int s, int fd, struct observe_reply *reply)
+{
+	struct obs_ring *r;
+	unsigned char buf[BUFSIZE];
+	fd_set readfds;
+	sigset_t sigs;
+	size_t size, left;
+	ssize_t len;
+	pid_t pid;
+	int n, ret = 0;
+
+	/* Find out how big the ring is, then map all of it. */
+	r = mmap(NULL, OBS_DATA, PROT_READ, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED || r->magic != OBS_MAGIC)
+		return 1;
+	size = r->size;
+	munmap(r, OBS_DATA);
+	r = mmap(NULL, OBS_DATA + size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return 1;
+
+	/* The snapshot of the screen comes through the socket first. */
+	for (left = reply->snaplen; left > 0; left -= len)
+	{
+		len = read(s, buf, left < sizeof(buf) ? left : sizeof(buf));
+		if (len == 0)
+			return 3;
+		else if (len < 0)
+			return 1;
+		write_all(1, buf, len);
+	}
+
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	else if (pid == 0)
+	{
+#ifdef PR_SET_PDEATHSIG
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+		follow_ring(r, reply->start);
+		_exit(1);
+	}
+
+	sigemptyset(&sigs);
+	attached = 1;
+	while (attached)
+	{
+		FD_ZERO(&readfds);
+		FD_SET(0, &readfds);
+		FD_SET(s, &readfds);
+		n = pselect(s + 1, &readfds, NULL, NULL, NULL, &sigs);
+		if (n < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			ret = 1;
+			break;
+		}
+
+		/* The master shouldn't send anything else. */
+		if (n > 0 && FD_ISSET(s, &readfds))
+		{
+			len = read(s, buf, sizeof(buf));
+			if (len == 0)
+			{
+				ret = 3;
+				break;
+			}
+			else if (len < 0)
+			{
+				ret = 1;
+				break;
+			}
+		}
+		if (n > 0 && FD_ISSET(0, &readfds))
+		{
+			len = read(0, buf, sizeof(buf));
+			if (len <= 0)
+				break;
+			process_kbd(s, buf, len);
+		}
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return ret;
+}
+#endif
+
+/* Asks the master to compress the output. Returns the codec it picked,
+** or 0 if it won't. */
+static int
+request_compress(int s)
+{
+	unsigned char hdr[FRAME_HDR];
+
+	send_msg(s, MSG_COMPRESS, compress_codecs(), NULL, 0);
+	if (read_all(s, hdr, sizeof(hdr)) < 0 || hdr[0] != MSG_COMPRESS ||
+		hdr[2] != 0 || hdr[3] != 0)
+		return 0;
+	return hdr[1];
+}
+
+/* Sends the terminal the output in the frames that have arrived, keeping
+** any partial frame for later. Returns -1 if a frame is no good. */
+static int
+output_frames(void)
+{
+	unsigned char out[BUFSIZE], *f = frames;
+	size_t len;
+	ssize_t n;
+
+	while (frameslen - (f - frames) >= FRAME_HDR)
+	{
+		len = f[2] << 8 | f[3];
+		if (frameslen - (f - frames) < FRAME_HDR + len)
+			break;
+		if (f[0] != MSG_PUSH)
+			return -1;
+		if (f[1] == 0)
+			term_write(f + FRAME_HDR, len);
+		else
+		{
+			n = decompress_chunk(f[1], f + FRAME_HDR, len, out,
+				sizeof(out));
+			if (n < 0)
+				return -1;
+			term_write(out, n);
+		}
+		f += FRAME_HDR + len;
+	}
+	frameslen -= f - frames;
+	memmove(frames, f, frameslen);
+	return 0;
+}
+
+#ifdef USE_DIRECT
+/* Copies the program's output from the pty to the terminal. Once the
+** program has gone away, the pty goes back to the master, which will end
+** the session. */
+static void
+pty_output(int s)
+{
+	unsigned char buf[BUFSIZE];
+	ssize_t len;
+
+	len = read(ptyfd, buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	else if (len <= 0)
+	{
+		release_pty(s, MSG_RELEASE);
+		return;
+	}
+#ifdef USE_PACKET
+	/* In packet mode, only output goes to the terminal. */
+	if (pty_packet)
+	{
+		if (buf[0] == TIOCPKT_DATA)
+			term_write(buf + 1, len - 1);
+		return;
+	}
+#endif
+	term_write(buf, len);
+}
+
+/* Acts on a frame from the master while the pty is ours, which can only
+** be MSG_RELEASE. After that, the output comes through the socket. Returns
+** -1 if the frame is no good. */
+static int
+direct_frame(int s)
+{
+	frameslen = 0;
+	if (frames[0] != MSG_RELEASE || frames[2] != 0 || frames[3] != 0)
+		return -1;
+	if (ptyfd >= 0)
+		release_pty(s, MSG_RELEASE);
+	direct = 0;
+	return 0;
+}
+#endif
+
 static int
 attach_main()
 {
-	struct packet pkt;
 	unsigned char buf[BUFSIZE];
 	fd_set readfds;
 	int s;
@@ -239,37 +744,87 @@ attach_main()
 	cur_term.c_cc[VTIME] = 0;
 	tcsetattr(0, TCSADRAIN, &cur_term);
 
-	/* Tell the master that we want to attach. */
-	memset(&pkt, 0, sizeof(struct packet));
-	pkt.type = MSG_ATTACH;
-	write(s, &pkt, sizeof(struct packet));
+	/* Find out how to talk to the master. */
+	framed = negotiate(s);
 
-	/* We would like a redraw, too. */
-	pkt.type = MSG_REDRAW;
-	pkt.len = redraw_method;
-	ioctl(0, TIOCGWINSZ, &pkt.u.ws);
-	write(s, &pkt, sizeof(struct packet));
+	/* Pick the session, if we were given one. */
+	if (session_name)
+	{
+		if (framed < 3)
+		{
+			fprintf(stderr, "%s: %s: The master does not host "
+				"named sessions.\r\n", progname, sockname);
+			return 1;
+		}
+		if (request_session(s, 0, session_name,
+			strlen(session_name)) != SESSION_OK)
+		{
+			fprintf(stderr, "%s: %s: No session named '%s'.\r\n",
+				progname, sockname, session_name);
+			return 1;
+		}
+	}
+
+#ifdef USE_OBSERVERS
+	/* Follow the observer ring, if the master has one. */
+	if (observe && framed >= 2)
+	{
+		struct observe_reply reply;
+		int fd;
+
+		send_msg(s, MSG_OBSERVE, redraw_method, NULL, 0);
+		fd = recv_observe(s, &reply);
+		if (fd >= 0)
+			return observe_main(s, fd, &reply);
+	}
+#endif
+
+	/* Have the output compressed, if the master can. */
+	if (want_compress && framed >= 6)
+		codec = request_compress(s);
+
+	/* Tell the master that we want to attach, with the pty to ourselves
+	** if we would like that. */
+	attach_session(s, want_direct && framed >= 9 && !observe && !codec);
+
+	/* We would like a redraw, too. Observers leave the window size alone
+	** if the master lets them. */
+	if (observe && framed)
+		send_msg(s, MSG_REDRAW, redraw_method, NULL, 0);
+	else
+		send_winsize(s, MSG_REDRAW, redraw_method);
 
 	/* Wait for things to happen */
 	attached = 1;
 	while (attached)
 	{
-		int n;
+		fd_set writefds;
+		int n, highest_fd = s;
 
 		/* Window size changed? */
-		if (win_changed)
+		if (win_changed && !observe)
 		{
 			win_changed = 0;
-
-			pkt.type = MSG_WINCH;
-			ioctl(0, TIOCGWINSZ, &pkt.u.ws);
-			write(s, &pkt, sizeof(pkt));
+			send_winsize(s, MSG_WINCH, 0);
 		}
 
+		/* With the pty, leave the keyboard alone until the program has
+		** taken the input we have for it. */
 		FD_ZERO(&readfds);
-		FD_SET(0, &readfds);
+		FD_ZERO(&writefds);
+		if (inqlen == 0)
+			FD_SET(0, &readfds);
 		FD_SET(s, &readfds);
-		n = pselect(s + 1, &readfds, NULL, NULL, NULL, &sigs);
+		if (ptyfd >= 0)
+		{
+			FD_SET(ptyfd, &readfds);
+			if (inqlen > 0)
+				FD_SET(ptyfd, &writefds);
+			if (ptyfd > highest_fd)
+				highest_fd = ptyfd;
+		}
+		n = pselect(highest_fd + 1, &readfds, &writefds, NULL, NULL,
+			&sigs);
 		if (n < 0 && errno != EINTR && errno != EAGAIN)
 		{
 			fprintf(stderr, "select failed\r\n");
@@ -279,8 +834,18 @@ attach_main()
 		/* Pty activity */
 		if (n > 0 && FD_ISSET(s, &readfds))
 		{
-			ssize_t len = read(s, buf, sizeof(buf));
+			ssize_t len;
 
+			/* While the pty is ours, only frames come, and output
+			** follows the last one. */
+			if (direct)
+				len = read(s, frames + frameslen,
+					FRAME_HDR - frameslen);
+			else if (codec)
+				len = read(s, frames + frameslen,
+					sizeof(frames) - frameslen);
+			else
+				len = read(s, buf, sizeof(buf));
 			if (len == 0)
 				return 3;
 			else if (len < 0)
@@ -288,8 +853,35 @@ attach_main()
 				fprintf(stderr, "read returned an error\r\n");
 				return 1;
 			}
+#ifdef USE_DIRECT
+			if (direct)
+			{
+				frameslen += len;
+				if (frameslen == FRAME_HDR && direct_frame(s) < 0)
+				{
+					fprintf(stderr, "%s: The master sent "
+						"something unexpected.\r\n",
+						progname);
+					return 1;
+				}
+			}
+			else
+#endif
 			/* Send the data to the terminal. */
-			write(1, buf, len);
+			if (!codec)
+				term_write(buf, len);
+			else
+			{
+				frameslen += len;
+				if (output_frames() < 0)
+				{
+					fprintf(stderr, "%s: The master sent "
+						"output that could not be "
+						"decompressed.\r\n",
+						progname);
+					return 1;
+				}
+			}
 			n--;
 		}
 		/* stdin activity */
@@ -297,9 +889,9 @@ attach_main()
 		{
 			ssize_t len;
 
-			pkt.type = MSG_PUSH;
-			memset(pkt.u.buf, 0, sizeof(pkt.u.buf));
-			len = read(0, pkt.u.buf, sizeof(pkt.u.buf));
+			/* Without frames, only a packet's worth at a time. */
+			len = read(0, buf, framed ? sizeof(buf) :
+				sizeof(struct winsize));
 
 			/* Detach on EOF from stdin */
 			if (len == 0)
@@ -307,10 +899,16 @@ attach_main()
 			else if (len < 0)
 				return 1;
 
-			pkt.len = len;
-			process_kbd(s, &pkt);
+			process_kbd(s, buf, len);
 			n--;
 		}
+#ifdef USE_DIRECT
+		/* Straight from and to the program, while the pty is ours. */
+		if (n > 0 && ptyfd >= 0 && FD_ISSET(ptyfd, &writefds))
+			flush_input();
+		if (n > 0 && ptyfd >= 0 && FD_ISSET(ptyfd, &readfds))
+			pty_output(s);
+#endif
 	}
 	return 0;
 }
@@ -352,6 +950,18 @@ main(int argc, char **argv)
 		{
 			if (*p == 'z')
 				no_suspend = 1;
+			else if (*p == 'O')
+				observe = 1;
+			else if (*p == 'Z')
+				want_compress = 1;
+			else if (*p == 'x')
+				want_direct = 1;
+			else if (*p == 'l')
+				list = 1;
+			else if (*p == 'm')
+				list = 2;
+			else if (*p == 't')
+				list = 3;
 			else if (*p == 'e')
 			{
 				++argv; --argc;
@@ -396,6 +1006,8 @@ main(int argc, char **argv)
 					redraw_method = REDRAW_CTRL_L;
 				else if (strcmp(argv[0], "winch") == 0)
 					redraw_method = REDRAW_WINCH;
+				else if (strcmp(argv[0], "screen") == 0)
+					redraw_method = REDRAW_SCREEN;
 				else
 				{
 					fprintf(stderr, "%s: Invalid redraw "
@@ -408,6 +1020,51 @@ main(int argc, char **argv)
 				}
 				break;
 			}
+			else if (*p == 's')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No session name "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				session_name = argv[0];
+				break;
+			}
+			else if (*p == 'q')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No overflow policy "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "block") == 0)
+					overflow_policy = OVERFLOW_BLOCK;
+				else if (strcmp(argv[0], "drop") == 0)
+					overflow_policy = OVERFLOW_DROP;
+				else if (strcmp(argv[0], "disconnect") == 0)
+					overflow_policy = OVERFLOW_DISCONNECT;
+				else
+				{
+					fprintf(stderr, "%s: Invalid overflow "
+						"policy specified.\n",
+						progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
 			else if (*p == '?')
 			{
 				usage();
@@ -434,6 +1091,13 @@ main(int argc, char **argv)
 		return 1;
 	}
 
+	if (list == 1)
+		return list_main(sockname);
+	else if (list == 2)
+		return metrics_main(sockname);
+	else if (list == 3)
+		return trace_main(sockname);
+
 	/* Save the original terminal settings. */
 	if (tcgetattr(0, &orig_term) < 0)
 		memset(&orig_term, 0, sizeof(struct termios));
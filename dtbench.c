@@ -0,0 +1,1251 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+/*
+** A benchmark of the master's data path. It starts dtmaster on a generator,
+** attaches some number of headless clients that read everything they are
+** sent, and measures how fast the output goes through, how much CPU time
+** the master spends on it, and how long it takes to reach the clients.
+**
+** The generator is this program run with -g. It writes lines of filler,
+** and the first line of every write carries the time it was written, as
+** '@' and sixteen hex digits of microseconds on the monotonic clock. The
+** clients run on the same machine, so they can tell how long each of
+** those took to arrive. Output replayed from a file has no timestamps,
+** and so no latencies.
+**
+** With -k, it measures typing instead. A real dtattach is run on a pty,
+** keys are typed at it, and the time until each one is echoed back by the
+** session's own terminal is taken: idle, under a flood of output, and
+** with other clients attached, with and without the flood.
+**
+** With -C, it measures connection churn. Workers connect to the master over
+** and over, at a given rate, attach some of the time, detach some of the
+** time before hanging up, and time how long the master takes to answer the
+** hello of each new connection. The master's CPU time and memory are taken
+** before and after.
+*/
+
+/* argv[0] from the program */
+char *progname;
+/* The name of the socket the master is run on. */
+char *sockname;
+
+/* Latencies are kept in a histogram with LAT_SUB buckets for each power of
+** two, which is precise to within about six percent. */
+#define LAT_SUB 16
+#define LAT_BUCKETS (LAT_SUB * 48)
+
+/* What a client found out, sent back to us through a pipe. */
+struct result
+{
+	/* The output that arrived during the run. */
+	uint64_t bytes;
+	/* The latencies of the timestamps that arrived, in microseconds. */
+	uint64_t lat[LAT_BUCKETS];
+};
+
+/* What a churn worker found out. */
+struct churn_result
+{
+	/* The connections made, and those that failed. */
+	uint64_t conns, failed;
+	/* The longest and the spread of the times to answer the hello, in
+	** microseconds. */
+	uint64_t max;
+	uint64_t lat[LAT_BUCKETS];
+};
+
+/* The numbers of clients to try, by default. */
+static const int default_counts[] = {1, 4, 16, 64};
+
+static void
+usage()
+{
+	printf(
+		"Usage: dtbench <options>\n"
+		"Options:\n"
+		"  -m <path>\tThe dtmaster to benchmark. Defaults to "
+		"./dtmaster.\n"
+		"  -c <n,...>\tThe numbers of clients to try. Defaults to "
+		"1,4,16,64.\n"
+		"  -t <secs>\tHow long to measure each number of clients for. "
+		"Defaults\n"
+		"\t\t  to 5.\n"
+		"  -r <rate>\tLimit the output to <rate> bytes a second. The "
+		"rate may\n"
+		"\t\t  be followed by k or m. Unlimited by default.\n"
+		"  -f <file>\tReplay <file> over and over instead of "
+		"generating output.\n"
+		"  -q <policy>\tThe overflow policy of the clients. Defaults to "
+		"block.\n"
+		"  -a <arg>\tPass <arg> on to dtmaster. Can be given more "
+		"than once.\n"
+		"  -o <file>\tWrite the results to <file> as JSON, instead "
+		"of to\n"
+		"\t\t  standard output.\n"
+		"  -k\t\tMeasure keystroke latency instead of throughput.\n"
+		"  -d <path>\tThe dtattach to type at with -k. Defaults to "
+		"./dtattach.\n"
+		"  -n <n>\tThe number of other clients to attach with -k. "
+		"Defaults\n"
+		"\t\t  to 16.\n"
+		"  -K <rate>\tType about <rate> keys a second with -k. "
+		"Defaults to 20.\n"
+		"  -C\t\tMeasure connection churn instead of throughput.\n"
+		"  -w <n>\tThe number of workers connecting at once with -C. "
+		"Defaults\n"
+		"\t\t  to 4.\n"
+		"  -R <rate>\tMake about <rate> connections a second in all "
+		"with -C.\n"
+		"\t\t  As many as possible by default.\n"
+		"  -A <pct>\tAttach with <pct> percent of the connections with "
+		"-C.\n"
+		"\t\t  Defaults to 100.\n"
+		"  -D <pct>\tDetach before hanging up with <pct> percent of "
+		"those.\n"
+		"\t\t  Defaults to 50.\n"
+		"\nReport any bugs to <%s>.\n", PACKAGE_BUGREPORT);
+}
+
+/* The time in microseconds, from some fixed point. */
+static uint64_t
+now_usec(void)
+{
+	struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * (uint64_t)1000000 + tv.tv_usec;
+}
+
+/* Write a string out as a JSON string. */
+static void
+json_string(FILE *out, const char *str)
+{
+	putc('"', out);
+	for (; *str; ++str)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < ' ')
+			fprintf(out, "\\u%04x", *str);
+		else
+			putc(*str, out);
+	}
+	putc('"', out);
+}
+
+/* Sleep until a point in time. */
+static void
+sleep_until(uint64_t t)
+{
+	uint64_t now = now_usec();
+	struct timeval tv;
+
+	if (now >= t)
+		return;
+	tv.tv_sec = (t - now) / 1000000;
+	tv.tv_usec = (t - now) % 1000000;
+	select(0, NULL, NULL, NULL, &tv);
+}
+
+/* Parse a size with an optional k or m after it. */
+static int
+parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+	unsigned long n;
+
+	n = strtoul(str, &end, 10);
+	if (end == str)
+		return -1;
+	if (*end == 'k' || *end == 'K')
+		n *= 1024, ++end;
+	else if (*end == 'm' || *end == 'M')
+		n *= 1024 * 1024, ++end;
+	if (*end)
+		return -1;
+	*size = n;
+	return 0;
+}
+
+/* Which latency bucket a value goes in. */
+static int
+lat_bucket(uint64_t v)
+{
+	int e = 0;
+
+	if (v < 2 * LAT_SUB)
+		return v;
+	while ((v >> e) >= 2 * LAT_SUB)
+		e++;
+	if (LAT_SUB * (e + 1) >= LAT_BUCKETS)
+		return LAT_BUCKETS - 1;
+	return LAT_SUB * (e + 1) + (v >> e) - LAT_SUB;
+}
+
+/* The smallest value that goes in a latency bucket. */
+static uint64_t
+lat_value(int i)
+{
+	int e;
+
+	if (i < 2 * LAT_SUB)
+		return i;
+	e = i / LAT_SUB - 1;
+	return (uint64_t)(i % LAT_SUB + LAT_SUB) << e;
+}
+
+/* The latency that a fraction q of the samples are within. */
+static uint64_t
+lat_quantile(const uint64_t *lat, uint64_t total, double q)
+{
+	uint64_t n = 0, want = q * total;
+	int i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < LAT_BUCKETS; ++i)
+	{
+		n += lat[i];
+		if (n >= want)
+			return lat_value(i);
+	}
+	return lat_value(LAT_BUCKETS - 1);
+}
+
+/* Be the generator: write output at the given rate, or as fast as it will
+** go if the rate is 0, forever. With drain, whatever is typed is echoed
+** and thrown away, the way a shell's line editor would; with silent, it
+** is only that. */
+static int
+generator_main(uint64_t rate, char *file, int drain, int silent)
+{
+	unsigned char buf[BUFSIZE], *data = NULL;
+	size_t len = 0, off = 0, n;
+	uint64_t start, sent = 0;
+	struct termios term;
+	char stamp[20];
+	ssize_t got;
+	int fd, i;
+
+	if (drain || silent)
+	{
+		if (tcgetattr(0, &term) == 0)
+		{
+			term.c_lflag |= ICANON | ECHO;
+			term.c_iflag |= ICRNL;
+			tcsetattr(0, TCSANOW, &term);
+		}
+		if (silent || fork() == 0)
+		{
+			while (read(0, buf, sizeof(buf)) > 0)
+				;
+			_exit(0);
+		}
+	}
+	/* A file is replayed as it is. */
+	if (file)
+	{
+		fd = open(file, O_RDONLY);
+		if (fd < 0)
+			return 1;
+		while ((got = read(fd, buf, sizeof(buf))) > 0)
+		{
+			data = realloc(data, len + got);
+			if (!data)
+				return 1;
+			memcpy(data + len, buf, got);
+			len += got;
+		}
+		close(fd);
+		if (len == 0)
+			return 1;
+	}
+	/* Otherwise it's lines of filler. */
+	else
+	{
+		for (i = 0; i < (int)sizeof(buf); ++i)
+			buf[i] = (i % 64 == 63) ? '\n' : 'a' + i % 64 % 26;
+	}
+
+	start = now_usec();
+	for (;;)
+	{
+		if (file)
+		{
+			n = len - off < sizeof(buf) ? len - off : sizeof(buf);
+			memcpy(buf, data + off, n);
+			off = (off + n) % len;
+		}
+		else
+		{
+			n = sizeof(buf);
+			snprintf(stamp, sizeof(stamp), "@%016llx",
+				(unsigned long long)now_usec());
+			memcpy(buf, stamp, 17);
+		}
+		if (write_all(1, buf, n) < 0)
+			return 0;
+		sent += n;
+
+		if (rate > 0)
+			sleep_until(start + sent * 1000000 / rate);
+	}
+}
+
+/* Be a client: attach, and read everything until the end of the run,
+** counting what arrives between start and end. */
+static void
+client_main(int resfd, int policy, uint64_t start, uint64_t end)
+{
+	static struct result res;
+	unsigned char buf[65536];
+	struct packet pkt;
+	struct timeval tv;
+	fd_set readfds;
+	uint64_t now, stamp = 0;
+	int s, digits = -1, c;
+	ssize_t len, i;
+
+	s = connect_socket(sockname);
+	if (s < 0)
+		_exit(1);
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.type = MSG_ATTACH;
+	pkt.len = policy;
+	if (write_all(s, &pkt, sizeof(pkt)) < 0)
+		_exit(1);
+
+	memset(&res, 0, sizeof(res));
+	while ((now = now_usec()) < end)
+	{
+		FD_ZERO(&readfds);
+		FD_SET(s, &readfds);
+		tv.tv_sec = (end - now) / 1000000;
+		tv.tv_usec = (end - now) % 1000000;
+		if (select(s + 1, &readfds, NULL, NULL, &tv) <= 0)
+			continue;
+		len = read(s, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+		now = now_usec();
+		if (now < start)
+			continue;
+		res.bytes += len;
+
+		/* Pick out the timestamps, which can be split between
+		** reads. */
+		for (i = 0; i < len; ++i)
+		{
+			c = buf[i];
+			if (c == '@')
+			{
+				digits = 0;
+				stamp = 0;
+			}
+			else if (digits < 0)
+				continue;
+			else if (c >= '0' && c <= '9')
+				stamp = stamp << 4 | (c - '0'), digits++;
+			else if (c >= 'a' && c <= 'f')
+				stamp = stamp << 4 | (c - 'a' + 10), digits++;
+			else
+				digits = -1;
+
+			if (digits == 16)
+			{
+				res.lat[lat_bucket(now > stamp ?
+					now - stamp : 0)]++;
+				digits = -1;
+			}
+		}
+	}
+	write_all(resfd, &res, sizeof(res));
+	_exit(0);
+}
+
+/* How much CPU time a process has used, in seconds, or -1 if we can't
+** tell. */
+static double
+cpu_time(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	ssize_t len;
+	int fd, i;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+
+	/* The name of the program can have anything in it, so start after
+	** it. utime and stime are the 12th and 13th fields after that. */
+	p = strrchr(buf, ')');
+	for (i = 0; p && i < 12; ++i)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, "%lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Start the master on the generator, and wait for its socket. */
+static pid_t
+start_master(char **argv)
+{
+	pid_t pid;
+	int s, i;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	else if (pid == 0)
+	{
+		execvp(argv[0], argv);
+		fprintf(stderr, "%s: %s: %s\n", progname, argv[0],
+			strerror(errno));
+		_exit(127);
+	}
+
+	for (i = 0; i < 500; ++i)
+	{
+		s = connect_socket(sockname);
+		if (s >= 0)
+		{
+			close(s);
+			return pid;
+		}
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return -1;
+		sleep_until(now_usec() + 10000);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+/* Measure one number of clients, and write out what we found. */
+static int
+bench_run(char **master_argv, int nclients, int policy, uint64_t secs,
+	FILE *out, int first)
+{
+	static struct result res, total;
+	uint64_t start, end, min = 0, samples = 0;
+	double cpu0, cpu1, elapsed, mb, cpu;
+	pid_t master, *pids;
+	int *fds, fd[2], i, j, ok = 1;
+
+	unlink(sockname);
+	master = start_master(master_argv);
+	if (master < 0)
+	{
+		fprintf(stderr, "%s: Could not start the master.\n",
+			progname);
+		return -1;
+	}
+
+	/* Give the clients a second to get going before measuring. */
+	start = now_usec() + 1000000;
+	end = start + secs * 1000000;
+	pids = calloc(nclients, sizeof(pid_t));
+	fds = calloc(nclients, sizeof(int));
+	for (i = 0; pids && fds && i < nclients; ++i)
+	{
+		fds[i] = -1;
+		if (pipe(fd) < 0)
+			break;
+		pids[i] = fork();
+		if (pids[i] == 0)
+		{
+			close(fd[0]);
+			client_main(fd[1], policy, start, end);
+		}
+		close(fd[1]);
+		fds[i] = fd[0];
+		if (pids[i] < 0)
+			break;
+	}
+
+	sleep_until(start);
+	cpu0 = cpu_time(master);
+	sleep_until(end);
+	cpu1 = cpu_time(master);
+
+	/* Collect what the clients saw. */
+	memset(&total, 0, sizeof(total));
+	for (i = 0; pids && fds && i < nclients; ++i)
+	{
+		if (fds[i] < 0 || read_all(fds[i], &res, sizeof(res)) < 0)
+			ok = 0;
+		else
+		{
+			if (i == 0 || res.bytes < min)
+				min = res.bytes;
+			total.bytes += res.bytes;
+			for (j = 0; j < LAT_BUCKETS; ++j)
+				total.lat[j] += res.lat[j];
+		}
+		if (fds[i] >= 0)
+			close(fds[i]);
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	}
+	free(fds);
+	free(pids);
+	kill(master, SIGTERM);
+	waitpid(master, NULL, 0);
+	if (!ok || !pids || !fds)
+	{
+		fprintf(stderr, "%s: A client failed.\n", progname);
+		return -1;
+	}
+
+	/* The output through the master is what each client got, or what
+	** the slowest one did if they didn't all keep up. */
+	for (j = 0; j < LAT_BUCKETS; ++j)
+		samples += total.lat[j];
+	elapsed = secs;
+	mb = min / 1e6;
+	cpu = (cpu0 >= 0 && cpu1 >= 0) ? cpu1 - cpu0 : -1;
+
+	fprintf(out, "%s\n    {\"clients\": %d, \"seconds\": %.3f, "
+		"\"bytes\": %llu, \"mb_per_sec\": %.3f, "
+		"\"fanout_mb_per_sec\": %.3f, ", first ? "" : ",", nclients,
+		elapsed, (unsigned long long)min, mb / elapsed,
+		total.bytes / 1e6 / elapsed);
+	if (cpu >= 0 && mb > 0)
+		fprintf(out, "\"cpu_seconds\": %.3f, \"cpu_ms_per_mb\": %.3f, ",
+			cpu, cpu * 1000 / mb);
+	else
+		fprintf(out, "\"cpu_seconds\": null, \"cpu_ms_per_mb\": null, ");
+	fprintf(out, "\"latency_samples\": %llu, ",
+		(unsigned long long)samples);
+	if (samples > 0)
+		fprintf(out, "\"latency_us\": {\"p50\": %llu, \"p99\": %llu, "
+			"\"p999\": %llu}}",
+			(unsigned long long)lat_quantile(total.lat, samples, 0.5),
+			(unsigned long long)lat_quantile(total.lat, samples, 0.99),
+			(unsigned long long)lat_quantile(total.lat, samples,
+			0.999));
+	else
+		fprintf(out, "\"latency_us\": null}");
+
+	fprintf(stderr, "%4d clients: %9.2f MB/s, %9.2f MB/s fanout, ",
+		nclients, mb / elapsed, total.bytes / 1e6 / elapsed);
+	if (cpu >= 0 && mb > 0)
+		fprintf(stderr, "%7.2f ms CPU/MB", cpu * 1000 / mb);
+	if (samples > 0)
+		fprintf(stderr, ", latency p50 %lluus p99 %lluus p999 %lluus",
+			(unsigned long long)lat_quantile(total.lat, samples, 0.5),
+			(unsigned long long)lat_quantile(total.lat, samples, 0.99),
+			(unsigned long long)lat_quantile(total.lat, samples,
+			0.999));
+	fprintf(stderr, "\n");
+	return 0;
+}
+
+/* How much memory a process has resident, in kilobytes, or -1 if we can't
+** tell. */
+static long
+rss_kb(pid_t pid)
+{
+	char path[64], line[256];
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+/* Be a churn worker: connect, attach and detach over and over at the given
+** rate until the end of the run, counting the connections made between
+** start and end. */
+static void
+churn_main(int resfd, uint64_t rate, int attach_pct, int detach_pct,
+	uint64_t start, uint64_t end)
+{
+	static struct churn_result res;
+	unsigned char hdr[FRAME_HDR];
+	uint64_t now, t, n = 0;
+	int s;
+
+	memset(&res, 0, sizeof(res));
+	srand(getpid());
+	while ((now = now_usec()) < end)
+	{
+		if (rate > 0)
+			sleep_until(start + n++ * 1000000 / rate);
+
+		/* The hello is answered once the master has accepted us and
+		** looked at what we sent. */
+		t = now_usec();
+		s = connect_socket(sockname);
+		if (s >= 0 && negotiate(s) > 0)
+		{
+			now = now_usec();
+			if (now >= start && now < end)
+			{
+				res.conns++;
+				res.lat[lat_bucket(now - t)]++;
+				if (now - t > res.max)
+					res.max = now - t;
+			}
+			if (rand() % 100 < attach_pct)
+			{
+				hdr[0] = MSG_ATTACH;
+				hdr[1] = OVERFLOW_DROP;
+				hdr[2] = hdr[3] = 0;
+				write_all(s, hdr, sizeof(hdr));
+				if (rand() % 100 < detach_pct)
+				{
+					hdr[0] = MSG_DETACH;
+					hdr[1] = 0;
+					write_all(s, hdr, sizeof(hdr));
+				}
+			}
+		}
+		else if (t >= start)
+			res.failed++;
+		if (s >= 0)
+			close(s);
+	}
+	write_all(resfd, &res, sizeof(res));
+	_exit(0);
+}
+
+/* Churn connections to the master for a while with some number of workers,
+** and write out what we found. */
+static int
+churn_run(char **master_argv, int nworkers, uint64_t rate, int attach_pct,
+	int detach_pct, uint64_t secs, FILE *out)
+{
+	static struct churn_result res, total;
+	uint64_t start, end;
+	double cpu0, cpu1, cpu;
+	long rss0, rss1;
+	pid_t master, *pids;
+	int *fds, fd[2], i, j, ok = 1;
+
+	unlink(sockname);
+	master = start_master(master_argv);
+	if (master < 0)
+	{
+		fprintf(stderr, "%s: Could not start the master.\n",
+			progname);
+		return -1;
+	}
+
+	start = now_usec() + 1000000;
+	end = start + secs * 1000000;
+	pids = calloc(nworkers, sizeof(pid_t));
+	fds = calloc(nworkers, sizeof(int));
+	for (i = 0; pids && fds && i < nworkers; ++i)
+	{
+		fds[i] = -1;
+		if (pipe(fd) < 0)
+			break;
+		pids[i] = fork();
+		if (pids[i] == 0)
+		{
+			close(fd[0]);
+			churn_main(fd[1], rate / nworkers, attach_pct,
+				detach_pct, start, end);
+		}
+		close(fd[1]);
+		fds[i] = fd[0];
+		if (pids[i] < 0)
+			break;
+	}
+
+	sleep_until(start);
+	cpu0 = cpu_time(master);
+	rss0 = rss_kb(master);
+	sleep_until(end);
+	cpu1 = cpu_time(master);
+	rss1 = rss_kb(master);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; pids && fds && i < nworkers; ++i)
+	{
+		if (fds[i] < 0 || read_all(fds[i], &res, sizeof(res)) < 0)
+			ok = 0;
+		else
+		{
+			total.conns += res.conns;
+			total.failed += res.failed;
+			if (res.max > total.max)
+				total.max = res.max;
+			for (j = 0; j < LAT_BUCKETS; ++j)
+				total.lat[j] += res.lat[j];
+		}
+		if (fds[i] >= 0)
+			close(fds[i]);
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	}
+	free(fds);
+	free(pids);
+	kill(master, SIGTERM);
+	waitpid(master, NULL, 0);
+	if (!ok || !pids || !fds)
+	{
+		fprintf(stderr, "%s: A worker failed.\n", progname);
+		return -1;
+	}
+	cpu = (cpu0 >= 0 && cpu1 >= 0) ? cpu1 - cpu0 : -1;
+
+	fprintf(out, "\n    {\"workers\": %d, \"seconds\": %llu, "
+		"\"connections\": %llu, \"failed\": %llu, "
+		"\"per_sec\": %.1f, ", nworkers, (unsigned long long)secs,
+		(unsigned long long)total.conns,
+		(unsigned long long)total.failed, (double)total.conns / secs);
+	if (cpu >= 0 && total.conns > 0)
+		fprintf(out, "\"cpu_seconds\": %.3f, "
+			"\"cpu_us_per_connection\": %.2f, ", cpu,
+			cpu * 1e6 / total.conns);
+	else
+		fprintf(out, "\"cpu_seconds\": null, "
+			"\"cpu_us_per_connection\": null, ");
+	if (rss0 >= 0 && rss1 >= 0)
+		fprintf(out, "\"rss_kb\": {\"start\": %ld, \"end\": %ld}, ",
+			rss0, rss1);
+	else
+		fprintf(out, "\"rss_kb\": null, ");
+	if (total.conns > 0)
+		fprintf(out, "\"accept_latency_us\": {\"p50\": %llu, "
+			"\"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+			(unsigned long long)lat_quantile(total.lat,
+			total.conns, 0.5),
+			(unsigned long long)lat_quantile(total.lat,
+			total.conns, 0.99),
+			(unsigned long long)lat_quantile(total.lat,
+			total.conns, 0.999),
+			(unsigned long long)total.max);
+	else
+		fprintf(out, "\"accept_latency_us\": null}");
+
+	fprintf(stderr, "%4d workers: %9.1f connections/s, %llu failed",
+		nworkers, (double)total.conns / secs,
+		(unsigned long long)total.failed);
+	if (cpu >= 0 && total.conns > 0)
+		fprintf(stderr, ", %7.2f us CPU/connection",
+			cpu * 1e6 / total.conns);
+	if (rss0 >= 0 && rss1 >= 0)
+		fprintf(stderr, ", RSS %ldk -> %ldk", rss0, rss1);
+	if (total.conns > 0)
+		fprintf(stderr, ", accept p50 %lluus p99 %lluus max %lluus",
+			(unsigned long long)lat_quantile(total.lat,
+			total.conns, 0.5),
+			(unsigned long long)lat_quantile(total.lat,
+			total.conns, 0.99),
+			(unsigned long long)total.max);
+	fprintf(stderr, "\n");
+	return 0;
+}
+
+#ifdef HAVE_FORKPTY
+/* How many keys can be waiting for their echoes at once. */
+#define KEYS_PENDING 64
+
+/* Type at a dtattach through a pty for a while, at about keyrate keys a
+** second, with other clients attached, and time how long each key takes
+** to be echoed back. The keys are capital letters, which the generator
+** never writes, with a return now and then to keep the line short. */
+static int
+keys_run(char **master_argv, char *attach, char *policy_name, int policy,
+	const char *name, int nothers, uint64_t secs, uint64_t keyrate,
+	FILE *out, int first)
+{
+	static uint64_t lat[LAT_BUCKETS];
+	struct
+	{
+		int c;
+		uint64_t t;
+	} pending[KEYS_PENDING];
+	unsigned char buf[65536], c;
+	uint64_t now, start, end, next, wait, v, max = 0, samples = 0;
+	uint64_t typed = 0, lost = 0;
+	int head = 0, npending = 0, fd, null, i, j, k, ok = 1;
+	pid_t master, child, *pids;
+	struct winsize ws;
+	struct timeval tv;
+	fd_set readfds;
+	ssize_t len;
+
+	unlink(sockname);
+	master = start_master(master_argv);
+	if (master < 0)
+	{
+		fprintf(stderr, "%s: Could not start the master.\n",
+			progname);
+		return -1;
+	}
+
+	/* The others read everything until a little after the typing
+	** stops. What they saw doesn't matter here. */
+	start = now_usec() + 1000000;
+	end = start + secs * 1000000;
+	null = open("/dev/null", O_WRONLY);
+	pids = calloc(nothers + 1, sizeof(pid_t));
+	for (i = 0; null >= 0 && pids && i < nothers; ++i)
+	{
+		pids[i] = fork();
+		if (pids[i] == 0)
+			client_main(null, policy, start, end + 1000000);
+		else if (pids[i] < 0)
+			break;
+	}
+
+	/* dtattach puts its terminal in raw mode itself, by the time it has
+	** attached. */
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_row = 24;
+	ws.ws_col = 80;
+	child = forkpty(&fd, NULL, NULL, &ws);
+	if (child == 0)
+	{
+		execl(attach, attach, sockname, "-q", policy_name,
+			(char *)NULL);
+		fprintf(stderr, "%s: %s: %s\r\n", progname, attach,
+			strerror(errno));
+		_exit(127);
+	}
+
+	memset(lat, 0, sizeof(lat));
+	next = start;
+	while (child > 0 && (now = now_usec()) < end + 1000000)
+	{
+		if (now >= next && now < end)
+		{
+			c = (typed % 40 == 39) ? '\r' : 'A' + typed % 26;
+			if (write(fd, &c, 1) == 1 && c != '\r')
+			{
+				if (npending == KEYS_PENDING)
+				{
+					lost++;
+					head = (head + 1) % KEYS_PENDING;
+					npending--;
+				}
+				k = (head + npending++) % KEYS_PENDING;
+				pending[k].c = c;
+				pending[k].t = now;
+			}
+			typed++;
+
+			/* People don't type like a metronome. */
+			next = now + 1000000 / keyrate * (50 + rand() % 101) /
+				100;
+			continue;
+		}
+		if (now >= end && npending == 0)
+			break;
+
+		wait = (now < end ? next : end + 1000000) - now;
+		FD_ZERO(&readfds);
+		FD_SET(fd, &readfds);
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+		if (select(fd + 1, &readfds, NULL, NULL, &tv) <= 0)
+			continue;
+		len = read(fd, buf, sizeof(buf));
+		if (len <= 0)
+		{
+			ok = 0;
+			break;
+		}
+
+		/* Match the echoes up with the keys, oldest first. A key
+		** that is skipped over was lost. */
+		now = now_usec();
+		for (i = 0; i < len; ++i)
+		{
+			if (buf[i] < 'A' || buf[i] > 'Z')
+				continue;
+			for (j = 0; j < npending; ++j)
+			{
+				if (pending[(head + j) % KEYS_PENDING].c ==
+					buf[i])
+					break;
+			}
+			if (j == npending)
+				continue;
+			k = (head + j) % KEYS_PENDING;
+			v = now - pending[k].t;
+			lat[lat_bucket(v)]++;
+			samples++;
+			if (v > max)
+				max = v;
+			lost += j;
+			head = (k + 1) % KEYS_PENDING;
+			npending -= j + 1;
+		}
+	}
+	lost += npending;
+
+	if (child > 0)
+	{
+		kill(child, SIGTERM);
+		close(fd);
+		waitpid(child, NULL, 0);
+	}
+	for (i = 0; pids && i < nothers; ++i)
+	{
+		if (pids[i] <= 0)
+			break;
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+	}
+	free(pids);
+	if (null >= 0)
+		close(null);
+	kill(master, SIGTERM);
+	waitpid(master, NULL, 0);
+	if (child < 0 || !ok)
+	{
+		fprintf(stderr, "%s: The attaching process failed.\n",
+			progname);
+		return -1;
+	}
+
+	fprintf(out, "%s\n    {\"scenario\": \"%s\", \"others\": %d, "
+		"\"seconds\": %llu, \"keys\": %llu, \"lost\": %llu, ",
+		first ? "" : ",", name, nothers, (unsigned long long)secs,
+		(unsigned long long)(samples + lost),
+		(unsigned long long)lost);
+	if (samples > 0)
+		fprintf(out, "\"latency_us\": {\"p50\": %llu, \"p90\": %llu, "
+			"\"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+			(unsigned long long)lat_quantile(lat, samples, 0.5),
+			(unsigned long long)lat_quantile(lat, samples, 0.9),
+			(unsigned long long)lat_quantile(lat, samples, 0.99),
+			(unsigned long long)lat_quantile(lat, samples, 0.999),
+			(unsigned long long)max);
+	else
+		fprintf(out, "\"latency_us\": null}");
+
+	fprintf(stderr, "%-14s %6llu keys, %4llu lost", name,
+		(unsigned long long)(samples + lost),
+		(unsigned long long)lost);
+	if (samples > 0)
+		fprintf(stderr, ", latency p50 %lluus p90 %lluus p99 %lluus "
+			"max %lluus",
+			(unsigned long long)lat_quantile(lat, samples, 0.5),
+			(unsigned long long)lat_quantile(lat, samples, 0.9),
+			(unsigned long long)lat_quantile(lat, samples, 0.99),
+			(unsigned long long)max);
+	fprintf(stderr, "\n");
+	return 0;
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+	char *master = "./dtmaster", *file = NULL, *outname = NULL;
+	char *policy_name = "block", dir[] = "/tmp/dtbench.XXXXXX";
+	char *attach = "./dtattach", rate_arg[32], **master_argv;
+	char **quiet_argv, **extra, *p;
+	int counts[64], ncounts = 0, policy = OVERFLOW_BLOCK;
+	int nextra = 0, generate = 0, drain = 0, silent = 0, keys = 0;
+	int nothers = 16, churn = 0, nworkers = 4, attach_pct = 100;
+	int detach_pct = 50, gen, i, n, ret = 0;
+	uint64_t rate = 0, secs = 5, keyrate = 20, connrate = 0;
+	FILE *out = stdout;
+
+	progname = argv[0];
+	master_argv = calloc(argc + 16, sizeof(char *));
+	quiet_argv = calloc(argc + 16, sizeof(char *));
+	extra = calloc(argc, sizeof(char *));
+	if (!master_argv || !quiet_argv || !extra)
+		return 1;
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (argv[i][0] != '-' || !argv[i][1] || argv[i][2])
+			goto invalid;
+		if (argv[i][1] == 'g')
+		{
+			generate = 1;
+			continue;
+		}
+		else if (argv[i][1] == 'i')
+		{
+			drain = 1;
+			continue;
+		}
+		else if (argv[i][1] == 's')
+		{
+			silent = 1;
+			continue;
+		}
+		else if (argv[i][1] == 'k')
+		{
+			keys = 1;
+			continue;
+		}
+		else if (argv[i][1] == 'C')
+		{
+			churn = 1;
+			continue;
+		}
+		else if (argv[i][1] == '?' || argv[i][1] == 'h')
+		{
+			usage();
+			return 0;
+		}
+		if (i + 1 >= argc)
+			goto invalid;
+
+		p = argv[++i];
+		switch (argv[i - 1][1])
+		{
+		case 'm':
+			master = p;
+			break;
+		case 'f':
+			file = p;
+			break;
+		case 'o':
+			outname = p;
+			break;
+		case 'd':
+			attach = p;
+			break;
+		case 'n':
+			nothers = strtol(p, &p, 10);
+			if (*p || nothers < 0)
+				goto invalid;
+			break;
+		case 'K':
+			keyrate = strtoul(p, &p, 10);
+			if (*p || keyrate == 0)
+				goto invalid;
+			break;
+		case 'w':
+			nworkers = strtol(p, &p, 10);
+			if (*p || nworkers <= 0)
+				goto invalid;
+			break;
+		case 'R':
+			connrate = strtoul(p, &p, 10);
+			if (*p)
+				goto invalid;
+			break;
+		case 'A':
+			attach_pct = strtol(p, &p, 10);
+			if (*p || attach_pct < 0 || attach_pct > 100)
+				goto invalid;
+			break;
+		case 'D':
+			detach_pct = strtol(p, &p, 10);
+			if (*p || detach_pct < 0 || detach_pct > 100)
+				goto invalid;
+			break;
+		case 'a':
+			extra[nextra++] = p;
+			break;
+		case 'r':
+			if (parse_size(p, &rate) < 0)
+				goto invalid;
+			break;
+		case 't':
+			secs = strtoul(p, &p, 10);
+			if (*p || secs == 0)
+				goto invalid;
+			break;
+		case 'q':
+			policy_name = p;
+			if (strcmp(p, "block") == 0)
+				policy = OVERFLOW_BLOCK;
+			else if (strcmp(p, "drop") == 0)
+				policy = OVERFLOW_DROP;
+			else if (strcmp(p, "disconnect") == 0)
+				policy = OVERFLOW_DISCONNECT;
+			else
+				goto invalid;
+			break;
+		case 'c':
+			for (; *p && ncounts < 64; p += *p == ',')
+			{
+				n = strtol(p, &p, 10);
+				if (n <= 0 || (*p && *p != ','))
+					goto invalid;
+				counts[ncounts++] = n;
+			}
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	if (generate)
+		return generator_main(rate, file, drain, silent);
+#ifndef HAVE_FORKPTY
+	if (keys && !churn)
+	{
+		fprintf(stderr, "%s: Keystroke latency can't be measured "
+			"without forkpty.\n", progname);
+		return 1;
+	}
+#endif
+
+	if (ncounts == 0)
+	{
+		for (i = 0; i < (int)(sizeof(default_counts) /
+			sizeof(default_counts[0])); ++i)
+			counts[ncounts++] = default_counts[i];
+	}
+
+	if (!mkdtemp(dir))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, dir,
+			strerror(errno));
+		return 1;
+	}
+	sockname = malloc(sizeof(dir) + sizeof("/sock"));
+	if (!sockname)
+		return 1;
+	sprintf(sockname, "%s/sock", dir);
+	if (outname && !(out = fopen(outname, "w")))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, outname,
+			strerror(errno));
+		rmdir(dir);
+		return 1;
+	}
+
+	/* Run the master in the foreground, so that we can tell how much CPU
+	** time it uses, on this program as the generator. */
+	n = 0;
+	master_argv[n++] = master;
+	master_argv[n++] = sockname;
+	master_argv[n++] = "-n";
+	master_argv[n++] = "-q";
+	master_argv[n++] = policy_name;
+	for (i = 0; i < nextra; ++i)
+		master_argv[n++] = extra[i];
+	master_argv[n++] = argv[0];
+	master_argv[n++] = "-g";
+	if (keys)
+		master_argv[n++] = "-i";
+	gen = n;
+	if (rate > 0)
+	{
+		snprintf(rate_arg, sizeof(rate_arg), "%llu",
+			(unsigned long long)rate);
+		master_argv[n++] = "-r";
+		master_argv[n++] = rate_arg;
+	}
+	if (file)
+	{
+		master_argv[n++] = "-f";
+		master_argv[n++] = file;
+	}
+	master_argv[n] = NULL;
+
+	/* Typing is also measured with a generator that writes nothing. */
+	memcpy(quiet_argv, master_argv, gen * sizeof(char *));
+	quiet_argv[gen] = "-s";
+	quiet_argv[gen + 1] = NULL;
+
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(out, "{\n  \"version\": \"%s\", \"mode\": \"%s\", "
+		"\"master\": ", PACKAGE_VERSION, churn ? "churn" :
+		keys ? "keys" : "throughput");
+	json_string(out, master);
+	if (churn)
+		fprintf(out, ", \"connection_rate\": %llu, \"attach_pct\": %d, "
+			"\"detach_pct\": %d", (unsigned long long)connrate,
+			attach_pct, detach_pct);
+	else if (keys)
+	{
+		fprintf(out, ", \"attach\": ");
+		json_string(out, attach);
+		fprintf(out, ", \"key_rate\": %llu",
+			(unsigned long long)keyrate);
+	}
+	fprintf(out, ", \"source\": ");
+	json_string(out, file ? file : "generator");
+	fprintf(out, ", \"rate\": %llu, \"policy\": \"%s\", \"extra\": [",
+		(unsigned long long)rate, policy_name);
+	for (i = 0; i < nextra; ++i)
+	{
+		if (i > 0)
+			fprintf(out, ", ");
+		json_string(out, extra[i]);
+	}
+	fprintf(out, "],\n  \"runs\": [");
+	if (churn && churn_run(quiet_argv, nworkers, connrate, attach_pct,
+		detach_pct, secs, out) < 0)
+		ret = 1;
+#ifdef HAVE_FORKPTY
+	if (keys && !churn)
+	{
+		if (keys_run(quiet_argv, attach, policy_name, policy, "idle",
+			0, secs, keyrate, out, 1) < 0 ||
+			keys_run(master_argv, attach, policy_name, policy,
+			"flood", 0, secs, keyrate, out, 0) < 0 ||
+			keys_run(quiet_argv, attach, policy_name, policy,
+			"clients", nothers, secs, keyrate, out, 0) < 0 ||
+			keys_run(master_argv, attach, policy_name, policy,
+			"flood+clients", nothers, secs, keyrate, out, 0) < 0)
+			ret = 1;
+	}
+#endif
+	for (i = 0; !keys && !churn && i < ncounts; ++i)
+	{
+		if (bench_run(master_argv, counts[i], policy, secs, out,
+			i == 0) < 0)
+		{
+			ret = 1;
+			break;
+		}
+	}
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	unlink(sockname);
+	rmdir(dir);
+	return ret;
+
+invalid:
+	fprintf(stderr, "%s: Invalid arguments.\n", progname);
+	fprintf(stderr, "Try '%s -?' for more information.\n", progname);
+	return 1;
+}
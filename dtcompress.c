@@ -0,0 +1,187 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+/*
+** Compression of the output for clients that ask for it. Each chunk of
+** output is compressed on its own, so the master can send the same
+** compressed chunk to every client using that codec, however long they have
+** been attached, and a client that has output dropped can still make sense
+** of what comes after. The codecs are all run at their fastest setting,
+** since the point is to keep up with the program.
+*/
+
+#ifdef USE_ZLIB
+/* The zlib streams are reset for each chunk, rather than set up again. */
+static z_stream deflater, inflater;
+static int have_deflater, have_inflater;
+#endif
+
+#ifdef USE_ZSTD
+static ZSTD_CCtx *zstd_cctx;
+static ZSTD_DCtx *zstd_dctx;
+#endif
+
+/* The codecs this program can use, as a mask of COMPRESS_* bits. */
+int
+compress_codecs(void)
+{
+	int codecs = 0;
+
+#ifdef USE_ZLIB
+	codecs |= COMPRESS_ZLIB;
+#endif
+#ifdef USE_LZ4
+	codecs |= COMPRESS_LZ4;
+#endif
+#ifdef USE_ZSTD
+	codecs |= COMPRESS_ZSTD;
+#endif
+	return codecs;
+}
+
+/* Pick the codec to use out of those the other side can use, or 0 if
+** there are none in common. */
+int
+compress_pick(int codecs)
+{
+	codecs &= compress_codecs();
+	if (codecs & COMPRESS_ZSTD)
+		return COMPRESS_ZSTD;
+	else if (codecs & COMPRESS_LZ4)
+		return COMPRESS_LZ4;
+	else if (codecs & COMPRESS_ZLIB)
+		return COMPRESS_ZLIB;
+	return 0;
+}
+
+/* Compresses a chunk into a buffer of size bytes. Returns the compressed
+** length, or 0 if it didn't fit or something went wrong. */
+size_t
+compress_chunk(int codec, const unsigned char *in, size_t len,
+	unsigned char *out, size_t size)
+{
+	if (size == 0)
+		return 0;
+
+#ifdef USE_ZLIB
+	if (codec == COMPRESS_ZLIB)
+	{
+		if (!have_deflater)
+		{
+			/* Raw deflate, without the zlib header and checksum.
+			** The frame already says how long it is. */
+			if (deflateInit2(&deflater, 1, Z_DEFLATED, -15, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+				return 0;
+			have_deflater = 1;
+		}
+		else if (deflateReset(&deflater) != Z_OK)
+			return 0;
+		deflater.next_in = (Bytef *)in;
+		deflater.avail_in = len;
+		deflater.next_out = out;
+		deflater.avail_out = size;
+		if (deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+			return 0;
+		return size - deflater.avail_out;
+	}
+#endif
+#ifdef USE_LZ4
+	if (codec == COMPRESS_LZ4)
+	{
+		int n;
+
+		n = LZ4_compress_default((const char *)in, (char *)out,
+			len, size);
+		return n > 0 ? (size_t)n : 0;
+	}
+#endif
+#ifdef USE_ZSTD
+	if (codec == COMPRESS_ZSTD)
+	{
+		size_t n;
+
+		if (!zstd_cctx && !(zstd_cctx = ZSTD_createCCtx()))
+			return 0;
+		n = ZSTD_compressCCtx(zstd_cctx, out, size, in, len, 1);
+		return ZSTD_isError(n) ? 0 : n;
+	}
+#endif
+	(void)codec;
+	(void)in;
+	(void)len;
+	(void)out;
+	return 0;
+}
+
+/* Decompresses a chunk into a buffer of size bytes. Returns the length of
+** the output, or -1 if the chunk is no good. */
+ssize_t
+decompress_chunk(int codec, const unsigned char *in, size_t len,
+	unsigned char *out, size_t size)
+{
+#ifdef USE_ZLIB
+	if (codec == COMPRESS_ZLIB)
+	{
+		if (!have_inflater)
+		{
+			if (inflateInit2(&inflater, -15) != Z_OK)
+				return -1;
+			have_inflater = 1;
+		}
+		else if (inflateReset(&inflater) != Z_OK)
+			return -1;
+		inflater.next_in = (Bytef *)in;
+		inflater.avail_in = len;
+		inflater.next_out = out;
+		inflater.avail_out = size;
+		if (inflate(&inflater, Z_FINISH) != Z_STREAM_END)
+			return -1;
+		return size - inflater.avail_out;
+	}
+#endif
+#ifdef USE_LZ4
+	if (codec == COMPRESS_LZ4)
+	{
+		int n;
+
+		n = LZ4_decompress_safe((const char *)in, (char *)out, len,
+			size);
+		return n >= 0 ? n : -1;
+	}
+#endif
+#ifdef USE_ZSTD
+	if (codec == COMPRESS_ZSTD)
+	{
+		size_t n;
+
+		if (!zstd_dctx && !(zstd_dctx = ZSTD_createDCtx()))
+			return -1;
+		n = ZSTD_decompressDCtx(zstd_dctx, out, size, in, len);
+		return ZSTD_isError(n) ? -1 : (ssize_t)n;
+	}
+#endif
+	(void)codec;
+	(void)in;
+	(void)len;
+	(void)out;
+	(void)size;
+	return -1;
+}
@@ -0,0 +1,552 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+/*
+** The dtach command. It works out what the mode calls for, and runs
+** dtmaster and dtattach with the options meant for each of them.
+*/
+
+const char copyright[] =
+	"dtach - version " PACKAGE_VERSION ", compiled on " BUILD_DATE ".\n"
+	" (C) Copyright 2004-2014 Ned T. Crigler, modified by Devin J. Pohly\n";
+
+/* argv[0] from the program */
+char *progname;
+/* The name of the passed in socket. */
+char *sockname;
+
+/* Which programs an option is passed on to. */
+#define TO_MASTER 1
+#define TO_ATTACH 2
+
+/* The options that are passed on as they are, and what their argument is
+** called, if they take one. */
+static const struct passopt
+{
+	char *name;
+	int to;
+	const char *arg;
+} passopts[] = {
+	{ "-e", TO_ATTACH, "escape character" },
+	{ "-r", TO_MASTER|TO_ATTACH, "redraw method" },
+	{ "-q", TO_MASTER|TO_ATTACH, "overflow policy" },
+	{ "-Q", TO_MASTER, "queue size" },
+	{ "-R", TO_MASTER, "replay size" },
+	{ "-o", TO_MASTER, "ring size" },
+	{ "-d", TO_MASTER, "detached policy" },
+	{ "-D", TO_MASTER, "detached buffer size" },
+	{ "-W", TO_MASTER, "settle time" },
+	{ "-g", TO_MASTER, "size policy" },
+	{ "-M", TO_MASTER, "metrics file" },
+	{ "-L", TO_MASTER, "recording file" },
+	{ "-G", TO_MASTER, "recording size" },
+	{ "-C", TO_MASTER, NULL },
+	{ "-p", TO_MASTER, "pool socket" },
+	{ "-O", TO_ATTACH, NULL },
+	{ "-Z", TO_ATTACH, NULL },
+	{ "-x", TO_ATTACH, NULL },
+	{ "-z", TO_ATTACH, NULL },
+	{ NULL, 0, NULL }
+};
+
+static void
+usage()
+{
+	printf(
+		"dtach - version %s, compiled on %s.\n"
+		"Usage: dtach -a <socket> <options>\n"
+		"       dtach -A <socket> <options> <command...>\n"
+		"       dtach -c <socket> <options> <command...>\n"
+		"       dtach -n <socket> <options> <command...>\n"
+		"       dtach -N <socket> <options> <command...>\n"
+		"       dtach -l <socket|directory>\n"
+		"       dtach -m <socket>\n"
+		"       dtach -t <socket>\n"
+		"       dtach -U <socket> [dtmaster]\n"
+		"Modes:\n"
+		"  -a\t\tAttach to the specified socket.\n"
+		"  -A\t\tAttach to the specified socket, or create it if it\n"
+		"\t\t  does not exist, running the specified command.\n"
+		"  -c\t\tCreate a new socket and run the specified command.\n"
+		"  -n\t\tCreate a new socket and run the specified command "
+		"detached.\n"
+		"  -N\t\tCreate a new socket and run the specified command "
+		"detached,\n"
+		"\t\t  but without forking to the background.\n"
+		"  -l\t\tList the sessions on the specified socket, or on "
+		"every\n"
+		"\t\t  socket in the specified directory.\n"
+		"  -m\t\tPrint the metrics of the master on the specified "
+		"socket.\n"
+		"  -t\t\tPrint the recent events in the trace of the master "
+		"on the\n"
+		"\t\t  specified socket.\n"
+		"  -U\t\tHave the master on the specified socket replace "
+		"itself with\n"
+		"\t\t  the specified dtmaster, or the one on the PATH, "
+		"without\n"
+		"\t\t  ending its sessions.\n"
+		"Options:\n"
+		"  -e <char>\tSet the detach character to <char>, defaults "
+		"to ^\\.\n"
+		"  -E\t\tDisable the detach character.\n"
+		"  -r <method>\tSet the redraw method to <method>. The "
+		"valid methods are:\n"
+		"\t\t     none: Don't redraw at all.\n"
+		"\t\t   ctrl_l: Send a Ctrl-L character to the program.\n"
+		"\t\t    winch: Send SIGWINCH to the program.\n"
+		"\t\t   screen: Send the screen as the master last saw it.\n"
+		"  -q <policy>\tSet what happens when a client falls behind. "
+		"The valid\n"
+		"\t\t  policies are:\n"
+		"\t\t        block: Stop reading from the program until the\n"
+		"\t\t               client catches up.\n"
+		"\t\t         drop: Discard the client's backlog and redraw.\n"
+		"\t\t   disconnect: Disconnect the client.\n"
+		"  -Q <size>\tSet the size of each client's output queue.\n"
+		"  -R <size>\tKeep the last <size> bytes of output, and show "
+		"them when\n"
+		"\t\t  attaching.\n"
+		"  -o <size>\tPublish output in a <size> byte shared memory "
+		"ring that\n"
+		"\t\t  observers can follow.\n"
+		"  -d <policy>\tSet what happens to the output while nobody "
+		"is attached.\n"
+		"\t\t  The valid policies are:\n"
+		"\t\t     drop: Throw it away.\n"
+		"\t\t   buffer: Keep the last of it for the next client to "
+		"attach.\n"
+		"\t\t    pause: Keep it, and stop the program once there is "
+		"no more\n"
+		"\t\t           room.\n"
+		"  -D <size>\tKeep up to <size> bytes of output while nobody "
+		"is attached.\n"
+		"  -W <ms>\tHold window size changes and redraws for <ms> "
+		"milliseconds,\n"
+		"\t\t  so that only the last size and one redraw are made.\n"
+		"  -g <policy>\tSet how the window is sized when several "
+		"clients are\n"
+		"\t\t  attached. The valid policies are:\n"
+		"\t\t     latest: The size the last client asked for.\n"
+		"\t\t   smallest: The biggest size that fits every client.\n"
+		"  -O\t\tWatch the session without sending it any input.\n"
+		"  -Z\t\tHave the master compress the output it sends.\n"
+		"  -x\t\tTalk to the program directly while nobody else is "
+		"attached.\n"
+		"  -M <file>\tHave the master write its metrics to <file> on "
+		"SIGUSR1.\n"
+		"  -L <file>\tRecord the output to <file>, with timing, in "
+		"ttyrec format.\n"
+		"  -G <size>\tStart a new recording once <size> bytes are in "
+		"the old one.\n"
+		"  -C\t\tCompress recordings with gzip.\n"
+		"  -s <name>\tUse the session called <name>, out of the many "
+		"that one\n"
+		"\t\t  master can host on the socket.\n"
+		"  -p <pool>\tHave the pool of masters on <pool> start the "
+		"session.\n"
+		"  -z\t\tDisable processing of the suspend key.\n"
+		"\nReport any bugs to <%s>.\n",
+		PACKAGE_VERSION, BUILD_DATE, PACKAGE_BUGREPORT);
+}
+
+/* Runs dtmaster or dtattach, and waits for it to finish. Returns its exit
+** status, or -1 if it couldn't be run. */
+static int
+run(char **argv)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0)
+	{
+		fprintf(stderr, "%s: fork: %s\n", progname, strerror(errno));
+		return -1;
+	}
+	else if (pid == 0)
+	{
+		execvp(argv[0], argv);
+		fprintf(stderr, "%s: could not execute %s: %s\n", progname,
+			argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return -1;
+}
+
+/* Works out the full path of a program the way execvp would find it, so
+** that a master running somewhere else runs the same one. */
+static char *
+program_path(const char *name)
+{
+	char cwd[PATH_MAX], *path, *dir, *buf, *next;
+
+	if (strchr(name, '/'))
+	{
+		if (*name == '/' || !getcwd(cwd, sizeof(cwd)))
+			return (char *)name;
+		buf = malloc(strlen(cwd) + strlen(name) + 2);
+		if (!buf)
+			return (char *)name;
+		sprintf(buf, "%s/%s", cwd, name);
+		return buf;
+	}
+
+	path = getenv("PATH");
+	path = strdup(path ? path : "/bin:/usr/bin");
+	for (dir = path; dir; dir = next)
+	{
+		next = strchr(dir, ':');
+		if (next)
+			*next++ = 0;
+		buf = malloc(strlen(dir) + strlen(name) + 3);
+		if (!buf)
+			break;
+		sprintf(buf, "%s/%s", *dir ? dir : ".", name);
+		if (access(buf, X_OK) == 0)
+		{
+			free(path);
+			return program_path(buf);
+		}
+		free(buf);
+	}
+	free(path);
+	return (char *)name;
+}
+
+/* Moves to the bottom line of the screen, if there is one, and says why we
+** are back. */
+static void
+bottom_line(const char *msg)
+{
+	struct winsize ws;
+
+	if (isatty(1))
+	{
+		if (ioctl(1, TIOCGWINSZ, &ws) < 0 || ws.ws_row == 0)
+			ws.ws_row = 999;
+		printf("\033[%d;1H", ws.ws_row);
+	}
+	printf("%s\n", msg);
+}
+
+/* Attaches to the session on a clear screen. */
+static int
+attach(char **argv)
+{
+	if (isatty(1))
+	{
+		printf("\033[H\033[J");
+		fflush(stdout);
+	}
+
+	switch (run(argv))
+	{
+	case 0:
+		bottom_line("[detached]");
+		return 0;
+	case 3:
+		bottom_line("[EOF - dtach terminating]");
+		return 0;
+	}
+	return 1;
+}
+
+/* Locks the directory the socket is in, so that nobody else starts a
+** master on the socket or removes it between us looking at it and starting
+** ours. Returns the descriptor to close to unlock it, or -1 if it couldn't
+** be locked, in which case we just carry on. */
+static int
+lock_dir(void)
+{
+#if defined(HAVE_FLOCK) && defined(LOCK_EX)
+	char *dir, *slash;
+	int fd;
+
+	dir = malloc(strlen(sockname) + 2);
+	if (!dir)
+		return -1;
+	strcpy(dir, sockname);
+	slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else
+		slash[slash == dir] = 0;
+	fd = open(dir, O_RDONLY);
+	free(dir);
+	if (fd < 0)
+		return -1;
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	/* The master mustn't keep it locked. */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+	while (flock(fd, LOCK_EX) < 0)
+	{
+		if (errno != EINTR)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/* Attaches to the session, starting it first if it isn't running. Finding
+** out whether it is and starting it happen with the directory locked, so
+** that if several of us try at once, only one starts it. */
+static int
+attach_or_create(char **master_argv, char **attach_argv, int named)
+{
+	int lock, s, rv = 0;
+
+	lock = lock_dir();
+	s = connect_socket(sockname);
+	if (s >= 0)
+		close(s);
+	/* Nothing is listening, so a master that went away left it behind. */
+	else if (errno == ECONNREFUSED)
+	{
+		if (unlink(sockname) < 0)
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, sockname,
+				strerror(errno));
+			rv = 1;
+		}
+	}
+	else if (errno != ENOENT)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, sockname,
+			strerror(errno));
+		rv = 1;
+	}
+
+	/* A master that hosts named sessions starts the session if it
+	** doesn't have it. */
+	if (rv == 0 && (s < 0 || named) && run(master_argv) != 0)
+		rv = 1;
+	if (lock >= 0)
+		close(lock);
+	if (rv != 0)
+		return rv;
+	return attach(attach_argv);
+}
+
+int
+main(int argc, char **argv)
+{
+	char **master_argv, **attach_argv, *session = NULL;
+	int nmaster = 0, nattach = 0, mode, i;
+	size_t size;
+
+	/* Save the program name */
+	progname = argv[0];
+	++argv; --argc;
+
+	/* Parse the arguments */
+	if (argc >= 1 && (strcmp(*argv, "--help") == 0 ||
+		strcmp(*argv, "-?") == 0))
+	{
+		usage();
+		return 0;
+	}
+	else if (argc >= 1 && strcmp(*argv, "--version") == 0)
+	{
+		printf("%s", copyright);
+		return 0;
+	}
+	else if (argc < 1 || argv[0][0] != '-' || !argv[0][1] ||
+		argv[0][2] || !strchr("acnlmtANU", argv[0][1]))
+	{
+		fprintf(stderr, "%s: No mode was specified.\n", progname);
+		fprintf(stderr, "Try '%s --help' for more information.\n",
+			progname);
+		return 1;
+	}
+	mode = argv[0][1];
+	++argv; --argc;
+
+	if (argc < 1)
+	{
+		fprintf(stderr, "%s: No socket was specified.\n", progname);
+		fprintf(stderr, "Try '%s --help' for more information.\n",
+			progname);
+		return 1;
+	}
+	sockname = *argv;
+	++argv; --argc;
+
+	/* Every character of the options turns into at most two arguments,
+	** and the command is passed on as it is. */
+	for (i = 0, size = 8; i < argc; ++i)
+		size += 2 * strlen(argv[i]) + 1;
+	master_argv = malloc(size * sizeof(char *));
+	attach_argv = malloc(size * sizeof(char *));
+	if (!master_argv || !attach_argv)
+	{
+		fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	master_argv[nmaster++] = "dtmaster";
+	master_argv[nmaster++] = sockname;
+	attach_argv[nattach++] = "dtattach";
+	attach_argv[nattach++] = sockname;
+
+	while (argc >= 1 && **argv == '-')
+	{
+		const struct passopt *o;
+		char *p;
+
+		for (p = *argv + 1; *p; ++p)
+		{
+			for (o = passopts; o->name && o->name[1] != *p; ++o)
+				;
+			if (o->name)
+			{
+				if (o->to & TO_MASTER)
+					master_argv[nmaster++] = o->name;
+				if (o->to & TO_ATTACH)
+					attach_argv[nattach++] = o->name;
+				if (!o->arg)
+					continue;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No %s specified.\n",
+						progname, o->arg);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				if (o->to & TO_MASTER)
+					master_argv[nmaster++] = *argv;
+				if (o->to & TO_ATTACH)
+					attach_argv[nattach++] = *argv;
+				break;
+			}
+			else if (*p == 'E')
+			{
+				attach_argv[nattach++] = "-e";
+				attach_argv[nattach++] = "";
+			}
+			else if (*p == 's')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No session name "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				session = *argv;
+				break;
+			}
+			else
+			{
+				fprintf(stderr, "%s: Invalid option '-%c'\n",
+					progname, *p);
+				fprintf(stderr, "Try '%s --help' for more "
+					"information.\n", progname);
+				return 1;
+			}
+		}
+		++argv; --argc;
+	}
+
+	/* Only the modes that start a master take a command, and upgrading
+	** takes the binary to upgrade to. */
+	if ((strchr("almt", mode) && argc > 0) || (mode == 'U' && argc > 1))
+	{
+		fprintf(stderr, "%s: Invalid number of arguments.\n",
+			progname);
+		fprintf(stderr, "Try '%s --help' for more information.\n",
+			progname);
+		return 1;
+	}
+	else if (!strchr("almtU", mode) && argc < 1)
+	{
+		fprintf(stderr, "%s: No command was specified.\n", progname);
+		fprintf(stderr, "Try '%s --help' for more information.\n",
+			progname);
+		return 1;
+	}
+
+	if (mode == 'l')
+		return list_main(sockname);
+	else if (mode == 'm')
+		return metrics_main(sockname);
+	else if (mode == 't')
+		return trace_main(sockname);
+	else if (mode == 'U')
+		return upgrade_main(sockname,
+			program_path(argc > 0 ? argv[0] : "dtmaster"));
+
+	/* Attaching with -A starts the session if it isn't there, so it's
+	** fine if someone else just did. */
+	if (session)
+	{
+		master_argv[nmaster++] = mode == 'A' ? "-S" : "-s";
+		master_argv[nmaster++] = session;
+		attach_argv[nattach++] = "-s";
+		attach_argv[nattach++] = session;
+	}
+	attach_argv[nattach] = NULL;
+
+	if (mode == 'a')
+		return attach(attach_argv);
+
+	if (mode == 'N')
+		master_argv[nmaster++] = "-n";
+	else if (mode == 'c' || mode == 'A')
+		master_argv[nmaster++] = "-w";
+	for (i = 0; i < argc; ++i)
+		master_argv[nmaster++] = argv[i];
+	master_argv[nmaster] = NULL;
+
+	/* Nothing is left to do once the master is running. */
+	if (mode == 'n' || mode == 'N')
+	{
+		execvp(master_argv[0], master_argv);
+		fprintf(stderr, "%s: could not execute %s: %s\n", progname,
+			master_argv[0], strerror(errno));
+		return 1;
+	}
+	else if (mode == 'A')
+		return attach_or_create(master_argv, attach_argv,
+			session != NULL);
+
+	i = run(master_argv);
+	if (i != 0)
+		return i < 0 ? 1 : i;
+	return attach(attach_argv);
+}
@@ -0,0 +1,667 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+/*
+** Listing the sessions on a socket, or on every socket in a directory. All
+** of the masters are asked at once, so that a directory full of sockets
+** takes about as long as the slowest master to answer, and stale sockets
+** show up as such instead of as an error from trying to attach.
+*/
+
+/* How long masters get to send their statistics, in milliseconds. Masters
+** that don't know about frames never answer the hello, and are given up on
+** after HELLO_TIMEOUT. */
+#define LIST_TIMEOUT 2000
+
+/* How many sockets are asked at once. This keeps us well within what select
+** can handle and how many files we can have open. */
+#define LIST_BATCH 256
+
+/* How far along a probe is. */
+enum
+{
+	PROBE_HELLO,	/* Waiting for the answer to the hello. */
+	PROBE_STATS,	/* Waiting for the statistics. */
+	PROBE_OK,	/* All of the statistics have arrived. */
+	PROBE_DEAD,	/* Nothing is listening on the socket. */
+	PROBE_OLD,	/* The master doesn't keep statistics. */
+	PROBE_SILENT,	/* The master didn't answer. */
+	PROBE_ERROR,	/* Something else went wrong, as error says. */
+};
+
+/* A socket being asked about its sessions. */
+struct probe
+{
+	/* The path of the socket, and the part of it to show. */
+	char *path;
+	const char *label;
+	/* The connection to the master, or -1 once we are done with it. */
+	int fd;
+	int state;
+	int error;
+	/* Input that hasn't made up a whole frame yet. */
+	unsigned char *in;
+	size_t inlen;
+	/* The sessions the master told us about. */
+	struct session_stats *st;
+	size_t nst;
+};
+
+/* Stop talking to a master, and note how it went. */
+static void
+probe_finish(struct probe *pr, int state)
+{
+	if (pr->fd >= 0)
+		close(pr->fd);
+	pr->fd = -1;
+	pr->state = state;
+	free(pr->in);
+	pr->in = NULL;
+	pr->inlen = 0;
+}
+
+/* Connect to a master and say hello. Connecting to a busy master would
+** block, so don't wait for it. */
+static void
+probe_start(struct probe *pr)
+{
+	struct sockaddr_un sockun;
+	struct packet pkt;
+
+	pr->fd = -1;
+	pr->state = PROBE_HELLO;
+	if (strlen(pr->path) >= sizeof(sockun.sun_path))
+	{
+		pr->error = ENAMETOOLONG;
+		probe_finish(pr, PROBE_ERROR);
+		return;
+	}
+	init_sockaddr_un(&sockun, pr->path);
+
+	pr->fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (pr->fd < 0 || pr->fd >= FD_SETSIZE ||
+		fcntl(pr->fd, F_SETFL, O_NONBLOCK) < 0)
+	{
+		pr->error = pr->fd < 0 ? errno : EMFILE;
+		probe_finish(pr, PROBE_ERROR);
+		return;
+	}
+	if (connect(pr->fd, (struct sockaddr *)&sockun, sizeof(sockun)) < 0)
+	{
+		pr->error = errno;
+		if (errno == ECONNREFUSED)
+			probe_finish(pr, PROBE_DEAD);
+		else if (errno == EAGAIN)
+			probe_finish(pr, PROBE_SILENT);
+		else
+			probe_finish(pr, PROBE_ERROR);
+		return;
+	}
+
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = MSG_HELLO;
+	pkt.len = PROTOCOL_VERSION;
+	if (write(pr->fd, &pkt, sizeof(struct packet)) !=
+		sizeof(struct packet))
+		probe_finish(pr, PROBE_SILENT);
+}
+
+/* Act on a frame from a master. */
+static void
+probe_frame(struct probe *pr, int type, int arg, unsigned char *buf,
+	size_t len)
+{
+	unsigned char hdr[FRAME_HDR];
+	struct session_stats *st;
+	size_t n;
+
+	if (pr->state == PROBE_HELLO)
+	{
+		if (type != MSG_HELLO || arg < 4)
+		{
+			probe_finish(pr, PROBE_OLD);
+			return;
+		}
+		hdr[0] = MSG_STATS;
+		hdr[1] = hdr[2] = hdr[3] = 0;
+		if (write(pr->fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		{
+			probe_finish(pr, PROBE_SILENT);
+			return;
+		}
+		pr->state = PROBE_STATS;
+	}
+	else if (type == MSG_STATS)
+	{
+		n = len / sizeof(struct session_stats);
+		if (n > 0)
+		{
+			st = realloc(pr->st,
+				(pr->nst + n) * sizeof(struct session_stats));
+			if (!st)
+			{
+				pr->error = errno;
+				probe_finish(pr, PROBE_ERROR);
+				return;
+			}
+			pr->st = st;
+			memcpy(st + pr->nst, buf, n * sizeof(*st));
+			for (st += pr->nst; st < pr->st + pr->nst + n; ++st)
+				st->name[sizeof(st->name) - 1] = 0;
+			pr->nst += n;
+		}
+		if (arg == 0)
+			probe_finish(pr, PROBE_OK);
+	}
+}
+
+/* Read what a master has sent, and act on each whole frame of it. */
+static void
+probe_read(struct probe *pr)
+{
+	unsigned char buf[BUFSIZE], *in;
+	size_t off = 0, len;
+	ssize_t n;
+
+	n = read(pr->fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	else if (n <= 0)
+	{
+		probe_finish(pr, PROBE_SILENT);
+		return;
+	}
+
+	in = realloc(pr->in, pr->inlen + n);
+	if (!in)
+	{
+		pr->error = errno;
+		probe_finish(pr, PROBE_ERROR);
+		return;
+	}
+	pr->in = in;
+	memcpy(in + pr->inlen, buf, n);
+	pr->inlen += n;
+
+	while (pr->fd >= 0 && pr->inlen - off >= FRAME_HDR)
+	{
+		len = (in[off + 2] << 8) | in[off + 3];
+		if (pr->inlen - off < FRAME_HDR + len)
+			break;
+		probe_frame(pr, in[off], in[off + 1], in + off + FRAME_HDR,
+			len);
+		off += FRAME_HDR + len;
+	}
+	if (pr->fd >= 0 && off > 0)
+	{
+		memmove(pr->in, pr->in + off, pr->inlen - off);
+		pr->inlen -= off;
+	}
+}
+
+/* Ask a batch of masters for their statistics, all at once. */
+static void
+probe_batch(struct probe *probes, size_t n)
+{
+	struct timeval start, now, tv;
+	fd_set readfds;
+	long elapsed, wait;
+	size_t i;
+	int maxfd;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i)
+		probe_start(&probes[i]);
+
+	for (;;)
+	{
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_usec - start.tv_usec) / 1000;
+		wait = LIST_TIMEOUT - elapsed;
+
+		FD_ZERO(&readfds);
+		maxfd = -1;
+		for (i = 0; i < n; ++i)
+		{
+			struct probe *pr = &probes[i];
+
+			if (pr->state == PROBE_HELLO)
+			{
+				if (elapsed >= HELLO_TIMEOUT)
+				{
+					probe_finish(pr, PROBE_OLD);
+					continue;
+				}
+				if (HELLO_TIMEOUT - elapsed < wait)
+					wait = HELLO_TIMEOUT - elapsed;
+			}
+			else if (pr->state == PROBE_STATS)
+			{
+				if (elapsed >= LIST_TIMEOUT)
+				{
+					probe_finish(pr, PROBE_SILENT);
+					continue;
+				}
+			}
+			else
+				continue;
+
+			FD_SET(pr->fd, &readfds);
+			if (pr->fd > maxfd)
+				maxfd = pr->fd;
+		}
+		if (maxfd < 0)
+			break;
+
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		if (select(maxfd + 1, &readfds, NULL, NULL, &tv) <= 0)
+			continue;
+		for (i = 0; i < n; ++i)
+			if (probes[i].fd >= 0 &&
+				FD_ISSET(probes[i].fd, &readfds))
+				probe_read(&probes[i]);
+	}
+}
+
+static int
+probe_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct probe *)a)->label,
+		((const struct probe *)b)->label);
+}
+
+static int
+stats_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct session_stats *)a)->name,
+		((const struct session_stats *)b)->name);
+}
+
+/* Add a socket to the list of them to probe. */
+static int
+probe_add(struct probe **probes, size_t *n, const char *dir,
+	const char *name)
+{
+	struct probe *pr;
+	size_t len;
+
+	pr = realloc(*probes, (*n + 1) * sizeof(struct probe));
+	if (!pr)
+		return -1;
+	*probes = pr;
+	pr += *n;
+	memset(pr, 0, sizeof(struct probe));
+
+	len = (dir ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+	pr->path = malloc(len);
+	if (!pr->path)
+		return -1;
+	if (dir)
+		sprintf(pr->path, "%s/%s", dir, name);
+	else
+		strcpy(pr->path, name);
+	pr->label = pr->path + len - strlen(name) - 1;
+	pr->fd = -1;
+	(*n)++;
+	return 0;
+}
+
+/* Find the sockets in a directory. */
+static int
+scan_dir(char *path, struct probe **probes, size_t *n)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	char *file;
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir)))
+	{
+		if (strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0)
+			continue;
+		file = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if (!file)
+			break;
+		sprintf(file, "%s/%s", path, de->d_name);
+		if (stat(file, &st) == 0 && S_ISSOCK(st.st_mode) &&
+			probe_add(probes, n, path, de->d_name) < 0)
+		{
+			free(file);
+			break;
+		}
+		free(file);
+	}
+	closedir(dir);
+	return de ? -1 : 0;
+}
+
+/* Format a length of time in its two largest units. */
+static void
+format_time(char *buf, size_t size, long secs)
+{
+	if (secs < 0)
+		secs = 0;
+	if (secs < 60)
+		snprintf(buf, size, "%lds", secs);
+	else if (secs < 3600)
+		snprintf(buf, size, "%ldm%02lds", secs / 60, secs % 60);
+	else if (secs < 86400)
+		snprintf(buf, size, "%ldh%02ldm", secs / 3600,
+			secs / 60 % 60);
+	else
+		snprintf(buf, size, "%ldd%02ldh", secs / 86400,
+			secs / 3600 % 24);
+}
+
+/* Format a number of bytes in the largest unit that fits. */
+static void
+format_size(char *buf, size_t size, uint64_t bytes)
+{
+	const char units[] = "KMGTPE";
+	double n = bytes;
+	int i = -1;
+
+	if (bytes < 1024)
+	{
+		snprintf(buf, size, "%u", (unsigned int)bytes);
+		return;
+	}
+	while (n >= 1024 && units[i + 1])
+	{
+		n /= 1024;
+		i++;
+	}
+	snprintf(buf, size, n < 10 ? "%.1f%c" : "%.0f%c", n, units[i]);
+}
+
+/* Print a table of what we found out. */
+static void
+print_probes(struct probe *probes, size_t n)
+{
+	char up[32], idle[32], in[32], out[32], size[32];
+	int sockw = 6, namew = 0, w;
+	time_t now = time(NULL);
+	struct session_stats *st;
+	const char *what;
+	size_t i, j;
+
+	for (i = 0; i < n; ++i)
+	{
+		w = strlen(probes[i].label);
+		if (w > sockw)
+			sockw = w;
+		for (j = 0; j < probes[i].nst; ++j)
+		{
+			w = strlen(probes[i].st[j].name);
+			if (w > namew)
+				namew = w;
+		}
+	}
+	/* Only show the session names if there are any. */
+	if (namew > 0 && namew < 7)
+		namew = 7;
+
+	printf("%-*s  ", sockw, "SOCKET");
+	if (namew > 0)
+		printf("%-*s  ", namew, "SESSION");
+	printf("%7s  %7s  %7s  %7s  %3s  %6s  %6s  %s\n", "PID", "UPTIME",
+		"IDLE", "CLIENTS", "OBS", "IN", "OUT", "SIZE");
+
+	for (i = 0; i < n; ++i)
+	{
+		if (probes[i].state != PROBE_OK)
+		{
+			if (probes[i].state == PROBE_DEAD)
+				what = "(not running)";
+			else if (probes[i].state == PROBE_OLD)
+				what = "(no statistics)";
+			else if (probes[i].state == PROBE_SILENT)
+				what = "(no answer)";
+			else
+				what = strerror(probes[i].error);
+			printf("%-*s  %s\n", sockw, probes[i].label, what);
+			continue;
+		}
+
+		qsort(probes[i].st, probes[i].nst, sizeof(*st), stats_cmp);
+		for (j = 0; j < probes[i].nst; ++j)
+		{
+			st = &probes[i].st[j];
+			format_time(up, sizeof(up), now - st->started);
+			format_time(idle, sizeof(idle), now - st->active);
+			format_size(in, sizeof(in), st->bytes_in);
+			format_size(out, sizeof(out), st->bytes_out);
+			if (st->rows > 0 && st->cols > 0)
+				snprintf(size, sizeof(size), "%ux%u", st->cols,
+					st->rows);
+			else
+				strcpy(size, "-");
+
+			printf("%-*s  ", sockw, probes[i].label);
+			if (namew > 0)
+				printf("%-*s  ", namew, st->name);
+			printf("%7u  %7s  %7s  %7u  %3u  %6s  %6s  %s\n",
+				(unsigned int)st->pid, up, idle, st->clients,
+				st->observers, in, out, size);
+		}
+	}
+}
+
+/* List the sessions on a socket, or on every socket in a directory. */
+int
+list_main(char *path)
+{
+	struct probe *probes = NULL;
+	struct stat st;
+	size_t i, n = 0;
+
+	/* A master going away mid-conversation is just another answer. */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (stat(path, &st) < 0 || (S_ISDIR(st.st_mode) ?
+		scan_dir(path, &probes, &n) : probe_add(&probes, &n, NULL,
+		path)) < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path,
+			strerror(errno));
+		return 1;
+	}
+
+	qsort(probes, n, sizeof(struct probe), probe_cmp);
+	for (i = 0; i < n; i += LIST_BATCH)
+		probe_batch(probes + i, n - i < LIST_BATCH ? n - i : LIST_BATCH);
+	if (n > 0)
+		print_probes(probes, n);
+
+	for (i = 0; i < n; ++i)
+	{
+		free(probes[i].path);
+		free(probes[i].st);
+	}
+	free(probes);
+	return 0;
+}
+
+/* Print a master's metrics. */
+int
+metrics_main(char *path)
+{
+	unsigned char hdr[FRAME_HDR], buf[FRAME_MAX];
+	size_t len;
+	int s;
+
+	s = connect_socket(path);
+	if (s < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path,
+			strerror(errno));
+		return 1;
+	}
+	if (negotiate(s) < 5)
+	{
+		fprintf(stderr, "%s: %s: The master does not keep metrics.\n",
+			progname, path);
+		return 1;
+	}
+
+	hdr[0] = MSG_STATS;
+	hdr[1] = STATS_METRICS;
+	hdr[2] = hdr[3] = 0;
+	if (write_all(s, hdr, sizeof(hdr)) < 0)
+		goto lost;
+	do
+	{
+		if (read_all(s, hdr, sizeof(hdr)) < 0)
+			goto lost;
+		len = (hdr[2] << 8) | hdr[3];
+		if (read_all(s, buf, len) < 0)
+			goto lost;
+		if (hdr[0] == MSG_STATS)
+			write_all(1, buf, len);
+	} while (hdr[0] != MSG_STATS || hdr[1]);
+	return 0;
+
+lost:
+	fprintf(stderr, "%s: %s: The master went away.\n", progname, path);
+	return 1;
+}
+
+/* What the events in the trace ring are called, by type. */
+static const char *const trace_names[] = {
+	"?", "pty_read", "client_write", "client_msg", "accept",
+};
+
+/* Print the events in a master's trace ring, one to a line, with the time
+** since the first one and since the one before it. */
+int
+trace_main(char *path)
+{
+	unsigned char hdr[FRAME_HDR], buf[FRAME_MAX];
+	struct trace_event e;
+	uint64_t first = 0, last = 0;
+	size_t len, i;
+	int s, n = 0;
+
+	s = connect_socket(path);
+	if (s < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path,
+			strerror(errno));
+		return 1;
+	}
+	if (negotiate(s) < 10)
+	{
+		fprintf(stderr, "%s: %s: The master does not keep a trace.\n",
+			progname, path);
+		return 1;
+	}
+
+	hdr[0] = MSG_STATS;
+	hdr[1] = STATS_TRACE;
+	hdr[2] = hdr[3] = 0;
+	if (write_all(s, hdr, sizeof(hdr)) < 0)
+		goto lost;
+	printf("%12s %10s  %-12s %8s %8s %4s\n", "TIME", "DELTA", "EVENT",
+		"ID", "BYTES", "ARG");
+	do
+	{
+		if (read_all(s, hdr, sizeof(hdr)) < 0)
+			goto lost;
+		len = (hdr[2] << 8) | hdr[3];
+		if (read_all(s, buf, len) < 0)
+			goto lost;
+		if (hdr[0] != MSG_STATS)
+			continue;
+		for (i = 0; i + sizeof(e) <= len; i += sizeof(e))
+		{
+			memcpy(&e, buf + i, sizeof(e));
+			if (n++ == 0)
+				first = last = e.usec;
+			printf("%5llu.%06llu %10llu  %-12s %8lu %8lu %4u\n",
+				(unsigned long long)(e.usec - first) / 1000000,
+				(unsigned long long)(e.usec - first) % 1000000,
+				(unsigned long long)(e.usec - last),
+				e.type < sizeof(trace_names) /
+				sizeof(trace_names[0]) ? trace_names[e.type] :
+				"?", (unsigned long)e.id, (unsigned long)e.len,
+				e.arg);
+			last = e.usec;
+		}
+	} while (hdr[0] != MSG_STATS || hdr[1]);
+	return 0;
+
+lost:
+	fprintf(stderr, "%s: %s: The master went away.\n", progname, path);
+	return 1;
+}
+
+/* Have the master on the socket replace itself with another binary,
+** without ending any of its sessions. */
+int
+upgrade_main(char *path, char *binary)
+{
+	unsigned char hdr[FRAME_HDR], buf[FRAME_MAX];
+	size_t len = strlen(binary);
+	int s;
+
+	s = connect_socket(path);
+	if (s < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path,
+			strerror(errno));
+		return 1;
+	}
+	if (negotiate(s) < 8 || len > FRAME_MAX)
+	{
+		fprintf(stderr, "%s: %s: The master can't be upgraded.\n",
+			progname, path);
+		return 1;
+	}
+
+	hdr[0] = MSG_UPGRADE;
+	hdr[1] = 0;
+	hdr[2] = len >> 8;
+	hdr[3] = len & 0xff;
+	if (write_all(s, hdr, sizeof(hdr)) < 0 ||
+		write_all(s, binary, len) < 0)
+		goto lost;
+	do
+	{
+		if (read_all(s, hdr, sizeof(hdr)) < 0)
+			goto lost;
+		len = (hdr[2] << 8) | hdr[3];
+		if (read_all(s, buf, len) < 0)
+			goto lost;
+	} while (hdr[0] != MSG_UPGRADE);
+	if (hdr[1])
+		return 0;
+	write_all(2, buf, len);
+	return 1;
+
+lost:
+	fprintf(stderr, "%s: %s: The master went away.\n", progname, path);
+	return 1;
+}
@@ -31,14 +31,104 @@ char *sockname;
 int stop;
 /* The default redraw method. If unspecified, use SIGWINCH. */
 int redraw_method = REDRAW_CTRL_L;
+/* What to do with clients that fall behind, unless they say otherwise. */
+int overflow_policy = OVERFLOW_DROP;
+/* The size of each client's output queue. */
+static size_t outq_size = OUTQ_SIZE;
+/* How much recent output to keep for replaying to new clients. */
+static size_t replay_size;
+/* What to do with the output while nobody is attached, and how much of it
+** to keep. */
+static int detach_policy = DETACH_DROP;
+static size_t held_size = HELD_SIZE;
+/* The size of the ring that observers read output from, if any. */
+static size_t observe_size;
+/* Set if we host named sessions, and keep going until the last one ends. */
+static int multisession;
+/* The name of the session to start, and how to ask for it. */
+static char *session_name;
+static int session_flags;
+/* Where to write the metrics when asked to with SIGUSR1. */
+static char *metrics_path;
+static volatile sig_atomic_t dump_metrics;
+/* Where to record the output, when to start a new file, and whether to
+** compress it. */
+static char *record_path;
+static size_t record_limit;
+static int record_compress;
+/* How many masters to keep ready, if we are a pool. */
+static int pool_size;
+/* How long to hold window size changes and redraws so that they can be put
+** together, in milliseconds, and how to size the window when several
+** clients are attached. */
+static int settle_ms = SETTLE_MS;
+static int size_policy = SIZE_LATEST;
+/* Set when a client has asked for a live upgrade, along with the binary to
+** upgrade to and the client, if it is still around. */
+static int upgrade_pending;
+static char *upgrade_path;
+static struct client *upgrade_client;
 
 /* The original terminal settings, for initializing the pty. */
 struct termios orig_term;
 int dont_have_tty;
 
-/* The pty struct - The pty information is stored here. */
+/* A fixed-size ring buffer of bytes. */
+struct ring
+{
+	/* The storage, allocated when first needed. */
+	unsigned char *buf;
+	/* The capacity of the buffer. */
+	size_t size;
+	/* The offset and length of the data in the buffer. */
+	size_t head, len;
+};
+
+/* A histogram of observations. */
+#define HIST_BUCKETS 16
+struct histogram
+{
+	/* The upper bounds of the buckets, in increasing order. */
+	const unsigned long *bounds;
+	int nbounds;
+	/* How many observations fell in each bucket, with one more for those
+	** past the last. */
+	uint64_t counts[HIST_BUCKETS + 1];
+	/* The sum and number of all the observations. */
+	uint64_t sum, count;
+};
+
+/* What the metrics count for each client. */
+enum
+{
+	CLIENT_SENT,
+	CLIENT_SHORT,
+	CLIENT_EAGAIN,
+	CLIENT_COUNTS,
+};
+
+#ifdef USE_EPOLL
+/* What the first member of a pty or a client says it is, so that epoll
+** events can be told apart. */
+enum
+{
+	KIND_CLIENT,
+	KIND_PTY,
+};
+#endif
+
+/* The pty struct - The pty information is stored here. There is one for
+** each session. */
 struct pty
 {
+#ifdef USE_EPOLL
+	/* KIND_PTY. */
+	int kind;
+#endif
+	/* The next session in the list. */
+	struct pty *next;
+	/* The name of the session, if we host named sessions. */
+	char *name;
 	/* File descriptor of the pty */
 	int fd;
 #ifdef BROKEN_MASTER
@@ -47,16 +137,91 @@ struct pty
 #endif
 	/* Process id of the child. */
 	pid_t pid;
-	/* The terminal parameters of the pty. Old and new for comparision
-	** purposes. */
+	/* The terminal parameters of the pty, as they were last looked at,
+	** and whether they might have changed since. */
 	struct termios term;
+	int term_stale;
+#ifdef USE_PACKET
+	/* Whether the pty is in packet mode, and whether the program's output
+	** is stopped. */
+	int packet;
+	int stopped;
+#endif
 	/* The current window size of the pty. */
 	struct winsize ws;
+	/* The window size and the program redraw that wait for the requests
+	** to settle, and when they will have, or 0 if nothing waits. */
+	struct winsize ws_want;
+	int resize_pending;
+	int redraw_pending;
+	uint64_t settle_at;
+	/* The most recent output, which new clients are sent on attach. */
+	struct ring replay;
+	/* Output from while nobody was attached, for the next client to
+	** attach. */
+	struct ring held;
+	/* Input from the clients that the program hasn't taken yet. */
+	struct ring inq;
+#ifdef USE_OBSERVERS
+	/* The ring that output is published in for observers, and its
+	** memfd. */
+	struct obs_ring *obs;
+	int obsfd;
+#endif
+	/* A model of the screen, if the screen redraw method is used. */
+	struct screen *screen;
+#ifdef USE_RECORDING
+	/* The recording of the output, if it is recorded. */
+	struct recorder *rec;
+#endif
+#ifdef USE_SPLICE
+	/* A pipe that output is spliced into on its way to the clients. */
+	int pipe[2];
+#endif
+	/* The clients talking to this session. */
+	struct client *clients;
+	/* The number of clients whose backlog is holding up the pty. */
+	int nblocking;
+	/* The number of clients reading from the observer ring. */
+	int nobservers;
+	/* Set until a client attaches, if the output waits for one. */
+	int waitattach;
+#ifdef USE_DIRECT
+	/* The client that has the pty to itself, if one does. */
+	struct client *direct;
+#endif
+	/* When the session started, and when its program last took input or
+	** produced output. */
+	time_t started, active;
+	/* How much input the program has taken, and output it has produced. */
+	uint64_t bytes_in, bytes_out;
+	/* When the output being timed was read, and how many clients have
+	** yet to be sent all of it. */
+	uint64_t lat_start;
+	int lat_owed;
+	/* When the oldest input in the queue might have arrived. */
+	uint64_t in_since;
+#ifdef USE_EPOLL
+	/* The events the pty is registered for. */
+	unsigned int events;
+	/* Whether the pty has output waiting to be read. */
+	int readable;
+	/* Whether the pty is on the pending list. */
+	int on_pending;
+	/* The next pty on the pending list. */
+	struct pty *pending_next;
+#endif
 };
 
 /* A connected client */
 struct client
 {
+#ifdef USE_EPOLL
+	/* KIND_CLIENT. */
+	int kind;
+#endif
+	/* The session the client talks to, or NULL if it hasn't picked one. */
+	struct pty *pty;
 	/* The next client in the linked list. */
 	struct client *next;
 	/* The previous client in the linked list. */
@@ -65,12 +230,150 @@ struct client
 	int fd;
 	/* Whether or not the client is attached. */
 	int attached;
+	/* Output waiting for the client to become writable. */
+	struct ring outq;
+	/* What to do when the output queue fills up. */
+	int overflow;
+	/* Set while the client's backlog is holding up the pty. */
+	int blocking;
+	/* Set when output was dropped and the client needs a redraw. */
+	int resync;
+	/* The redraw method the client last asked for. */
+	int redraw;
+	/* The window size the client last asked for, if it has asked. */
+	struct winsize ws;
+	int has_ws;
+	/* Set while the client waits for the screen until the requests
+	** settle. */
+	int snapshot_pending;
+	/* Set once the client has been sent the replay buffer. */
+	int replayed;
+	/* Set while the client's input waits for room in the pty's queue. */
+	int waiting;
+	/* Set if the client follows the output through the observer ring. */
+	int observer;
+#ifdef USE_DIRECT
+	/* 1 while the client has the pty to itself, or 2 once it has been
+	** asked to give it back. */
+	int direct;
+#endif
+	/* The framing version agreed on, or 0 for plain packets. */
+	int version;
+	/* The codec the output is compressed with, or 0 for a plain stream. */
+	int codec;
+	/* A number that tells the client apart in the metrics, and what they
+	** say about its output. */
+	uint64_t id;
+	uint64_t counts[CLIENT_COUNTS];
+	/* Set while the client has yet to be sent output being timed. */
+	int lat_owed;
+	/* Input that hasn't made up a whole message yet. */
+	unsigned char *in;
+	size_t inlen, insize;
+#ifdef USE_SPLICE
+	/* A pipe that output is teed into on its way to the client. */
+	int pipe[2];
+#endif
+#ifdef USE_EPOLL
+	/* Whether the client can take more output. */
+	int writable;
+	/* Whether the client has input waiting to be read. */
+	int readable;
+	/* Whether the client is on the ready list. */
+	int on_ready;
+	/* The next client on the ready list. */
+	struct client *ready_next;
+#endif
 };
 
-/* The list of connected clients. */
-static struct client *clients;
-/* The pseudo-terminal created for the child process. */
-static struct pty the_pty;
+/* The sessions, newest first. Unless we host named sessions, there is
+** only ever the one. */
+static struct pty *sessions;
+/* Clients that haven't picked a session yet. */
+static struct client *unbound;
+
+/* The sizes of reads from a pty, in bytes. A read that (nearly) fills the
+** buffer means there was more waiting, so those get a bucket of their own;
+** Linux ptys hand out at most one byte less than was asked for. */
+static const unsigned long read_bounds[] =
+	{16, 64, 256, 1024, 2048, BUFSIZE - 64, BUFSIZE};
+/* How long output takes to reach the clients, in microseconds. */
+static const unsigned long latency_bounds[] =
+	{50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000};
+
+/* What the master has been up to, for seeing where the time goes. The
+** totals include sessions and clients that have since gone away. */
+static struct
+{
+	/* How many times the event loop woke up. */
+	uint64_t wakeups;
+	/* Reads from the ptys, by size. */
+	struct histogram reads;
+	/* Input messages from the clients, and the writes to the ptys. */
+	uint64_t input_msgs, input_bytes;
+	uint64_t pty_writes, pty_written;
+	/* Output to the clients, as counted for each of them. */
+	uint64_t client[CLIENT_COUNTS];
+	/* How many clients have connected. */
+	uint64_t clients;
+	/* How long it takes output read from a pty to be written to every
+	** attached client. Only one read per pty is timed at once. */
+	struct histogram latency;
+	/* How long input waits to be written to a pty, from when it might
+	** have arrived, and how many times reading output was cut short to
+	** get back to the clients. */
+	struct histogram input_latency;
+	uint64_t slices;
+	/* Output put in frames for clients that have it compressed, and how
+	** big it was after that. Shared frames are counted once. */
+	uint64_t compress_in, compress_out;
+	/* How many times a client was handed a pty. */
+	uint64_t direct;
+	/* Window size changes and redraws that the clients asked for, and
+	** how many were carried out once the requests had settled. */
+	uint64_t resize_requests, resizes;
+	uint64_t redraw_requests, redraws;
+} metrics;
+
+/* Client records that aren't in use, and how many records there are in all.
+** They come in slabs of CLIENT_SLAB and are never given back, so that a
+** master that sees clients come and go for months doesn't scatter them over
+** the heap. A record keeps its input buffer while it is free. */
+#define CLIENT_SLAB 64
+static struct client *free_clients;
+static uint64_t client_records, client_records_free;
+
+/* The most recent events, and how many there have been. */
+static struct trace_event trace[TRACE_EVENTS];
+static uint64_t trace_count;
+/* The earliest that the input being read now might have arrived: when the
+** event loop woke up for it, or, if it was already waiting, when the loop
+** last looked. */
+static uint64_t input_since;
+
+#ifdef USE_EPOLL
+/* The epoll instance. Clients are registered edge-triggered, so a readiness
+** change is only reported once and remembered here until it is handled. */
+static int epfd = -1;
+/* Clients with input waiting to be read or output waiting to be written. */
+static struct client *ready;
+/* ptys with something to do, or whose events need updating. */
+static struct pty *pending;
+/* Set when the control socket or the signalfd become readable. */
+static int control_ready, signal_ready;
+/* Tags that tell these descriptors apart from ptys and clients in epoll
+** events. */
+static char control_tag, signal_tag;
+#endif
+
+#ifdef USE_SIGNALFD
+/* Receives SIGCHLD, SIGINT, SIGTERM and SIGUSR1, or -1 if we use
+** handlers. */
+static int sigfd = -1;
+/* The signal mask to restore in the child. */
+static sigset_t orig_sigmask;
+#endif
 
 #ifndef HAVE_FORKPTY
 pid_t forkpty(int *amaster, char *name, struct termios *termp,
@@ -82,6 +385,7 @@ usage()
 {
 	printf(
 		"Usage: dtmaster <socket> <options> <command> [arg...]\n"
+		"       dtmaster <pool> -P <count> <options>\n"
 		"Options:\n"
 		"  -n\t\tDo not fork after running the command.\n"
 		"  -w\t\tWait for a client to attach before processing any "
@@ -93,7 +397,74 @@ usage()
 		"\t\t     none: Don't redraw at all.\n"
 		"\t\t   ctrl_l: Send a Ctrl-L character to the program.\n"
 		"\t\t    winch: Send SIGWINCH to the program.\n"
-		"\nReport any bugs to <%s>.\n", PACKAGE_BUGREPORT);
+		"\t\t   screen: Keep track of the screen, and send it to "
+		"the\n"
+		"\t\t           client without involving the program.\n"
+		"  -q <policy>\tSet the default policy for clients that fall "
+		"behind to\n"
+		"\t\t  <policy>. The valid policies are:\n"
+		"\t\t        block: Stop reading from the program until "
+		"the\n"
+		"\t\t               client catches up.\n"
+		"\t\t         drop: Discard the client's backlog and "
+		"redraw.\n"
+		"\t\t   disconnect: Disconnect the client.\n"
+		"  -Q <size>\tSet the size of each client's output queue. "
+		"Defaults\n"
+		"\t\t  to %dk.\n"
+		"  -R <size>\tKeep the last <size> bytes of output, and send "
+		"them to\n"
+		"\t\t  clients when they attach.\n"
+		"  -o <size>\tPublish output in a <size> byte shared memory ring "
+		"that\n"
+		"\t\t  read-only observers can follow.\n"
+		"  -d <policy>\tSet what happens to the output while nobody is "
+		"attached\n"
+		"\t\t  to <policy>. The valid policies are:\n"
+		"\t\t     drop: Throw it away.\n"
+		"\t\t   buffer: Keep the last of it for the next client to "
+		"attach.\n"
+		"\t\t    pause: Keep it, and stop reading from the program "
+		"once\n"
+		"\t\t           there is no more room.\n"
+		"  -D <size>\tKeep up to <size> bytes of output while nobody is "
+		"attached.\n"
+		"\t\t  Defaults to %dk.\n"
+		"  -W <ms>\tHold window size changes and redraws for <ms> "
+		"milliseconds,\n"
+		"\t\t  and only make the last size change and one redraw. "
+		"Defaults\n"
+		"\t\t  to %d, and 0 makes them right away.\n"
+		"  -g <policy>\tSet how the window is sized when several "
+		"clients are\n"
+		"\t\t  attached to <policy>. The valid policies are:\n"
+		"\t\t     latest: The size the last client asked for.\n"
+		"\t\t   smallest: The biggest size that fits every "
+		"client.\n"
+		"  -s <name>\tHost named sessions, starting with one called "
+		"<name>. If\n"
+		"\t\t  there is already a master doing that on <socket>, "
+		"have it\n"
+		"\t\t  start the session instead.\n"
+		"  -S <name>\tLike -s, but it is not an error for the session "
+		"to exist.\n"
+		"  -M <file>\tWrite metrics to <file> on SIGUSR1. Defaults to "
+		"<socket>.prom.\n"
+		"  -L <file>\tRecord the output to <file> in ttyrec format. "
+		"Named\n"
+		"\t\t  sessions are recorded to <file>.<name>.\n"
+		"  -G <size>\tMove a recording aside as <file>.<n> once "
+		"<size> bytes\n"
+		"\t\t  have been written to it, and start a new one.\n"
+		"  -C\t\tCompress recordings with gzip.\n"
+		"  -P <count>\tRun a pool of <count> masters on <pool>, each "
+		"ready to\n"
+		"\t\t  start a session without a command of its own.\n"
+		"  -p <pool>\tHave the pool on <pool> start the session if it "
+		"is\n"
+		"\t\t  running.\n"
+		"\nReport any bugs to <%s>.\n", OUTQ_SIZE / 1024,
+		HELD_SIZE / 1024, SETTLE_MS, PACKAGE_BUGREPORT);
 }
 
 /* Unlink the socket */
@@ -107,13 +478,32 @@ unlink_socket(void)
 static RETSIGTYPE 
 die(int sig)
 {
-	/* Well, the child died. */
+	/* Well, a child died. Its session ends when the pty closes, but
+	** the child still has to be reaped. */
 	if (sig == SIGCHLD)
 	{
+		int saved_errno = errno;
+		pid_t pid;
+
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		{
 #ifdef BROKEN_MASTER
-		/* Damn you Solaris! */
-		close(the_pty.fd);
+			struct pty *pty;
+
+			/* Damn you Solaris! */
+			for (pty = sessions; pty; pty = pty->next)
+				if (pty->pid == pid)
+					close(pty->fd);
 #endif
+		}
+		errno = saved_errno;
+		return;
+	}
+	/* Someone wants the metrics. They are written out from the main
+	** loop. */
+	else if (sig == SIGUSR1)
+	{
+		dump_metrics = 1;
 		return;
 	}
 	exit(128 + sig);
@@ -141,49 +531,347 @@ setnonblocking(int fd)
 #endif
 }
 
-/* Initialize the pty structure. */
+/* Allocates the storage for a ring buffer. */
+static int
+ring_alloc(struct ring *r, size_t size)
+{
+	r->buf = malloc(size);
+	if (!r->buf)
+		return -1;
+	r->size = size;
+	r->head = r->len = 0;
+	return 0;
+}
+
+/* Appends data to a ring buffer. The data must fit. */
+static void
+ring_put(struct ring *r, const unsigned char *data, size_t len)
+{
+	size_t tail = (r->head + r->len) % r->size;
+	size_t n = r->size - tail;
+
+	if (n > len)
+		n = len;
+	memcpy(r->buf + tail, data, n);
+	memcpy(r->buf, data + n, len - n);
+	r->len += len;
+}
+
+/* Describes the data in a ring buffer with at most two iovecs. */
+static int
+ring_iov(struct ring *r, struct iovec *iov)
+{
+	size_t n = r->size - r->head;
+
+	if (r->len == 0)
+		return 0;
+	iov[0].iov_base = r->buf + r->head;
+	if (n >= r->len)
+	{
+		iov[0].iov_len = r->len;
+		return 1;
+	}
+	iov[0].iov_len = n;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = r->len - n;
+	return 2;
+}
+
+/* Removes data from the front of a ring buffer. */
+static void
+ring_consume(struct ring *r, size_t len)
+{
+	r->len -= len;
+	r->head = r->len ? (r->head + len) % r->size : 0;
+}
+
+/* Appends data to a ring buffer, discarding the oldest data to make room. */
+static void
+ring_record(struct ring *r, const unsigned char *data, size_t len)
+{
+	if (len >= r->size)
+	{
+		r->head = r->len = 0;
+		ring_put(r, data + len - r->size, r->size);
+		return;
+	}
+	if (len > r->size - r->len)
+		ring_consume(r, len - (r->size - r->len));
+	ring_put(r, data, len);
+}
+
+/* Parses a size with an optional k or m suffix. */
+static int
+parse_size(const char *str, size_t *size)
+{
+	char *end;
+	unsigned long n, scale = 1;
+
+	/* strtoul would take a sign, and make -1 the biggest size there
+	** is. */
+	if (*str < '0' || *str > '9')
+		return -1;
+	errno = 0;
+	n = strtoul(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+	if (*end == 'k' || *end == 'K')
+		scale = 1024, ++end;
+	else if (*end == 'm' || *end == 'M')
+		scale = 1024 * 1024, ++end;
+	if (*end || n == 0 || n > SIZE_MAX / scale)
+		return -1;
+	*size = n * scale;
+	return 0;
+}
+
+#ifdef USE_OBSERVERS
+/* Create the shared memory ring that observers read output from. Nobody
+** else gets to write to it once it's set up. */
+static int
+obs_create(struct pty *pty, size_t size)
+{
+	void *map;
+	int fd;
+
+	fd = memfd_create("dtach", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, OBS_DATA + size) < 0)
+		goto fail;
+	map = mmap(NULL, OBS_DATA + size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+#ifdef F_SEAL_FUTURE_WRITE
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_FUTURE_WRITE);
+#else
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW);
+#endif
+
+	pty->obs = map;
+	pty->obs->magic = OBS_MAGIC;
+	pty->obs->size = size;
+	pty->obsfd = fd;
+	return 0;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/* Publish output to the observers, and wake up any that are waiting. The
+** cost is the same however many of them there are. */
+static void
+obs_publish(struct pty *pty, const unsigned char *buf, size_t len)
+{
+	struct obs_ring *r = pty->obs;
+	unsigned char *data = (unsigned char *)r + OBS_DATA;
+	size_t off = r->head % r->size;
+	size_t n = r->size - off;
+
+	if (n > len)
+		n = len;
+	memcpy(data + off, buf, n);
+	memcpy(data, buf + n, len - n);
+	__atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&r->seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &r->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+static uint64_t now_usec(void);
+
+#ifdef USE_RECORDING
+/* Start recording a session's output, if the output is recorded. */
+static int
+pty_record(struct pty *pty)
+{
+	char *path = record_path;
+
+	if (!record_path)
+		return 0;
+	if (pty->name)
+	{
+		path = malloc(strlen(record_path) + strlen(pty->name) + 2);
+		if (!path)
+			return -1;
+		sprintf(path, "%s.%s", record_path, pty->name);
+	}
+	pty->rec = rec_open(path, record_limit, record_compress, now_usec());
+	if (path != record_path)
+		free(path);
+	if (!pty->rec)
+		return -1;
+	return 0;
+}
+#endif
+
+/* Set up the master side of a pty for the main loop. */
+static int
+pty_setup(struct pty *pty)
+{
+	/* A program that stops reading its input mustn't hold us up. */
+	if (setnonblocking(pty->fd) < 0)
+		return -1;
+#ifdef USE_PACKET
+	/* Have the kernel tell us about flow control along with the output,
+	** rather than reading it as it is. */
+	pty->packet = 1;
+	if (ioctl(pty->fd, TIOCPKT, &pty->packet) < 0)
+		pty->packet = 0;
+#endif
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	/* Nor should the programs in other sessions keep it open. */
+	fcntl(pty->fd, F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef USE_SPLICE
+	/* Without a pipe, output just gets read the usual way. */
+	if (pipe2(pty->pipe, O_NONBLOCK|O_CLOEXEC) < 0)
+		pty->pipe[0] = pty->pipe[1] = -1;
+#endif
+	return 0;
+}
+
+/* How a master in the pool tells its program what to run. */
+static int warm_cmd[2] = { -1, -1 };
+
+/* Read what a program started by a pool master is to run: the directory
+** followed by the arguments, each ending in a NUL. Returns NULL if the
+** master went away without saying. */
+static char **
+warm_command(const char **cwd)
+{
+	char *buf, *p, **argv;
+	size_t len = 0;
+	ssize_t n;
+	int argc = 0, i;
+
+	buf = malloc(FRAME_MAX);
+	if (!buf)
+		return NULL;
+	while (len < FRAME_MAX)
+	{
+		n = read(warm_cmd[0], buf + len, FRAME_MAX - len);
+		if (n == 0)
+			break;
+		else if (n < 0 && errno != EINTR)
+			return NULL;
+		else if (n > 0)
+			len += n;
+	}
+	if (len == 0 || buf[len - 1] != 0)
+		return NULL;
+	for (p = buf; p < buf + len; p += strlen(p) + 1)
+		argc++;
+	if (--argc < 1)
+		return NULL;
+
+	argv = malloc((argc + 1) * sizeof(char *));
+	if (!argv)
+		return NULL;
+	*cwd = *buf ? buf : NULL;
+	p = buf + strlen(buf) + 1;
+	for (i = 0; i < argc; p += strlen(p) + 1)
+		argv[i++] = p;
+	argv[argc] = NULL;
+	return argv;
+}
+
+/* Initialize the pty structure. Without a program to run, the child
+** waits to be told what to run (see warm_master). */
 static int
-init_pty(char **argv, int statusfd)
+init_pty(struct pty *pty, char **argv, const char *cwd, int statusfd)
 {
 	/* Use the original terminal's settings. We don't have to set the
 	** window size here, because the attacher will send it in a packet. */
-	the_pty.term = orig_term;
-	memset(&the_pty.ws, 0, sizeof(struct winsize));
+	pty->term = orig_term;
+	memset(&pty->ws, 0, sizeof(struct winsize));
+	if (replay_size && ring_alloc(&pty->replay, replay_size) < 0)
+		return -1;
+	if (detach_policy != DETACH_DROP &&
+		ring_alloc(&pty->held, held_size) < 0)
+		return -1;
+	if (ring_alloc(&pty->inq, INQ_SIZE) < 0)
+		return -1;
+	if (redraw_method == REDRAW_SCREEN)
+	{
+		pty->screen = screen_new(0, 0);
+		if (!pty->screen)
+			return -1;
+	}
+#ifdef USE_OBSERVERS
+	pty->obsfd = -1;
+	if (observe_size && obs_create(pty, observe_size) < 0)
+		return -1;
+#endif
+#ifdef USE_RECORDING
+	if (pty_record(pty) < 0)
+		return -1;
+#endif
+
+	if (!argv)
+	{
+		if (pipe(warm_cmd) < 0)
+			return -1;
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+		fcntl(warm_cmd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(warm_cmd[1], F_SETFD, FD_CLOEXEC);
+#endif
+	}
 
 	/* Create the pty process */
+	pty->term_stale = 1;
 	if (!dont_have_tty)
-		the_pty.pid = forkpty(&the_pty.fd, NULL, &the_pty.term, NULL);
+		pty->pid = forkpty(&pty->fd, NULL, &pty->term, NULL);
 	else
-		the_pty.pid = forkpty(&the_pty.fd, NULL, NULL, NULL);
-	if (the_pty.pid < 0)
+		pty->pid = forkpty(&pty->fd, NULL, NULL, NULL);
+	if (pty->pid < 0)
 		return -1;
-	else if (the_pty.pid == 0)
+	else if (pty->pid == 0)
 	{
-		/* Child.. Execute the program. */
-		execvp(*argv, argv);
+#ifdef USE_SIGNALFD
+		/* Don't leave our blocked signals blocked in the program. */
+		if (sigfd != -1)
+			sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+#endif
+		if (!argv)
+		{
+			close(warm_cmd[1]);
+			argv = warm_command(&cwd);
+			if (!argv)
+				_exit(1);
+		}
+
+		/* Child.. Execute the program, in the directory it was
+		** started from. */
+		if (!cwd || chdir(cwd) == 0)
+			execvp(*argv, argv);
 
-		/* Report the error to statusfd if we can, or stdout if we
-		** can't. */
+		/* Report the error to statusfd if we can, or the terminal if
+		** we can't. */
 		if (statusfd != -1)
-			dup2(statusfd, 1);
+			dup2(statusfd, 2);
 		else
 			fprintf(stderr, "\r\n");
 
 		fprintf(stderr, "%s: could not execute %s: %s\r\n", progname,
 		       *argv, strerror(errno));
-		fflush(stdout);
+		fflush(stderr);
 		_exit(127);
 	}
+	if (!argv)
+		close(warm_cmd[0]);
 	/* Parent.. Finish up and return */
 #ifdef BROKEN_MASTER
 	{
 		char *buf;
 
-		buf = ptsname(the_pty.fd);
-		the_pty.slave = open(buf, O_RDWR|O_NOCTTY);
+		buf = ptsname(pty->fd);
+		pty->slave = open(buf, O_RDWR|O_NOCTTY);
 	}
 #endif
-	return 0;
+	return pty_setup(pty);
 }
 
 /* Send a signal to the slave side of a pseudo-terminal. */
@@ -250,203 +938,3153 @@ create_socket(char *name)
 	return s;
 }
 
-/* Process activity on the pty - Input and terminal changes are sent out to
-** the attached clients. If the pty goes away, we die. */
+/* Whether anyone is attached to a session or watching it. */
 static int
-pty_activity(int s)
+pty_watched(struct pty *pty)
 {
-	unsigned char buf[BUFSIZE];
-	ssize_t len;
 	struct client *p;
-	fd_set readfds, writefds;
-	int highest_fd, nclients;
-
-	/* Read the pty activity */
-	len = read(the_pty.fd, buf, sizeof(buf));
 
-	/* Error or zero read */
-	if (len < 0 && errno == EIO)
-	{
-		/* EIO can mean pty slave is closed, which is OK. */
-		stop = 1;
-		return 0;
-	}
-	else if (len <= 0)
+	if (pty->nobservers > 0)
 		return 1;
+	for (p = pty->clients; p; p = p->next)
+		if (p->attached)
+			return 1;
+	return 0;
+}
 
-#ifdef BROKEN_MASTER
-	/* Get the current terminal settings. */
-	if (tcgetattr(the_pty.slave, &the_pty.term) < 0)
-		return 1;
-#else
-	/* Get the current terminal settings. */
-	if (tcgetattr(the_pty.fd, &the_pty.term) < 0)
-		return 1;
-#endif
+/* Whether the program is paused until someone attaches, because the output
+** that nobody has seen fills the room we keep for it. */
+static int
+pty_paused(struct pty *pty)
+{
+	return detach_policy == DETACH_PAUSE &&
+		pty->held.len == pty->held.size && !pty_watched(pty);
+}
 
-top:
-	/*
-	** Wait until at least one client is writable. Also wait on the control
-	** socket in case a new client tries to connect.
-	*/
-	FD_ZERO(&readfds);
-	FD_ZERO(&writefds);
-	FD_SET(s, &readfds);
-	highest_fd = s;
-	for (p = clients, nclients = 0; p; p = p->next)
-	{
-		if (!p->attached)
-			continue;
-		FD_SET(p->fd, &writefds);
-		if (p->fd > highest_fd)
-			highest_fd = p->fd;
-		nclients++;
-	}
-	if (nclients == 0)
-		return 0;
-	/* XXX In what cases should this be fatal... */
-	if (select(highest_fd + 1, &readfds, &writefds, NULL, NULL) < 0)
+/* Whether to read the program's output: once a client has attached if it
+** should wait for one, while the clients can keep up, while no client
+** has the pty to itself, and unless it is paused. */
+static int
+pty_reading(struct pty *pty)
+{
+#ifdef USE_DIRECT
+	if (pty->direct)
 		return 0;
+#endif
+	return !pty->waitattach && !pty->nblocking && !pty_paused(pty);
+}
 
-	/* Send the data out to the clients. */
-	for (p = clients, nclients = 0; p; p = p->next)
-	{
-		ssize_t written;
-
-		if (!FD_ISSET(p->fd, &writefds))
-			continue;
-
-		written = 0;
-		while (written < len)
-		{
-			ssize_t n = write(p->fd, buf + written, len - written);
-
-			if (n > 0)
-			{
-				written += n;
-				continue;
-			}
-			else if (n < 0 && errno == EINTR)
-				continue;
-			else if (n < 0 && errno != EAGAIN)
-				nclients = -1;
-			break;
-		}
-		if (nclients != -1 && written == len)
-			nclients++;
-	}
+#ifdef USE_EPOLL
+/* Registers a file descriptor with epoll. */
+static int
+watch_fd(int fd, unsigned int events, void *ptr)
+{
+	struct epoll_event ev;
 
-	/* Try again if nothing happened. */
-	if (!FD_ISSET(s, &readfds) && nclients == 0)
-		goto top;
-	return 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-/* Process activity on the control socket */
+/* Have the main loop look at a pty. Anything that changes which events it
+** should be registered for calls this. */
 static void
-control_activity(int s)
+pty_touch(struct pty *pty)
 {
-	int fd;
-	struct client *p;
- 
-	/* Accept the new client and link it in. */
-	fd = accept(s, NULL, NULL);
-	if (fd < 0)
-		return;
-	else if (setnonblocking(fd) < 0)
+	if (!pty->on_pending)
 	{
-		close(fd);
-		return;
+		pty->on_pending = 1;
+		pty->pending_next = pending;
+		pending = pty;
 	}
-
-	/* Link it in. */
-	p = malloc(sizeof(struct client));
-	p->fd = fd;
-	p->attached = 0;
-	p->pprev = &clients;
-	p->next = *(p->pprev);
-	if (p->next)
-		p->next->pprev = &p->next;
-	*(p->pprev) = p;
 }
 
-/* Process activity from a client. */
-static void
-client_activity(struct client *p)
+/* Register the pty for the events it needs. Only read from it when we
+** should, and wait for it to take more input if it has some queued. */
+static int
+pty_watch(struct pty *pty)
 {
-	ssize_t len;
-	struct packet pkt;
-
-	/* Read the activity. */
-	len = read(p->fd, &pkt, sizeof(struct packet));
-	if (len < 0 && (errno == EAGAIN || errno == EINTR))
-		return;
-
-	/* Close the client on an error. */
-	if (len <= 0)
-	{
-		close(p->fd);
-		if (p->next)
-			p->next->pprev = p->pprev;
-		*(p->pprev) = p->next;
-		free(p);
-		return;
-	} 
+	struct epoll_event ev;
+	unsigned int events = 0;
 
-	/* Push out data to the program. */
-	if (pkt.type == MSG_PUSH)
-	{
-		if (pkt.len <= sizeof(pkt.u.buf))
-			write(the_pty.fd, pkt.u.buf, pkt.len);
-	}
+	if (pty_reading(pty))
+		events |= EPOLLIN;
+	if (pty->inq.len > 0)
+		events |= EPOLLOUT;
+	if (!(events & EPOLLIN))
+		pty->readable = 0;
+	if (events == pty->events)
+		return 0;
 
-	/* Attach or detach from the program. */
-	else if (pkt.type == MSG_ATTACH)
-		p->attached = 1;
-	else if (pkt.type == MSG_DETACH)
-		p->attached = 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = pty;
+	if (epoll_ctl(epfd, !pty->events ? EPOLL_CTL_ADD :
+		!events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, pty->fd, &ev) < 0)
+		return -1;
+	pty->events = events;
+	return 0;
+}
 
-	/* Window size change request, without a forced redraw. */
-	else if (pkt.type == MSG_WINCH)
-	{
-		the_pty.ws = pkt.u.ws;
-		ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
-	}
+/* Wait for something to happen, and note what is now ready. */
+static int
+poll_events(int timeout)
+{
+	struct epoll_event events[64];
+	int i, n;
 
-	/* Force a redraw using a particular method. */
-	else if (pkt.type == MSG_REDRAW)
+	n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+		timeout);
+	for (i = 0; i < n; ++i)
 	{
-		int method = pkt.len;
-
-		/* If the client didn't specify a particular method, use
-		** whatever we had on startup. */
-		if (method == REDRAW_UNSPEC)
-			method = redraw_method;
-		if (method == REDRAW_NONE)
-			return;
-
-		/* Set the window size. */
-		the_pty.ws = pkt.u.ws;
-		ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+		void *ptr = events[i].data.ptr;
+		struct client *p;
+		struct pty *pty;
 
-		/* Send a ^L character if the terminal is in no-echo and
-		** character-at-a-time mode. */
-		if (method == REDRAW_CTRL_L)
+		if (ptr == &control_tag)
+			control_ready = 1;
+		else if (ptr == &signal_tag)
+			signal_ready = 1;
+		/* Writability is handled by flushing the input queue, which
+		** happens whenever the pty is looked at. */
+		else if (*(int *)ptr == KIND_PTY)
 		{
-			char c = '\f';
-
-                	if (((the_pty.term.c_lflag & (ECHO|ICANON)) == 0) &&
-                        	(the_pty.term.c_cc[VMIN] == 1))
-			{
-				write(the_pty.fd, &c, 1);
-			}
+			pty = ptr;
+			if (events[i].events & ~EPOLLOUT)
+				pty->readable = 1;
+			pty_touch(pty);
 		}
-		/* Send a WINCH signal to the program. */
-		else if (method == REDRAW_WINCH)
+		else
 		{
-			killpty(&the_pty, SIGWINCH);
+			p = ptr;
+			if (events[i].events & EPOLLOUT)
+				p->writable = 1;
+			/* Hangups and errors are found by reading. */
+			if (events[i].events & ~EPOLLOUT)
+				p->readable = 1;
+			if (!p->on_ready && (p->readable ||
+				(p->writable && p->outq.len > 0)))
+			{
+				p->on_ready = 1;
+				p->ready_next = ready;
+				ready = p;
+			}
 		}
 	}
+	return n;
+}
+#else
+/* The main loop looks at every pty anyway. */
+static void
+pty_touch(struct pty *pty)
+{
+	(void)pty;
+}
+#endif
+
+#ifdef USE_SIGNALFD
+/* Process signals that arrived on the signalfd. */
+static void
+signal_activity(void)
+{
+	struct signalfd_siginfo si;
+
+	signal_ready = 0;
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+		die(si.ssi_signo);
+}
+#endif
+
+/* Queue input for the program. It is written out after the clients have
+** been dealt with, so input from several messages goes out in one write.
+** Returns -1 if there isn't room for it. */
+static int
+pty_push(struct pty *pty, const unsigned char *buf, size_t len)
+{
+	if (len > pty->inq.size - pty->inq.len)
+		return -1;
+	if (pty->inq.len == 0)
+		pty->in_since = input_since;
+	ring_put(&pty->inq, buf, len);
+	pty_touch(pty);
+	return 0;
+}
+
+/* Bring the terminal parameters up to date, if they might have changed.
+** Returns -1 if they couldn't be looked at. */
+static int
+pty_getattr(struct pty *pty)
+{
+	if (!pty->term_stale)
+		return 0;
+#ifdef BROKEN_MASTER
+	if (tcgetattr(pty->slave, &pty->term) < 0)
+		return -1;
+#else
+	if (tcgetattr(pty->fd, &pty->term) < 0)
+		return -1;
+#endif
+	pty->term_stale = 0;
+	return 0;
+}
+
+/* Send a redraw request to the program using a particular method. */
+static void
+redraw(struct pty *pty, int method)
+{
+	/* Send a ^L character if the terminal is in no-echo and
+	** character-at-a-time mode. */
+	if (method == REDRAW_CTRL_L)
+	{
+		unsigned char c = '\f';
+
+		if (pty_getattr(pty) == 0 &&
+			((pty->term.c_lflag & (ECHO|ICANON)) == 0) &&
+			(pty->term.c_cc[VMIN] == 1))
+		{
+			pty_push(pty, &c, 1);
+		}
+	}
+	/* Send a WINCH signal to the program. */
+	else if (method == REDRAW_WINCH)
+	{
+		killpty(pty, SIGWINCH);
+	}
+}
+
+/* Change the window size of the pty. */
+static void
+set_winsize(struct pty *pty, struct winsize *ws)
+{
+	pty->ws = *ws;
+	ioctl(pty->fd, TIOCSWINSZ, &pty->ws);
+	if (pty->screen)
+		screen_resize(pty->screen, ws->ws_row, ws->ws_col);
+}
+
+/* The time in microseconds, from some fixed point. */
+static uint64_t
+now_usec(void)
+{
+	struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * (uint64_t)1000000 + tv.tv_usec;
+}
+
+/* Add an observation to a histogram. */
+static void
+hist_observe(struct histogram *h, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < h->nbounds && v > h->bounds[i]; ++i)
+		;
+	h->counts[i]++;
+	h->sum += v;
+	h->count++;
+}
+
+/* Note an event in the trace ring. */
+static void
+trace_put(int type, uint32_t id, uint32_t len, int arg)
+{
+	struct trace_event *e = &trace[trace_count++ % TRACE_EVENTS];
+
+	e->usec = now_usec();
+	e->id = id;
+	e->len = len;
+	e->type = type;
+	e->arg = arg;
+	e->pad = 0;
+}
+
+/* Count a write of len bytes to a client, which wrote n of them. */
+static void
+count_write(struct client *p, size_t len, ssize_t n)
+{
+	int i;
+
+	PROBE3(client_write, p->id, len, n);
+	trace_put(TRACE_CLIENT_WRITE, p->id, n < 0 ? 0 : n, (size_t)n != len);
+	if (n < 0)
+	{
+		if (errno != EAGAIN)
+			return;
+		i = CLIENT_EAGAIN;
+	}
+	else
+	{
+		p->counts[CLIENT_SENT] += n;
+		metrics.client[CLIENT_SENT] += n;
+		if ((size_t)n == len)
+			return;
+		i = CLIENT_SHORT;
+	}
+	p->counts[i]++;
+	metrics.client[i]++;
+}
+
+/* Time output that was just read from the pty until every attached client
+** has been sent it, unless some earlier output is still being timed. */
+static void
+pty_timed(struct pty *pty, uint64_t start)
+{
+	struct client *p;
+	int n = 0;
+
+	if (pty->lat_owed)
+		return;
+	for (p = pty->clients; p; p = p->next)
+	{
+		if (!p->attached)
+			continue;
+		n++;
+		if (p->outq.len > 0)
+		{
+			p->lat_owed = 1;
+			pty->lat_owed++;
+		}
+	}
+	if (n > 0 && !pty->lat_owed)
+		hist_observe(&metrics.latency, now_usec() - start);
+	pty->lat_start = start;
+}
+
+/* A client has been sent the output being timed, or never will be. */
+static void
+client_delivered(struct client *p)
+{
+	if (!p->lat_owed)
+		return;
+	p->lat_owed = 0;
+	if (--p->pty->lat_owed == 0)
+		hist_observe(&metrics.latency, now_usec() - p->pty->lat_start);
+}
+
+/* Stop letting a client's backlog hold up the pty. */
+static void
+client_unblock(struct client *p)
+{
+	if (p->blocking)
+	{
+		p->blocking = 0;
+		if (--p->pty->nblocking == 0)
+			pty_touch(p->pty);
+	}
+}
+
+/* Take the pty back from a client that had it to itself. The output it
+** didn't read waits in the pty for us. */
+static void
+client_undirect(struct client *p)
+{
+#ifdef USE_DIRECT
+	if (!p->direct)
+		return;
+	p->direct = 0;
+	p->pty->direct = NULL;
+	/* The client heard about any changes to the terminal, not us. */
+	p->pty->term_stale = 1;
+	pty_touch(p->pty);
+#else
+	(void)p;
+#endif
+}
+
+/* Get a zeroed client record, with whatever input buffer it had. */
+static struct client *
+client_alloc(void)
+{
+	struct client *p;
+	unsigned char *in;
+	int i;
+
+	if (!free_clients)
+	{
+		p = calloc(CLIENT_SLAB, sizeof(struct client));
+		if (!p)
+			return NULL;
+		for (i = CLIENT_SLAB - 1; i >= 0; --i)
+		{
+			p[i].next = free_clients;
+			free_clients = &p[i];
+		}
+		client_records += CLIENT_SLAB;
+		client_records_free += CLIENT_SLAB;
+	}
+	p = free_clients;
+	free_clients = p->next;
+	client_records_free--;
+
+	in = p->in;
+	memset(p, 0, sizeof(struct client));
+	p->in = in;
+	return p;
+}
+
+/* Put a client record back for the next client. The input buffer stays
+** with it if it has room for packets. */
+static void
+client_free(struct client *p)
+{
+	free(p->outq.buf);
+	if (p->insize < LEGACY_INSIZE)
+	{
+		free(p->in);
+		p->in = NULL;
+	}
+	p->next = free_clients;
+	free_clients = p;
+	client_records_free++;
+}
+
+/* Hang up on a client. Reading from it will then clean it up. */
+static void
+client_hangup(struct client *p)
+{
+	shutdown(p->fd, SHUT_RDWR);
+	p->attached = 0;
+	ring_consume(&p->outq, p->outq.len);
+	client_unblock(p);
+	client_delivered(p);
+	client_undirect(p);
+}
+
+/* Link a client into a list. */
+static void
+client_link(struct client *p, struct client **list)
+{
+	p->pprev = list;
+	p->next = *list;
+	if (p->next)
+		p->next->pprev = &p->next;
+	*list = p;
+}
+
+/* Unlink a client from the list it is on. */
+static void
+client_unlink(struct client *p)
+{
+	if (p->next)
+		p->next->pprev = p->pprev;
+	*(p->pprev) = p->next;
+}
+
+/* Free a pty and everything that goes with it. */
+static void
+pty_release(struct pty *pty)
+{
+	if (pty->fd >= 0)
+		close(pty->fd);
+#ifdef BROKEN_MASTER
+	if (pty->slave >= 0)
+		close(pty->slave);
+#endif
+#ifdef USE_SPLICE
+	if (pty->pipe[0] >= 0)
+	{
+		close(pty->pipe[0]);
+		close(pty->pipe[1]);
+	}
+#endif
+#ifdef USE_OBSERVERS
+	if (pty->obs)
+		munmap(pty->obs, OBS_DATA + pty->obs->size);
+	if (pty->obsfd >= 0)
+		close(pty->obsfd);
+#endif
+	if (pty->screen)
+		screen_free(pty->screen);
+#ifdef USE_RECORDING
+	if (pty->rec)
+		rec_close(pty->rec);
+#endif
+	free(pty->replay.buf);
+	free(pty->held.buf);
+	free(pty->inq.buf);
+	free(pty->name);
+}
+
+/* Free a session. */
+static void
+pty_free(struct pty *pty)
+{
+	pty_release(pty);
+	free(pty);
+}
+
+/* Start a session running argv, and add it to the list. */
+static struct pty *
+pty_new(const char *name, char **argv, const char *cwd, int waitattach,
+	int statusfd)
+{
+	struct pty *pty;
+	int saved_errno;
+
+	pty = calloc(1, sizeof(struct pty));
+	if (!pty)
+		return NULL;
+#ifdef USE_EPOLL
+	pty->kind = KIND_PTY;
+#endif
+	pty->fd = -1;
+#ifdef BROKEN_MASTER
+	pty->slave = -1;
+#endif
+#ifdef USE_SPLICE
+	pty->pipe[0] = pty->pipe[1] = -1;
+#endif
+#ifdef USE_OBSERVERS
+	pty->obsfd = -1;
+#endif
+	pty->waitattach = waitattach;
+	pty->started = pty->active = time(NULL);
+	if ((name && !(pty->name = strdup(name))) ||
+		init_pty(pty, argv, cwd, statusfd) < 0)
+	{
+		saved_errno = errno;
+		pty_free(pty);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	pty->next = sessions;
+	sessions = pty;
+	pty_touch(pty);
+	return pty;
+}
+
+/* End a session whose program has gone away, or whose pty has failed. Its
+** clients are hung up, and are left without a session until they notice.
+** The other sessions carry on, and without any we are done. */
+static void
+pty_close(struct pty *pty)
+{
+	struct client *p;
+	struct pty **pp;
+
+	while ((p = pty->clients))
+	{
+		client_hangup(p);
+		p->waiting = p->observer = 0;
+		client_unlink(p);
+		p->pty = NULL;
+		client_link(p, &unbound);
+	}
+#ifdef USE_EPOLL
+	/* Like a client's, the pty may still be shared with a new program. */
+	if (pty->events)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, pty->fd, NULL);
+	for (pp = &pending; *pp; pp = &(*pp)->pending_next)
+		if (*pp == pty)
+		{
+			*pp = pty->pending_next;
+			break;
+		}
+#endif
+	for (pp = &sessions; *pp; pp = &(*pp)->next)
+		if (*pp == pty)
+		{
+			*pp = pty->next;
+			break;
+		}
+	pty_free(pty);
+
+	if (!sessions)
+		stop = 1;
+}
+
+static void client_write(struct client *p, const unsigned char *buf,
+	size_t len);
+static void client_output(struct client *p, const unsigned char *buf,
+	size_t len);
+
+/* Redraw a client's screen. With a screen model, only that client is sent
+** the current screen, and otherwise the program is asked to redraw. */
+static void
+client_redraw(struct client *p, int method)
+{
+	unsigned char *buf;
+	size_t len;
+
+	/* If the client didn't specify a particular method, use whatever we
+	** had on startup. */
+	if (method == REDRAW_UNSPEC)
+		method = redraw_method;
+	if (method == REDRAW_SCREEN && !p->pty->screen)
+		method = REDRAW_CTRL_L;
+
+	if (method == REDRAW_SCREEN)
+	{
+		buf = screen_snapshot(p->pty->screen, &len);
+		if (buf)
+		{
+			client_output(p, buf, len);
+			free(buf);
+		}
+	}
+	else
+		redraw(p->pty, method);
+}
+
+/* Carry out the window size change and the redraws that the clients of a
+** session asked for, now that the requests have settled. */
+static void
+pty_settle(struct pty *pty)
+{
+	struct winsize ws = pty->ws_want;
+	struct client *p;
+	int n, method;
+
+	pty->settle_at = 0;
+	if (pty->resize_pending)
+	{
+		pty->resize_pending = 0;
+
+		/* The biggest window that every attached client can show. The
+		** pixel sizes don't mean anything across clients. */
+		if (size_policy == SIZE_SMALLEST)
+		{
+			ws = pty->ws;
+			for (n = 0, p = pty->clients; p; p = p->next)
+			{
+				if (!p->attached || !p->has_ws)
+					continue;
+				if (n++ == 0)
+					ws = p->ws;
+				else
+				{
+					if (p->ws.ws_row < ws.ws_row)
+						ws.ws_row = p->ws.ws_row;
+					if (p->ws.ws_col < ws.ws_col)
+						ws.ws_col = p->ws.ws_col;
+					ws.ws_xpixel = ws.ws_ypixel = 0;
+				}
+			}
+		}
+		if (memcmp(&ws, &pty->ws, sizeof(ws)) != 0)
+		{
+			set_winsize(pty, &ws);
+			metrics.resizes++;
+		}
+	}
+
+	/* The program only has to redraw once for everyone. */
+	method = pty->redraw_pending;
+	pty->redraw_pending = 0;
+	if (method)
+	{
+		redraw(pty, method);
+		metrics.redraws++;
+	}
+	for (p = pty->clients; p; p = p->next)
+		if (p->snapshot_pending)
+		{
+			p->snapshot_pending = 0;
+			client_redraw(p, REDRAW_SCREEN);
+			metrics.redraws++;
+		}
+}
+
+/* Hold a session's requests until they settle, unless they aren't held. */
+static void
+pty_defer(struct pty *pty)
+{
+	if (settle_ms == 0)
+		pty_settle(pty);
+	else if (!pty->settle_at)
+		pty->settle_at = now_usec() + (uint64_t)settle_ms * 1000;
+}
+
+/* Note the window size that a client asked for. A NULL client means that
+** one has detached or gone away, which may leave room for a bigger window
+** when the smallest one is used. */
+static void
+pty_want_size(struct pty *pty, struct client *p, struct winsize *ws)
+{
+	if (p)
+	{
+		p->ws = *ws;
+		p->has_ws = 1;
+		pty->ws_want = *ws;
+		metrics.resize_requests++;
+	}
+	else if (size_policy != SIZE_SMALLEST)
+		return;
+	pty->resize_pending = 1;
+	pty_defer(pty);
+}
+
+/* Ask for a client's screen to be redrawn once the requests settle. With a
+** screen model, only that client is sent the screen, and otherwise the
+** program is asked to redraw, once for all of the clients. */
+static void
+client_want_redraw(struct client *p, int method)
+{
+	if (method == REDRAW_UNSPEC)
+		method = redraw_method;
+	if (method == REDRAW_SCREEN && !p->pty->screen)
+		method = REDRAW_CTRL_L;
+	if (method == REDRAW_NONE)
+		return;
+
+	metrics.redraw_requests++;
+	if (method == REDRAW_SCREEN)
+		p->snapshot_pending = 1;
+	else
+		p->pty->redraw_pending = method;
+	pty_defer(p->pty);
+}
+
+/* Settle the requests of the sessions whose time has come. Returns how
+** long until the next ones do in milliseconds, or -1 if none are held. */
+static int
+settle_due(void)
+{
+	struct pty *pty;
+	uint64_t now = 0, next = 0;
+
+	for (pty = sessions; pty; pty = pty->next)
+	{
+		if (!pty->settle_at)
+			continue;
+		if (!now)
+			now = now_usec();
+		if (pty->settle_at <= now)
+			pty_settle(pty);
+		else if (!next || pty->settle_at - now < next)
+			next = pty->settle_at - now;
+	}
+	return next ? (int)((next + 999) / 1000) : -1;
+}
+
+/* Whether a client's output queue is held because the program's output
+** is stopped, as it would be in a terminal. A queue that is holding up the
+** pty still goes out, or we would never read that it has been started. */
+static int
+client_held(struct client *p)
+{
+#ifdef USE_PACKET
+	return p->attached && p->pty->stopped && !p->blocking;
+#else
+	(void)p;
+	return 0;
+#endif
+}
+
+/* Write out as much of a client's output queue as it will take. */
+static void
+client_flush(struct client *p)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	if (client_held(p))
+		return;
+	while (p->outq.len > 0)
+	{
+		n = writev(p->fd, iov, ring_iov(&p->outq, iov));
+		count_write(p, p->outq.len, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+		{
+#ifdef USE_EPOLL
+			p->writable = 0;
+#endif
+			break;
+		}
+		/* The client is going away; reading will notice. */
+		else if (n <= 0)
+		{
+			ring_consume(&p->outq, p->outq.len);
+			break;
+		}
+		ring_consume(&p->outq, n);
+	}
+	if (p->outq.len == 0)
+		client_delivered(p);
+
+	/* Let the pty go again once we are under the low watermark. */
+	if (p->blocking && p->outq.len <= p->outq.size / 4)
+		client_unblock(p);
+
+	/* Once a client that lost output catches up, redraw its screen. */
+	if (p->resync && p->outq.len == 0)
+	{
+		p->resync = 0;
+		client_want_redraw(p, p->redraw);
+	}
+}
+
+/* Send output to a client, queueing whatever it can't take right now. */
+static void
+client_write(struct client *p, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	/* Skip the queue if it is empty. */
+	while (p->outq.len == 0 && len > 0)
+	{
+#ifdef USE_EPOLL
+		if (!p->writable)
+			break;
+#endif
+		n = write(p->fd, buf, len);
+		count_write(p, len, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+		{
+#ifdef USE_EPOLL
+			p->writable = 0;
+#endif
+			break;
+		}
+		/* The client is going away; reading will notice. */
+		else if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+	if (len == 0)
+		return;
+
+	if (!p->outq.buf && ring_alloc(&p->outq, outq_size) < 0)
+	{
+		client_hangup(p);
+		return;
+	}
+
+	/* The client has fallen too far behind. */
+	if (len > p->outq.size - p->outq.len)
+	{
+		if (p->overflow == OVERFLOW_DISCONNECT)
+		{
+			client_hangup(p);
+			return;
+		}
+
+		/* Frames can't be cut short, so a client that takes them
+		** loses this one instead of its backlog. */
+		if (p->codec)
+		{
+			p->resync = 1;
+			return;
+		}
+
+		/* Blocking clients hold up the pty before it gets this far,
+		** so they only end up here with oversized writes. */
+		ring_consume(&p->outq, p->outq.len);
+		if (len > p->outq.size)
+		{
+			buf += len - p->outq.size;
+			len = p->outq.size;
+		}
+		p->resync = 1;
+	}
+	ring_put(&p->outq, buf, len);
+
+	/* Hold up the pty before the queue can overflow. */
+	if (p->overflow == OVERFLOW_BLOCK && !p->blocking && p->pty &&
+		p->outq.size - p->outq.len < BUFSIZE)
+	{
+		p->blocking = 1;
+		if (p->pty->nblocking++ == 0)
+			pty_touch(p->pty);
+	}
+}
+
+/* Put up to BUFSIZE bytes of output in a frame, for a client that has its
+** output compressed, if compressing it makes it any smaller. The frame
+** needs room for FRAME_HDR more bytes. Returns the length of the frame. */
+static size_t
+frame_output(int codec, const unsigned char *buf, size_t len,
+	unsigned char *frame)
+{
+	size_t n;
+
+	n = compress_chunk(codec, buf, len, frame + FRAME_HDR, len - 1);
+	if (n == 0)
+	{
+		memcpy(frame + FRAME_HDR, buf, len);
+		n = len;
+		codec = 0;
+	}
+	frame[0] = MSG_PUSH;
+	frame[1] = codec;
+	frame[2] = n >> 8;
+	frame[3] = n & 0xff;
+	metrics.compress_in += len;
+	metrics.compress_out += n;
+	return FRAME_HDR + n;
+}
+
+/* Send output to a client, in frames if it has its output compressed. */
+static void
+client_output(struct client *p, const unsigned char *buf, size_t len)
+{
+	unsigned char frame[FRAME_HDR + BUFSIZE];
+	size_t n;
+
+	if (!p->codec)
+	{
+		client_write(p, buf, len);
+		return;
+	}
+	while (len > 0)
+	{
+		n = len < BUFSIZE ? len : BUFSIZE;
+		client_write(p, frame, frame_output(p->codec, buf, n, frame));
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Send a newly attached client the most recent output. */
+static void
+client_replay(struct client *p)
+{
+	struct iovec iov[2];
+	unsigned char *nl;
+	int i, n;
+
+	p->replayed = 1;
+	n = ring_iov(&p->pty->replay, iov);
+
+	/* If older output was thrown away, we may be in the middle of a line
+	** or an escape sequence, so start at the next line. */
+	if (p->pty->replay.len == p->pty->replay.size)
+	{
+		for (i = 0; i < n; ++i)
+		{
+			nl = memchr(iov[i].iov_base, '\n', iov[i].iov_len);
+			if (nl)
+			{
+				iov[i].iov_len -= nl + 1 -
+					(unsigned char *)iov[i].iov_base;
+				iov[i].iov_base = nl + 1;
+				break;
+			}
+			iov[i].iov_len = 0;
+		}
+		if (i == n)
+			return;
+	}
+
+	for (i = 0; i < n; ++i)
+		client_output(p, iov[i].iov_base, iov[i].iov_len);
+}
+
+/* Send a client that attaches the output that nobody saw, and let the
+** program carry on if it was paused. Clients that attach later get it with
+** the replay buffer, if there is one. */
+static void
+client_unhold(struct client *p)
+{
+	struct pty *pty = p->pty;
+	struct iovec iov[2];
+	int i, n;
+
+	n = ring_iov(&pty->held, iov);
+	for (i = 0; i < n; ++i)
+	{
+		client_output(p, iov[i].iov_base, iov[i].iov_len);
+		if (pty->replay.buf)
+			ring_record(&pty->replay, iov[i].iov_base,
+				iov[i].iov_len);
+	}
+	ring_consume(&pty->held, pty->held.len);
+	pty_touch(pty);
+}
+
+#ifdef USE_SPLICE
+/* Discard whatever is left in a pipe. */
+static void
+drain_pipe(int fd)
+{
+	unsigned char buf[BUFSIZE];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/* Whether the next output can bypass the master. It needs to be looked at
+** if it's being recorded, and it has to be queued behind any backlog. */
+static int
+can_splice(struct pty *pty)
+{
+	struct client *p;
+	int n = 0;
+
+	if (pty->pipe[0] < 0 || pty->replay.buf || pty->screen ||
+		pty->nobservers > 0)
+		return 0;
+#ifdef USE_RECORDING
+	if (pty->rec)
+		return 0;
+#endif
+	for (p = pty->clients; p; p = p->next)
+	{
+		if (!p->attached)
+			continue;
+		if (p->outq.len > 0 || p->codec)
+			return 0;
+		if (p->pipe[0] < 0 &&
+			pipe2(p->pipe, O_NONBLOCK|O_CLOEXEC) < 0)
+			return 0;
+		n++;
+	}
+	return n > 0;
+}
+
+/* Send output sitting in the pty's pipe to a client. The last client gets
+** the pipe's contents moved to it rather than copied. */
+static void
+client_tee(struct client *p, size_t len, int last)
+{
+	unsigned char buf[BUFSIZE];
+	ssize_t n;
+
+	if (last)
+		n = splice(p->pty->pipe[0], NULL, p->pipe[1], NULL, len,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	else
+		n = tee(p->pty->pipe[0], p->pipe[1], len, SPLICE_F_NONBLOCK);
+
+	/* The client's pipe is empty, so this shouldn't happen. */
+	if (n != (ssize_t)len)
+	{
+		drain_pipe(p->pipe[0]);
+		client_hangup(p);
+		return;
+	}
+
+	while (len > 0)
+	{
+#ifdef USE_EPOLL
+		if (!p->writable)
+			break;
+#endif
+		n = splice(p->pipe[0], NULL, p->fd, NULL, len,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		count_write(p, len, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+		{
+#ifdef USE_EPOLL
+			p->writable = 0;
+#endif
+			break;
+		}
+		/* The client is going away; reading will notice. */
+		else if (n <= 0)
+		{
+			drain_pipe(p->pipe[0]);
+			return;
+		}
+		len -= n;
+	}
+
+	/* Whatever the client couldn't take goes through the queue. */
+	if (len > 0)
+	{
+		n = read(p->pipe[0], buf, len);
+		if (n > 0)
+			client_write(p, buf, n);
+	}
+}
+
+/* Splice pty output into the pty's pipe, and from there to the clients.
+** If splicing from the pty doesn't work, the pipe is closed so that the
+** output is read instead from then on. In packet mode, the header is read
+** out of the pipe into status, and only output goes on to the clients. */
+static ssize_t
+pty_splice(struct pty *pty, int hdr, unsigned char *status)
+{
+	struct client *p, *last = NULL;
+	ssize_t len;
+
+	len = splice(pty->fd, NULL, pty->pipe[1], NULL, BUFSIZE + hdr,
+		SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+	/* Not every kernel can splice from a pty. */
+	if (len < 0 && errno == EINVAL)
+	{
+		close(pty->pipe[0]);
+		close(pty->pipe[1]);
+		pty->pipe[0] = pty->pipe[1] = -1;
+		return -1;
+	}
+	if (len <= 0)
+		return len;
+	if (hdr)
+	{
+		if (read(pty->pipe[0], status, 1) != 1)
+		{
+			drain_pipe(pty->pipe[0]);
+			return -1;
+		}
+		/* News about the terminal comes on its own, without any
+		** output for the clients. */
+		if (*status != 0)
+			return len;
+	}
+
+	for (p = pty->clients; p; p = p->next)
+		if (p->attached)
+			last = p;
+	for (p = pty->clients; p; p = p->next)
+		if (p->attached)
+			client_tee(p, len - hdr, p == last);
+	drain_pipe(pty->pipe[0]);
+	return len;
+}
+#endif
+
+#ifdef USE_PACKET
+/* Deal with news about the terminal, which comes in packet mode instead of
+** output. */
+static void
+pty_packet(struct pty *pty, int status)
+{
+	struct client *p;
+
+	/* The start and stop characters were turned on or off, or the
+	** settings were changed some other way. */
+	if (status & (TIOCPKT_NOSTOP|TIOCPKT_DOSTOP))
+		pty->term_stale = 1;
+#ifdef TIOCPKT_IOCTL
+	if (status & TIOCPKT_IOCTL)
+		pty->term_stale = 1;
+#endif
+
+	/* Hold the clients' backlogs while the output is stopped, and send
+	** them on once it starts again. */
+	if (status & TIOCPKT_STOP)
+		pty->stopped = 1;
+	if (status & TIOCPKT_START)
+	{
+		pty->stopped = 0;
+		for (p = pty->clients; p; p = p->next)
+		{
+#ifdef USE_EPOLL
+			if (!p->writable)
+				continue;
+#endif
+			if (p->outq.len > 0)
+				client_flush(p);
+		}
+	}
+}
+#endif
+
+/* Process activity on the pty - Input and terminal changes are sent out to
+** the attached clients. Returns 1 if the program has gone away, and -1 if
+** something went wrong. */
+static int
+pty_activity(struct pty *pty)
+{
+	/* Leave room in front of the output for the packet mode header. */
+	unsigned char in[1 + BUFSIZE], *buf = in + 1;
+	unsigned char frames[COMPRESS_CODECS][FRAME_HDR + BUFSIZE];
+	int codecs[COMPRESS_CODECS], nframes = 0, i;
+	size_t framelen[COMPRESS_CODECS];
+	ssize_t len;
+	struct client *p;
+	int spliced = 0, hdr = 0, keep = 0;
+	size_t want = BUFSIZE;
+	uint64_t start;
+
+#ifdef USE_PACKET
+	hdr = pty->packet;
+#endif
+	/* With nobody there to see it, the output is kept for whoever
+	** attaches next, if it is kept at all. Paused programs only get to
+	** write as much as there is room for. */
+	if (pty->held.buf && !pty_watched(pty))
+	{
+		keep = 1;
+		if (detach_policy == DETACH_PAUSE)
+			want = pty->held.size - pty->held.len;
+		if (want > BUFSIZE)
+			want = BUFSIZE;
+		if (want == 0)
+			return 0;
+	}
+#ifdef USE_SPLICE
+	/* Skip the copy through here if we can. */
+	if (can_splice(pty))
+	{
+		len = pty_splice(pty, hdr, buf - hdr);
+		spliced = (pty->pipe[0] >= 0);
+	}
+	if (!spliced)
+#endif
+	/* Read the pty activity */
+	len = read(pty->fd, buf - hdr, want + hdr);
+
+	/* Error or zero read */
+	if (len < 0 && errno == EIO)
+	{
+		/* EIO can mean pty slave is closed, which is OK. */
+		return 1;
+	}
+	else if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	else if (len <= 0)
+		return -1;
+#ifdef USE_PACKET
+	/* In packet mode, a header byte says whether output follows, or
+	** whether it is news about the terminal instead. */
+	if (hdr)
+	{
+		if (buf[-1] != TIOCPKT_DATA)
+		{
+			pty_packet(pty, buf[-1]);
+			return 0;
+		}
+		len--;
+	}
+#endif
+	PROBE2(pty_read, pty->pid, len);
+	trace_put(TRACE_PTY_READ, pty->pid, len, spliced);
+	pty->bytes_out += len;
+	pty->active = time(NULL);
+	hist_observe(&metrics.reads, len);
+	start = pty->lat_owed ? 0 : now_usec();
+
+	/* The program might have changed the terminal settings along with
+	** its output. They are looked at again when they are needed. */
+	pty->term_stale = 1;
+
+	/* The clients already have it. */
+	if (spliced)
+	{
+		pty_timed(pty, start);
+		return 0;
+	}
+
+	/* Remember it for whoever attaches next. What nobody saw goes in the
+	** replay buffer once somebody has. */
+	if (keep && detach_policy == DETACH_PAUSE)
+		ring_put(&pty->held, buf, len);
+	else if (keep)
+		ring_record(&pty->held, buf, len);
+	else if (pty->replay.buf)
+		ring_record(&pty->replay, buf, len);
+	if (pty->screen)
+		screen_feed(pty->screen, buf, len);
+#ifdef USE_RECORDING
+	/* And for the record. This only queues it for the writer thread. */
+	if (pty->rec)
+		rec_output(pty->rec, buf, len, start ? start : now_usec());
+#endif
+
+	/* Send the data out to the attached clients. Clients that can't keep
+	** up have it queued, so nobody waits on the slowest one. It is only
+	** compressed once for each codec the clients use. */
+	for (p = pty->clients; p; p = p->next)
+	{
+		if (!p->attached)
+			continue;
+		if (!p->codec)
+		{
+			client_write(p, buf, len);
+			continue;
+		}
+		for (i = 0; i < nframes && codecs[i] != p->codec; ++i)
+			;
+		if (i == nframes)
+		{
+			codecs[i] = p->codec;
+			framelen[i] = frame_output(p->codec, buf, len,
+				frames[i]);
+			nframes++;
+		}
+		client_write(p, frames[i], framelen[i]);
+	}
+#ifdef USE_OBSERVERS
+	/* Observers all get it at once. */
+	if (pty->nobservers > 0)
+		obs_publish(pty, buf, len);
+#endif
+	pty_timed(pty, start);
+	return 0;
+}
+
+/* Read the program's output for as long as there is more of it and the
+** slice of time given to output lasts, so a flood is read in batches without
+** the clients waiting on it. A read that doesn't nearly fill the buffer
+** means there is nothing more for now. Returns as pty_activity does. */
+static int
+pty_drain(struct pty *pty, uint64_t until)
+{
+	uint64_t before;
+	int n;
+
+	for (;;)
+	{
+		before = pty->bytes_out;
+		n = pty_activity(pty);
+		if (n != 0 || pty->bytes_out - before < BUFSIZE / 2 ||
+			!pty_reading(pty))
+			return n;
+		if (now_usec() >= until)
+			break;
+	}
+	metrics.slices++;
+	return 0;
+}
+
+/* Process activity on the control socket - Accept every pending client. */
+static void
+control_activity(int s)
+{
+	int fd;
+	struct client *p;
+
+#ifdef USE_EPOLL
+	control_ready = 0;
+#endif
+	for (;;)
+	{
+		/* Accept the new client. */
+#ifdef HAVE_ACCEPT4
+		fd = accept4(s, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+#else
+		fd = accept(s, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		else if (setnonblocking(fd) < 0)
+		{
+			close(fd);
+			continue;
+		}
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+		/* Keep it out of the programs in new sessions. */
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+#endif
+
+		p = client_alloc();
+		if (!p)
+		{
+			close(fd);
+			continue;
+		}
+		/* The record comes zeroed, except for its input buffer. */
+		p->fd = fd;
+		p->overflow = overflow_policy;
+		p->redraw = REDRAW_UNSPEC;
+		p->id = ++metrics.clients;
+		p->insize = LEGACY_INSIZE;
+		if (!p->in)
+			p->in = malloc(p->insize);
+		if (!p->in)
+		{
+			close(fd);
+			client_free(p);
+			continue;
+		}
+#ifdef USE_SPLICE
+		p->pipe[0] = p->pipe[1] = -1;
+#endif
+#ifdef USE_EPOLL
+		p->kind = KIND_CLIENT;
+		p->writable = 1;
+		if (watch_fd(fd, EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET, p) < 0)
+		{
+			close(fd);
+			client_free(p);
+			continue;
+		}
+#endif
+
+		/* Link it in. With named sessions, it has to pick one
+		** first. */
+		p->pty = multisession ? NULL : sessions;
+		client_link(p, p->pty ? &p->pty->clients : &unbound);
+		PROBE2(accept, p->id, fd);
+		trace_put(TRACE_ACCEPT, p->id, 0, 0);
+	}
+}
+
+/* Hand a client the observer ring, if there is one, so that the output
+** doesn't have to be sent to it separately. */
+static void
+client_observe(struct client *p, int method)
+{
+	unsigned char ack[FRAME_HDR];
+#ifdef USE_OBSERVERS
+	struct observe_reply reply;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[2];
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	unsigned char *snap = NULL;
+	size_t snaplen = 0;
+	ssize_t n;
+
+	/* Anything already queued would end up out of order. */
+	if (p->pty->obs && p->outq.len == 0)
+	{
+		if (method == REDRAW_UNSPEC || method > REDRAW_SCREEN)
+			method = redraw_method;
+		if (method == REDRAW_SCREEN && !p->pty->screen)
+			method = REDRAW_CTRL_L;
+		if (method == REDRAW_SCREEN)
+		{
+			snap = screen_snapshot(p->pty->screen, &snaplen);
+			if (!snap)
+				snaplen = 0;
+		}
+
+		memset(&reply, 0, sizeof(reply));
+		reply.start = p->pty->obs->head;
+		reply.snaplen = snaplen;
+		ack[0] = MSG_OBSERVE;
+		ack[1] = 1;
+		ack[2] = 0;
+		ack[3] = sizeof(reply);
+		iov[0].iov_base = ack;
+		iov[0].iov_len = sizeof(ack);
+		iov[1].iov_base = &reply;
+		iov[1].iov_len = sizeof(reply);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &p->pty->obsfd, sizeof(int));
+
+		/* This is the first thing the client reads, so it fits. */
+		n = sendmsg(p->fd, &msg, MSG_NOSIGNAL);
+		if (n != (ssize_t)(sizeof(ack) + sizeof(reply)))
+		{
+			free(snap);
+			client_hangup(p);
+			return;
+		}
+		p->observer = 1;
+		p->pty->nobservers++;
+
+		/* The snapshot goes through the socket, and anything the
+		** program redraws goes through the ring. */
+		if (snap)
+		{
+			client_write(p, snap, snaplen);
+			free(snap);
+		}
+		else if (method != REDRAW_NONE)
+			redraw(p->pty, method);
+		return;
+	}
+#endif
+	(void)method;
+
+	/* Otherwise it will have to attach like anyone else. */
+	ack[0] = MSG_OBSERVE;
+	ack[1] = ack[2] = ack[3] = 0;
+	client_write(p, ack, sizeof(ack));
+}
+
+#ifdef USE_DIRECT
+/* Ask the client that has the pty to itself to give it back. The output
+** waits in the pty until it has. */
+static void
+pty_reclaim(struct pty *pty)
+{
+	static const unsigned char msg[FRAME_HDR] = {MSG_RELEASE, 0, 0, 0};
+
+	if (pty->direct && pty->direct->direct == 1)
+	{
+		pty->direct->direct = 2;
+		client_write(pty->direct, msg, sizeof(msg));
+	}
+}
+
+/* Whether a client can have the pty to itself. Nobody else can be attached
+** or observing, and like with splicing, nothing can need to look at the
+** output on its way. */
+static int
+can_direct(struct client *p)
+{
+	struct pty *pty = p->pty;
+	struct client *q;
+
+	if (p->attached || p->observer || p->codec || p->outq.len > 0 ||
+		pty->direct || pty->nobservers > 0 || pty->inq.len > 0 ||
+		pty->held.len > 0 || pty->replay.buf || pty->screen ||
+		upgrade_pending)
+		return 0;
+#ifdef USE_RECORDING
+	if (pty->rec)
+		return 0;
+#endif
+	for (q = pty->clients; q; q = q->next)
+		if (q->attached)
+			return 0;
+	return 1;
+}
+#endif
+
+/* Hand a client the pty, if it can have it to itself. Otherwise it will
+** have to attach as usual. */
+static void
+client_direct(struct client *p, int overflow)
+{
+	unsigned char ack[FRAME_HDR];
+#ifdef USE_DIRECT
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	if (can_direct(p))
+	{
+		ack[0] = MSG_DIRECT;
+		ack[1] = DIRECT_OK;
+#ifdef USE_PACKET
+		if (p->pty->packet)
+			ack[1] |= DIRECT_PACKET;
+#endif
+		ack[2] = ack[3] = 0;
+		iov.iov_base = ack;
+		iov.iov_len = sizeof(ack);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &p->pty->fd, sizeof(int));
+
+		/* Nothing else is on its way to the client, so this fits. */
+		if (sendmsg(p->fd, &msg, MSG_NOSIGNAL) != sizeof(ack))
+		{
+			client_hangup(p);
+			return;
+		}
+		p->attached = 1;
+		if (overflow > OVERFLOW_UNSPEC && overflow <= OVERFLOW_DISCONNECT)
+			p->overflow = overflow;
+		p->direct = 1;
+		p->pty->direct = p;
+		p->pty->waitattach = 0;
+#ifdef USE_PACKET
+		/* The client hears about the output stopping from now on. */
+		p->pty->stopped = 0;
+#endif
+		metrics.direct++;
+		pty_touch(p->pty);
+		return;
+	}
+
+	/* Whoever has it now will have to share it. */
+	if (p->pty->direct != p)
+		pty_reclaim(p->pty);
+#endif
+	(void)overflow;
+
+	ack[0] = MSG_DIRECT;
+	ack[1] = ack[2] = ack[3] = 0;
+	client_write(p, ack, sizeof(ack));
+}
+
+/* Whether a session name is one we accept. */
+static int
+session_name_ok(const char *name)
+{
+	size_t n;
+
+	for (n = 0; name[n]; ++n)
+		if ((unsigned char)name[n] < ' ' || name[n] == '\177')
+			return 0;
+	return n > 0 && n <= SESSION_NAME_MAX;
+}
+
+/* Find the session a client asked for, or start one. */
+static void
+client_session(struct client *p, int flags, unsigned char *buf, size_t len)
+{
+	unsigned char ack[FRAME_HDR];
+	struct pty *pty;
+	char *data, *cwd, **argv = NULL;
+	size_t off, i, n;
+
+	ack[0] = MSG_SESSION;
+	ack[1] = SESSION_FAILED;
+	ack[2] = ack[3] = 0;
+
+	/* Work on a copy that is sure to end with a NUL. */
+	data = malloc(len + 1);
+	if (!data || !multisession || p->pty)
+		goto out;
+	memcpy(data, buf, len);
+	data[len] = 0;
+	if (!session_name_ok(data))
+		goto out;
+	for (pty = sessions; pty; pty = pty->next)
+		if (strcmp(pty->name, data) == 0)
+			break;
+
+	if (!(flags & SESSION_CREATE))
+	{
+		if (pty)
+		{
+			client_unlink(p);
+			p->pty = pty;
+			client_link(p, &pty->clients);
+			ack[1] = SESSION_OK;
+		}
+		goto out;
+	}
+	else if (pty)
+	{
+		ack[1] = (flags & SESSION_EXCL) ? SESSION_EXISTS : SESSION_OK;
+		goto out;
+	}
+
+	/* The name is followed by the directory, and then the command. */
+	off = strlen(data) + 1;
+	if (off >= len)
+		goto out;
+	cwd = data + off;
+	off += strlen(cwd) + 1;
+	for (i = n = 0; i < len; ++i)
+		if (!data[i])
+			n++;
+	argv = malloc((n + 1) * sizeof(char *));
+	if (!argv)
+		goto out;
+	for (n = 0; off < len; off += strlen(data + off) + 1)
+		argv[n++] = data + off;
+	argv[n] = NULL;
+
+	if (n > 0 && pty_new(data, argv, *cwd ? cwd : NULL,
+		(flags & SESSION_WAIT) != 0, -1))
+		ack[1] = SESSION_OK;
+
+out:
+	free(argv);
+	free(data);
+	client_write(p, ack, sizeof(ack));
+}
+
+/* Send a client any amount of data, in frames of a type. Frames are split
+** between units of the given size, and the argument of every frame but the
+** last is 1. */
+static void
+client_frames(struct client *p, int type, const void *data, size_t len,
+	size_t unit)
+{
+	const unsigned char *buf = data;
+	unsigned char hdr[FRAME_HDR];
+	size_t n, max = FRAME_MAX - FRAME_MAX % unit;
+
+	do
+	{
+		n = len < max ? len : max;
+		hdr[0] = type;
+		hdr[1] = n < len;
+		hdr[2] = n >> 8;
+		hdr[3] = n & 0xff;
+		client_write(p, hdr, sizeof(hdr));
+		client_write(p, buf, n);
+		buf += n;
+		len -= n;
+	} while (len > 0);
+}
+
+/* Send a client the statistics of its session, or of every session if it
+** hasn't picked one. */
+static void
+client_stats(struct client *p)
+{
+	struct session_stats *st;
+	struct client *c;
+	struct pty *pty;
+	size_t n = 0;
+
+	for (pty = sessions; pty; pty = pty->next)
+		n++;
+	st = calloc(n, sizeof(struct session_stats));
+	n = 0;
+	for (pty = p->pty ? p->pty : sessions; pty && st;
+		pty = p->pty ? NULL : pty->next)
+	{
+		st[n].started = pty->started;
+		st[n].active = pty->active;
+		st[n].bytes_in = pty->bytes_in;
+		st[n].bytes_out = pty->bytes_out;
+		st[n].pid = pty->pid;
+		for (c = pty->clients; c; c = c->next)
+			if (c->attached)
+				st[n].clients++;
+		st[n].observers = pty->nobservers;
+		st[n].rows = pty->ws.ws_row;
+		st[n].cols = pty->ws.ws_col;
+		if (pty->name)
+			strcpy(st[n].name, pty->name);
+		n++;
+	}
+	client_frames(p, MSG_STATS, st, n * sizeof(struct session_stats),
+		sizeof(struct session_stats));
+	free(st);
+}
+
+/* Text that grows as it is written. If memory runs out, it is cut short. */
+struct text
+{
+	char *buf;
+	size_t len, size;
+};
+
+static void
+text_printf(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	size_t size;
+	int n;
+
+	for (;;)
+	{
+		va_start(ap, fmt);
+		n = vsnprintf(t->buf ? t->buf + t->len : NULL, t->size - t->len,
+			fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if ((size_t)n < t->size - t->len)
+		{
+			t->len += n;
+			return;
+		}
+
+		size = t->size ? t->size * 2 : BUFSIZE;
+		while (size - t->len <= (size_t)n)
+			size *= 2;
+		buf = realloc(t->buf, size);
+		if (!buf)
+			return;
+		t->buf = buf;
+		t->size = size;
+	}
+}
+
+/* Write out a counter or a gauge. */
+static void
+text_metric(struct text *t, const char *type, const char *name,
+	const char *help, uint64_t v)
+{
+	text_printf(t, "# HELP dtach_%s %s\n# TYPE dtach_%s %s\n"
+		"dtach_%s %llu\n", name, help, name, type, name,
+		(unsigned long long)v);
+}
+
+/* Write out a histogram, with its bounds and sum multiplied by scale. */
+static void
+text_histogram(struct text *t, const char *name, const char *help,
+	struct histogram *h, double scale)
+{
+	uint64_t n = 0;
+	int i;
+
+	text_printf(t, "# HELP dtach_%s %s\n# TYPE dtach_%s histogram\n",
+		name, help, name);
+	for (i = 0; i < h->nbounds; ++i)
+	{
+		n += h->counts[i];
+		text_printf(t, "dtach_%s_bucket{le=\"%g\"} %llu\n", name,
+			h->bounds[i] * scale, (unsigned long long)n);
+	}
+	text_printf(t, "dtach_%s_bucket{le=\"+Inf\"} %llu\n"
+		"dtach_%s_sum %.*f\ndtach_%s_count %llu\n", name,
+		(unsigned long long)h->count, name, scale < 1 ? 6 : 0,
+		h->sum * scale, name, (unsigned long long)h->count);
+}
+
+/* Write out one of the counts for every client in a session. */
+static void
+text_clients(struct text *t, const char *name, const char *help, int i)
+{
+	struct client *p;
+	struct pty *pty;
+	const char *c;
+
+	text_printf(t, "# HELP dtach_%s %s\n# TYPE dtach_%s counter\n", name,
+		help, name);
+	for (pty = sessions; pty; pty = pty->next)
+		for (p = pty->clients; p; p = p->next)
+		{
+			text_printf(t, "dtach_%s{session=\"", name);
+			for (c = pty->name; c && *c; ++c)
+				text_printf(t, *c == '"' || *c == '\\' ?
+					"\\%c" : "%c", *c);
+			text_printf(t, "\",client=\"%llu\"} %llu\n",
+				(unsigned long long)p->id,
+				(unsigned long long)p->counts[i]);
+		}
+}
+
+/* Describe everything the metrics keep track of. */
+static void
+metrics_text(struct text *t)
+{
+	struct client *p;
+	struct pty *pty;
+	uint64_t nsessions = 0, nclients = 0, npaused = 0, held = 0;
+
+	for (pty = sessions; pty; pty = pty->next)
+	{
+		nsessions++;
+		for (p = pty->clients; p; p = p->next)
+			nclients++;
+		if (pty_paused(pty))
+			npaused++;
+		held += pty->held.len;
+	}
+
+	text_metric(t, "gauge", "sessions", "Sessions running.", nsessions);
+	text_metric(t, "gauge", "clients",
+		"Clients connected to a session.", nclients);
+	text_metric(t, "gauge", "sessions_paused",
+		"Sessions paused until someone attaches.", npaused);
+	text_metric(t, "gauge", "held_bytes",
+		"Output kept from while nobody was attached.", held);
+	text_metric(t, "counter", "clients_total",
+		"Clients that have connected.", metrics.clients);
+	text_metric(t, "gauge", "client_records",
+		"Client records allocated, in use or not.", client_records);
+	text_metric(t, "gauge", "client_records_free",
+		"Client records waiting to be reused.", client_records_free);
+	text_metric(t, "counter", "wakeups_total",
+		"Times the event loop woke up.", metrics.wakeups);
+	text_histogram(t, "pty_read_bytes",
+		"Sizes of the reads from the ptys.", &metrics.reads, 1);
+	text_metric(t, "counter", "input_messages_total",
+		"Input messages from the clients.", metrics.input_msgs);
+	text_metric(t, "counter", "input_bytes_total",
+		"Input from the clients.", metrics.input_bytes);
+	text_metric(t, "counter", "pty_writes_total",
+		"Writes of input to the ptys.", metrics.pty_writes);
+	text_metric(t, "counter", "pty_written_bytes_total",
+		"Input written to the ptys.", metrics.pty_written);
+	text_metric(t, "counter", "sent_bytes_total",
+		"Output written to the clients.", metrics.client[CLIENT_SENT]);
+	text_metric(t, "counter", "short_writes_total",
+		"Writes to the clients that took only part of the output.",
+		metrics.client[CLIENT_SHORT]);
+	text_metric(t, "counter", "eagain_total",
+		"Writes to the clients that took none of the output.",
+		metrics.client[CLIENT_EAGAIN]);
+	text_histogram(t, "output_latency_seconds",
+		"Time from reading output to writing it to every client.",
+		&metrics.latency, 1e-6);
+	text_histogram(t, "input_latency_seconds",
+		"Time from input arriving to writing it to the pty.",
+		&metrics.input_latency, 1e-6);
+	text_metric(t, "counter", "output_slices_total",
+		"Times reading output stopped to get back to the clients.",
+		metrics.slices);
+	text_metric(t, "counter", "compress_input_bytes_total",
+		"Output put in frames for clients that have it compressed.",
+		metrics.compress_in);
+	text_metric(t, "counter", "compress_output_bytes_total",
+		"The same output after compression.", metrics.compress_out);
+	text_metric(t, "counter", "direct_total",
+		"Times a client was handed a pty to itself.", metrics.direct);
+	text_metric(t, "counter", "resize_requests_total",
+		"Window size changes the clients asked for.",
+		metrics.resize_requests);
+	text_metric(t, "counter", "resizes_total",
+		"Window size changes made once the requests settled.",
+		metrics.resizes);
+	text_metric(t, "counter", "redraw_requests_total",
+		"Redraws the clients asked for.", metrics.redraw_requests);
+	text_metric(t, "counter", "redraws_total",
+		"Redraws done once the requests settled.", metrics.redraws);
+	text_clients(t, "client_sent_bytes_total",
+		"Output written to each client.", CLIENT_SENT);
+	text_clients(t, "client_short_writes_total",
+		"Writes to each client that took only part of the output.",
+		CLIENT_SHORT);
+	text_clients(t, "client_eagain_total",
+		"Writes to each client that took none of the output.",
+		CLIENT_EAGAIN);
+#ifdef USE_RECORDING
+	if (record_path)
+	{
+		uint64_t written, dropped, rotations;
+
+		rec_totals(&written, &dropped, &rotations);
+		text_metric(t, "counter", "recorded_bytes_total",
+			"Output written to the recordings, before compression.",
+			written);
+		text_metric(t, "counter", "record_dropped_bytes_total",
+			"Output left out of the recordings, because writing "
+			"them fell behind or failed.", dropped);
+		text_metric(t, "counter", "record_rotations_total",
+			"Recordings moved aside for being full.", rotations);
+	}
+#endif
+}
+
+/* Send a client the metrics. */
+static void
+client_metrics(struct client *p)
+{
+	struct text t = {NULL, 0, 0};
+
+	metrics_text(&t);
+	client_frames(p, MSG_STATS, t.buf, t.len, 1);
+	free(t.buf);
+}
+
+/* Send a client the events in the trace ring, oldest first. */
+static void
+client_trace(struct client *p)
+{
+	struct trace_event *buf;
+	size_t i, n = trace_count < TRACE_EVENTS ? trace_count : TRACE_EVENTS;
+
+	buf = malloc(n * sizeof(struct trace_event));
+	if (!buf)
+		n = 0;
+	for (i = 0; i < n; ++i)
+		buf[i] = trace[(trace_count - n + i) % TRACE_EVENTS];
+	client_frames(p, MSG_STATS, buf, n * sizeof(struct trace_event),
+		sizeof(struct trace_event));
+	free(buf);
+}
+
+/* Write the metrics to their file. They go to another file first and are
+** then renamed, so that nobody reads half of them. */
+static void
+metrics_dump(void)
+{
+	struct text t = {NULL, 0, 0};
+	char *tmp;
+	int fd, n;
+
+	dump_metrics = 0;
+	if (!metrics_path)
+		return;
+	tmp = malloc(strlen(metrics_path) + sizeof(".tmp"));
+	if (!tmp)
+		return;
+	sprintf(tmp, "%s.tmp", metrics_path);
+
+	metrics_text(&t);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd >= 0)
+	{
+		n = write_all(fd, t.buf, t.len);
+		if (close(fd) < 0 || n < 0 || rename(tmp, metrics_path) < 0)
+			unlink(tmp);
+	}
+	free(t.buf);
+	free(tmp);
+}
+
+/* Act on a message from a client. */
+static void
+client_message(struct client *p, int type, int arg, unsigned char *buf,
+	size_t len)
+{
+	struct winsize ws;
+
+	PROBE3(client_msg, p->id, type, len);
+	trace_put(TRACE_CLIENT_MSG, p->id, len, type);
+
+	/* Until a client picks a session, all it can do is pick one. Older
+	** clients can't, so don't leave them waiting. */
+	if (!p->pty && type != MSG_HELLO && type != MSG_SESSION &&
+		type != MSG_STATS && type != MSG_COMPRESS &&
+		type != MSG_UPGRADE)
+	{
+		if (type == MSG_ATTACH || type == MSG_DIRECT)
+			client_hangup(p);
+		return;
+	}
+
+	/* The window size messages carry one. */
+	memset(&ws, 0, sizeof(ws));
+	if (len >= sizeof(ws))
+		memcpy(&ws, buf, sizeof(ws));
+
+	/* Push out data to the program. */
+	if (type == MSG_PUSH)
+	{
+		metrics.input_msgs++;
+		metrics.input_bytes += len;
+		pty_push(p->pty, buf, len);
+	}
+
+	/* Attach or detach from the program. The attach message can carry
+	** the client's overflow policy. */
+	else if (type == MSG_ATTACH)
+	{
+		p->attached = 1;
+		if (arg > OVERFLOW_UNSPEC && arg <= OVERFLOW_DISCONNECT)
+			p->overflow = arg;
+		if (!p->replayed && p->pty->replay.len > 0)
+			client_replay(p);
+		if (p->pty->held.len > 0)
+			client_unhold(p);
+#ifdef USE_DIRECT
+		/* Whoever has the pty to itself will have to share it. */
+		if (p->pty->direct != p)
+			pty_reclaim(p->pty);
+#endif
+
+		/* The program can get going now. */
+		if (p->pty->waitattach)
+		{
+			p->pty->waitattach = 0;
+			pty_touch(p->pty);
+		}
+	}
+	else if (type == MSG_DETACH)
+	{
+		/* A suspended client shouldn't hold up everyone else. One that
+		** had the pty to itself has given it back. */
+		p->attached = 0;
+		client_unblock(p);
+		client_delivered(p);
+		client_undirect(p);
+		pty_want_size(p->pty, NULL, NULL);
+	}
+
+	/* Window size change request, without a forced redraw. */
+	else if (type == MSG_WINCH)
+		pty_want_size(p->pty, p, &ws);
+
+	/* Force a redraw using a particular method. */
+	else if (type == MSG_REDRAW)
+	{
+		int method = arg;
+
+		if (method > REDRAW_SCREEN)
+			method = REDRAW_UNSPEC;
+		p->redraw = method;
+
+		/* If the client didn't specify a particular method, use
+		** whatever we had on startup. */
+		if (method == REDRAW_UNSPEC)
+			method = redraw_method;
+		if (method == REDRAW_NONE)
+			return;
+
+		/* Set the window size, unless the client is just watching.
+		** Both wait for the requests to settle. */
+		if (len >= sizeof(ws))
+			pty_want_size(p->pty, p, &ws);
+
+		client_want_redraw(p, method);
+	}
+
+	/* Follow the output without attaching. */
+	else if (type == MSG_OBSERVE && p->version >= 2 && !p->attached &&
+		!p->observer)
+	{
+#ifdef USE_DIRECT
+		/* The output has to go through us for the ring. */
+		pty_reclaim(p->pty);
+#endif
+		client_observe(p, arg);
+
+		/* The program can carry on while somebody watches. */
+		pty_touch(p->pty);
+	}
+
+	/* Have the pty to itself instead of attaching. */
+	else if (type == MSG_DIRECT && p->version >= 9)
+		client_direct(p, arg);
+#ifdef USE_DIRECT
+	/* The client gave the pty back. Unless we asked for it, say that we
+	** have it. */
+	else if (type == MSG_RELEASE && p->direct)
+	{
+		pty_reclaim(p->pty);
+		client_undirect(p);
+	}
+#endif
+
+	/* Pick or start a session. */
+	else if (type == MSG_SESSION && p->version >= 3)
+		client_session(p, arg, buf, len);
+
+	/* Say how the sessions, or the master, are doing. */
+	else if (type == MSG_STATS && arg == STATS_METRICS && p->version >= 5)
+		client_metrics(p);
+	else if (type == MSG_STATS && arg == STATS_TRACE && p->version >= 10)
+		client_trace(p);
+	else if (type == MSG_STATS && p->version >= 4)
+		client_stats(p);
+
+	/* Compress the output from now on. This has to be settled before
+	** any output is sent. */
+	else if (type == MSG_COMPRESS && p->version >= 6 && !p->attached &&
+		!p->observer)
+	{
+		unsigned char ack[FRAME_HDR];
+
+		p->codec = compress_pick(arg);
+		ack[0] = MSG_COMPRESS;
+		ack[1] = p->codec;
+		ack[2] = ack[3] = 0;
+		client_write(p, ack, sizeof(ack));
+	}
+
+	/* Replace ourselves with another binary. This waits until the
+	** clients have been dealt with, so that nothing is half done. */
+	else if (type == MSG_UPGRADE && p->version >= 8 && !upgrade_pending)
+	{
+		upgrade_path = malloc(len + 1);
+		if (!upgrade_path)
+			return;
+		memcpy(upgrade_path, buf, len);
+		upgrade_path[len] = 0;
+		upgrade_pending = 1;
+		upgrade_client = p;
+	}
+
+	/* Switch to frames, if the client is still sending packets. */
+	else if (type == MSG_HELLO && p->version == 0 && arg > 0)
+	{
+		unsigned char *in, ack[FRAME_HDR];
+
+		in = realloc(p->in, FRAME_HDR + FRAME_MAX);
+		if (!in)
+			return;
+		p->in = in;
+		p->insize = FRAME_HDR + FRAME_MAX;
+		p->version = arg < PROTOCOL_VERSION ? arg : PROTOCOL_VERSION;
+
+		ack[0] = MSG_HELLO;
+		ack[1] = p->version;
+		ack[2] = ack[3] = 0;
+		client_write(p, ack, sizeof(ack));
+	}
+}
+
+/* Pick the next whole message out of a client's input. Returns how much
+** input it took up, or 0 if the rest of the message hasn't arrived yet. */
+static size_t
+client_parse(struct client *p, unsigned char *buf, size_t len)
+{
+	struct packet pkt;
+	unsigned char *data;
+	int type, arg;
+	size_t n, size;
+
+	if (p->version == 0)
+	{
+		if (len < sizeof(struct packet))
+			return 0;
+		memcpy(&pkt, buf, sizeof(struct packet));
+		type = pkt.type;
+		arg = pkt.len;
+		data = pkt.u.buf;
+		if (type != MSG_PUSH)
+			n = sizeof(pkt.u.buf);
+		else if (pkt.len <= sizeof(pkt.u.buf))
+			n = pkt.len;
+		else
+			n = 0;
+		size = sizeof(struct packet);
+	}
+	else
+	{
+		if (len < FRAME_HDR)
+			return 0;
+		type = buf[0];
+		arg = buf[1];
+		data = buf + FRAME_HDR;
+		n = (buf[2] << 8) | buf[3];
+		size = FRAME_HDR + n;
+		if (len < size)
+			return 0;
+	}
+
+	/* Leave input where it is until the pty has room for it. */
+	if (type == MSG_PUSH && p->pty &&
+		n > p->pty->inq.size - p->pty->inq.len)
+	{
+		p->waiting = 1;
+		return 0;
+	}
+	client_message(p, type, arg, data, n);
+	return size;
+}
+
+/* Process activity from a client. */
+static void
+client_activity(struct client *p)
+{
+	ssize_t len;
+	size_t n, off;
+
+	for (;;)
+	{
+		/* Act on every whole message, and keep the rest for later.
+		** Note that a message can change how the ones after it are
+		** framed. */
+		for (off = 0; (n = client_parse(p, p->in + off,
+			p->inlen - off)) > 0; off += n)
+			;
+		p->inlen -= off;
+		memmove(p->in, p->in + off, p->inlen);
+
+		/* Don't read any more while the pty is holding us up. */
+		if (p->waiting)
+			return;
+
+		/* Read as much as there is room for. */
+		len = read(p->fd, p->in + p->inlen, p->insize - p->inlen);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return;
+
+		/* Close the client on an error. */
+		if (len <= 0)
+			break;
+		p->inlen += len;
+	}
+
+	client_unblock(p);
+	client_delivered(p);
+	client_undirect(p);
+	if (p->observer)
+		p->pty->nobservers--;
+#ifdef USE_EPOLL
+	/* A program we just started may still share the descriptor, which
+	** would keep it registered. */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+#endif
+	close(p->fd);
+#ifdef USE_SPLICE
+	if (p->pipe[0] >= 0)
+	{
+		close(p->pipe[0]);
+		close(p->pipe[1]);
+	}
+#endif
+	client_unlink(p);
+	if (p->pty)
+		pty_want_size(p->pty, NULL, NULL);
+	if (upgrade_client == p)
+		upgrade_client = NULL;
+	client_free(p);
+}
+
+/* Write out as much of the clients' input as the program will take. */
+static void
+pty_flush(struct pty *pty)
+{
+	struct iovec iov[2];
+	struct client *p, *next;
+	ssize_t n;
+
+	while (pty->inq.len > 0)
+	{
+		n = writev(pty->fd, iov, ring_iov(&pty->inq, iov));
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+			break;
+		/* The program is gone; reading will notice. */
+		else if (n <= 0)
+		{
+			ring_consume(&pty->inq, pty->inq.len);
+			break;
+		}
+		ring_consume(&pty->inq, n);
+		pty->bytes_in += n;
+		pty->active = time(NULL);
+		metrics.pty_writes++;
+		metrics.pty_written += n;
+		/* Whatever is left keeps the same time, so its wait is never
+		** counted as shorter than it was. */
+		hist_observe(&metrics.input_latency,
+			now_usec() - pty->in_since);
+	}
+
+	/* Let clients that were held up carry on once there is room. */
+	if (pty->inq.len > pty->inq.size / 2)
+		return;
+	for (p = pty->clients; p; p = next)
+	{
+		next = p->next;
+		if (p->waiting)
+		{
+			p->waiting = 0;
+			client_activity(p);
+		}
+	}
+}
+
+#ifndef USE_EPOLL
+/* Add a list of clients to the sets for select. Returns the new highest
+** file descriptor. */
+static int
+select_clients(struct client *p, fd_set *readfds, fd_set *writefds,
+	int highest_fd)
+{
+	for (; p; p = p->next)
+	{
+		if (!p->waiting)
+			FD_SET(p->fd, readfds);
+		if (p->outq.len > 0 && !client_held(p))
+			FD_SET(p->fd, writefds);
+		if (p->fd > highest_fd)
+			highest_fd = p->fd;
+	}
+	return highest_fd;
+}
+
+/* Deal with the clients in a list that select found ready. */
+static void
+serve_clients(struct client *p, fd_set *readfds, fd_set *writefds)
+{
+	struct client *next;
+
+	for (; p; p = next)
+	{
+		next = p->next;
+		if (FD_ISSET(p->fd, writefds))
+			client_flush(p);
+		if (FD_ISSET(p->fd, readfds))
+			client_activity(p);
+	}
+}
+#endif
+
+/* Set up the metrics, which are written next to the socket unless we were
+** told otherwise. */
+static void
+metrics_init(void)
+{
+	metrics.reads.bounds = read_bounds;
+	metrics.reads.nbounds = sizeof(read_bounds) / sizeof(read_bounds[0]);
+	metrics.latency.bounds = latency_bounds;
+	metrics.latency.nbounds =
+		sizeof(latency_bounds) / sizeof(latency_bounds[0]);
+	metrics.input_latency.bounds = latency_bounds;
+	metrics.input_latency.nbounds =
+		sizeof(latency_bounds) / sizeof(latency_bounds[0]);
+	if (!metrics_path)
+	{
+		metrics_path = malloc(strlen(sockname) + sizeof(".prom"));
+		if (metrics_path)
+			sprintf(metrics_path, "%s.prom", sockname);
+	}
+}
+
+/* Set up the signals that the master catches, and the ones it ignores. */
+static void
+master_signals(void)
+{
+	struct sigaction sa;
+
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	sigaction(SIGXFSZ, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGTTIN, &sa, NULL);
+	sigaction(SIGTTOU, &sa, NULL);
+
+	sa.sa_handler = die;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+#ifdef USE_SIGNALFD
+	/* Take the same signals through the event loop instead, if we can. */
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIGINT);
+	sigaddset(&sa.sa_mask, SIGTERM);
+	sigaddset(&sa.sa_mask, SIGCHLD);
+	sigaddset(&sa.sa_mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sa.sa_mask, &orig_sigmask);
+	sigfd = signalfd(-1, &sa.sa_mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sigfd < 0)
+		sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+#endif
+}
+
+static int master_serve(int s);
+
+/*
+** Live upgrades. The master saves its state to a temporary file, and then
+** executes the new binary in its own place. That keeps the process, so the
+** programs stay our children, and the descriptors of the socket, the ptys
+** and the clients stay open across it. The new master is told with -U
+** where to find the file, and carries on from there. The observers are
+** hung up, since their ring can't be mapped for writing again once it is
+** sealed, and the recordings are closed and then added to by the new
+** master.
+*/
+
+/* Set when the saved state turns out to be incomplete, and when the rest of
+** it can't even be read. */
+static int upgrade_failed, upgrade_broken;
+
+/* Save a number. */
+static void
+put_num(FILE *f, uint64_t v)
+{
+	fwrite(&v, sizeof(v), 1, f);
+}
+
+/* Save some bytes, after their length. */
+static void
+put_bytes(FILE *f, const void *buf, size_t len)
+{
+	put_num(f, len);
+	if (len > 0)
+		fwrite(buf, 1, len, f);
+}
+
+/* Save the contents of a ring buffer, after its size. */
+static void
+put_ring(FILE *f, struct ring *r)
+{
+	struct iovec iov[2];
+	int i, n;
+
+	put_num(f, r->buf ? r->size : 0);
+	put_num(f, r->len);
+	n = ring_iov(r, iov);
+	for (i = 0; i < n; ++i)
+		fwrite(iov[i].iov_base, 1, iov[i].iov_len, f);
+}
+
+/* Save a histogram's counts. */
+static void
+put_histogram(FILE *f, struct histogram *h)
+{
+	int i;
+
+	for (i = 0; i <= HIST_BUCKETS; ++i)
+		put_num(f, h->counts[i]);
+	put_num(f, h->sum);
+	put_num(f, h->count);
+}
+
+/* Restore a number. */
+static uint64_t
+get_num(FILE *f)
+{
+	uint64_t v = 0;
+
+	if (fread(&v, sizeof(v), 1, f) != 1)
+		upgrade_broken = upgrade_failed = 1;
+	return v;
+}
+
+/* Restore some bytes, with a NUL after them. */
+static char *
+get_bytes(FILE *f, size_t *len)
+{
+	uint64_t n = get_num(f);
+	char *buf;
+
+	/* Nothing that is saved comes anywhere near this big. */
+	if (upgrade_broken || n > (1 << 28))
+	{
+		upgrade_broken = upgrade_failed = 1;
+		return NULL;
+	}
+	/* Skip what there is no room for, so the rest can still be read. */
+	buf = malloc(n + 1);
+	if (!buf)
+	{
+		upgrade_failed = 1;
+		if (fseek(f, n, SEEK_CUR) != 0)
+			upgrade_broken = 1;
+		return NULL;
+	}
+	if (fread(buf, 1, n, f) != n)
+	{
+		free(buf);
+		upgrade_broken = upgrade_failed = 1;
+		return NULL;
+	}
+	buf[n] = 0;
+	*len = n;
+	return buf;
+}
+
+/* Restore a ring buffer. */
+static void
+get_ring(FILE *f, struct ring *r)
+{
+	uint64_t size = get_num(f), len = get_num(f);
+
+	memset(r, 0, sizeof(struct ring));
+	if (upgrade_broken || len > size)
+	{
+		upgrade_broken = upgrade_failed = 1;
+		return;
+	}
+	if (size == 0)
+		return;
+	if (ring_alloc(r, size) < 0)
+	{
+		upgrade_failed = 1;
+		if (fseek(f, len, SEEK_CUR) != 0)
+			upgrade_broken = 1;
+		return;
+	}
+	if (fread(r->buf, 1, len, f) != len)
+	{
+		upgrade_broken = upgrade_failed = 1;
+		return;
+	}
+	r->len = len;
+}
+
+/* Restore a histogram's counts. */
+static void
+get_histogram(FILE *f, struct histogram *h)
+{
+	int i;
+
+	for (i = 0; i <= HIST_BUCKETS; ++i)
+		h->counts[i] = get_num(f);
+	h->sum = get_num(f);
+	h->count = get_num(f);
+}
+
+/* Save a client, after the session it is in: 1 for none, or 2 and up for
+** the sessions in the order they were saved. */
+static void
+upgrade_save_client(FILE *f, struct client *p, uint64_t session)
+{
+	int i;
+
+	put_num(f, session);
+	put_num(f, p->fd);
+	put_num(f, p->attached);
+	put_ring(f, &p->outq);
+	put_num(f, p->overflow);
+	put_num(f, p->blocking);
+	put_num(f, p->resync);
+	put_num(f, p->redraw);
+	put_bytes(f, &p->ws, sizeof(struct winsize));
+	put_num(f, p->has_ws);
+	put_num(f, p->replayed);
+	put_num(f, p->waiting);
+	put_num(f, p->version);
+	put_num(f, p->codec);
+#ifdef USE_DIRECT
+	put_num(f, p->direct);
+#else
+	put_num(f, 0);
+#endif
+	put_num(f, p->id);
+	for (i = 0; i < CLIENT_COUNTS; ++i)
+		put_num(f, p->counts[i]);
+	put_bytes(f, p->in, p->inlen);
+	put_num(f, p->insize);
+	put_num(f, p == upgrade_client);
+}
+
+/* Save the state of the master, its sessions and its clients. */
+static void
+upgrade_save(FILE *f, int s)
+{
+	unsigned char *snap;
+	struct client *p;
+	struct pty *pty;
+	uint64_t n;
+	size_t len;
+	int i;
+
+	put_num(f, UPGRADE_VERSION);
+	put_num(f, s);
+	put_num(f, redraw_method);
+	put_num(f, overflow_policy);
+	put_num(f, outq_size);
+	put_num(f, replay_size);
+	put_num(f, detach_policy);
+	put_num(f, held_size);
+	put_num(f, observe_size);
+	put_num(f, multisession);
+	put_bytes(f, metrics_path, metrics_path ? strlen(metrics_path) : 0);
+	put_bytes(f, record_path, record_path ? strlen(record_path) : 0);
+	put_num(f, record_limit);
+	put_num(f, record_compress);
+	put_num(f, settle_ms);
+	put_num(f, size_policy);
+	put_bytes(f, &orig_term, sizeof(struct termios));
+	put_num(f, dont_have_tty);
+
+	put_num(f, metrics.wakeups);
+	put_histogram(f, &metrics.reads);
+	put_num(f, metrics.input_msgs);
+	put_num(f, metrics.input_bytes);
+	put_num(f, metrics.pty_writes);
+	put_num(f, metrics.pty_written);
+	for (i = 0; i < CLIENT_COUNTS; ++i)
+		put_num(f, metrics.client[i]);
+	put_num(f, metrics.clients);
+	put_histogram(f, &metrics.latency);
+	put_num(f, metrics.compress_in);
+	put_num(f, metrics.compress_out);
+	put_num(f, metrics.direct);
+	put_num(f, metrics.resize_requests);
+	put_num(f, metrics.resizes);
+	put_num(f, metrics.redraw_requests);
+	put_num(f, metrics.redraws);
+	put_histogram(f, &metrics.input_latency);
+	put_num(f, metrics.slices);
+
+	for (n = 0, pty = sessions; pty; pty = pty->next)
+		n++;
+	put_num(f, n);
+	for (pty = sessions; pty; pty = pty->next)
+	{
+		put_bytes(f, pty->name, pty->name ? strlen(pty->name) : 0);
+		put_num(f, pty->fd);
+#ifdef BROKEN_MASTER
+		put_num(f, pty->slave);
+#else
+		put_num(f, -1);
+#endif
+		put_num(f, pty->pid);
+		put_bytes(f, &pty->term, sizeof(struct termios));
+#ifdef USE_PACKET
+		put_num(f, pty->stopped);
+#else
+		put_num(f, 0);
+#endif
+		put_bytes(f, &pty->ws, sizeof(struct winsize));
+		put_ring(f, &pty->replay);
+		put_ring(f, &pty->held);
+		put_ring(f, &pty->inq);
+
+		/* The screen is saved as what it takes to draw it. */
+		snap = pty->screen ? screen_snapshot(pty->screen, &len) : NULL;
+		put_num(f, pty->screen != NULL);
+		put_bytes(f, snap, snap ? len : 0);
+		free(snap);
+
+		put_num(f, pty->waitattach);
+		put_num(f, pty->started);
+		put_num(f, pty->active);
+		put_num(f, pty->bytes_in);
+		put_num(f, pty->bytes_out);
+	}
+
+	for (p = unbound; p; p = p->next)
+		upgrade_save_client(f, p, 1);
+	for (n = 2, pty = sessions; pty; pty = pty->next, ++n)
+		for (p = pty->clients; p; p = p->next)
+			if (!p->observer)
+				upgrade_save_client(f, p, n);
+	put_num(f, 0);
+}
+
+/* Let the descriptors that the new master takes over survive executing
+** it, or go back to closing them on exec if it didn't happen. */
+static void
+upgrade_inherit(int s, int fd, int inherit)
+{
+	int flags = inherit ? 0 : FD_CLOEXEC;
+	struct client *p;
+	struct pty *pty;
+
+	fcntl(s, F_SETFD, flags);
+	fcntl(fd, F_SETFD, flags);
+	for (pty = sessions; pty; pty = pty->next)
+	{
+		fcntl(pty->fd, F_SETFD, flags);
+#ifdef BROKEN_MASTER
+		fcntl(pty->slave, F_SETFD, flags);
+#endif
+		for (p = pty->clients; p; p = p->next)
+			if (!p->observer)
+				fcntl(p->fd, F_SETFD, flags);
+	}
+	for (p = unbound; p; p = p->next)
+		fcntl(p->fd, F_SETFD, flags);
+}
+
+/* Whether a binary can take over from us. It has to save and restore the
+** state the same way, which it says when asked. */
+static int
+upgrade_check(const char *path)
+{
+	struct timeval tv;
+	fd_set readfds;
+	char buf[32];
+	size_t len = 0;
+	ssize_t n;
+	int fd[2];
+	pid_t pid;
+
+	if (pipe(fd) < 0)
+		return -1;
+	pid = fork();
+	if (pid < 0)
+	{
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+	else if (pid == 0)
+	{
+		dup2(fd[1], 1);
+		execlp(path, path, "--upgrade-version", (char *)NULL);
+		_exit(127);
+	}
+	close(fd[1]);
+
+	/* It shouldn't take long to say. */
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	while (len < sizeof(buf) - 1)
+	{
+		FD_ZERO(&readfds);
+		FD_SET(fd[0], &readfds);
+		if (select(fd[0] + 1, &readfds, NULL, NULL, &tv) <= 0)
+			break;
+		n = read(fd[0], buf + len, sizeof(buf) - 1 - len);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	buf[len] = 0;
+	return (len > 0 && atoi(buf) == UPGRADE_VERSION) ? 0 : -1;
+}
+
+/* Replace ourselves with the binary a client asked for. If it can't take
+** over, or executing it fails, we carry on and tell the client why. */
+static void
+master_upgrade(int s)
+{
+	const char *path = *upgrade_path ? upgrade_path : progname;
+	char *argv[5], fdstr[16], msg[512];
+	struct pty *pty;
+	FILE *f;
+	int fd;
+
+	upgrade_pending = 0;
+	if (upgrade_check(path) < 0)
+	{
+		snprintf(msg, sizeof(msg), "%s: %s: It can't take over from "
+			"this master.\n", progname, path);
+		goto fail;
+	}
+	f = tmpfile();
+	if (!f)
+	{
+		snprintf(msg, sizeof(msg), "%s: %s\n", progname,
+			strerror(errno));
+		goto fail;
+	}
+	fd = fileno(f);
+
+#ifdef USE_RECORDING
+	/* The writers would go away with what they have yet to write, so
+	** wait for them to finish. The new master adds to the files. */
+	for (pty = sessions; pty; pty = pty->next)
+		if (pty->rec)
+		{
+			rec_stop(pty->rec);
+			pty->rec = NULL;
+		}
+#endif
+	/* The new master doesn't wait for requests to settle. */
+	for (pty = sessions; pty; pty = pty->next)
+		if (pty->settle_at)
+			pty_settle(pty);
+	upgrade_save(f, s);
+	if (fflush(f) != 0 || ferror(f) || lseek(fd, 0, SEEK_SET) < 0)
+	{
+		snprintf(msg, sizeof(msg), "%s: %s\n", progname,
+			strerror(errno));
+		goto undo;
+	}
+
+	upgrade_inherit(s, fd, 1);
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	argv[0] = (char *)path;
+	argv[1] = sockname;
+	argv[2] = "-U";
+	argv[3] = fdstr;
+	argv[4] = NULL;
+	execvp(path, argv);
+	snprintf(msg, sizeof(msg), "%s: could not execute %s: %s\n",
+		progname, path, strerror(errno));
+	upgrade_inherit(s, fd, 0);
+
+undo:
+	fclose(f);
+#ifdef USE_RECORDING
+	for (pty = sessions; pty; pty = pty->next)
+		pty_record(pty);
+#endif
+fail:
+	if (upgrade_client)
+		client_frames(upgrade_client, MSG_UPGRADE, msg, strlen(msg), 1);
+	upgrade_client = NULL;
+	free(upgrade_path);
+	upgrade_path = NULL;
+}
+
+/* Restore a session from its record. The descriptors in it are left out if
+** the state can't be read. */
+static void
+get_pty(FILE *f, struct pty *pty)
+{
+	size_t len;
+	char *buf;
+
+	memset(pty, 0, sizeof(struct pty));
+#ifdef USE_EPOLL
+	pty->kind = KIND_PTY;
+#endif
+#ifdef USE_SPLICE
+	pty->pipe[0] = pty->pipe[1] = -1;
+#endif
+#ifdef USE_OBSERVERS
+	pty->obsfd = -1;
+#endif
+	pty->name = get_bytes(f, &len);
+	if (pty->name && len == 0)
+	{
+		free(pty->name);
+		pty->name = NULL;
+	}
+	pty->fd = get_num(f);
+#ifdef BROKEN_MASTER
+	pty->slave = get_num(f);
+#else
+	get_num(f);
+#endif
+	pty->pid = get_num(f);
+	buf = get_bytes(f, &len);
+	if (buf && len == sizeof(struct termios))
+		memcpy(&pty->term, buf, len);
+	free(buf);
+	pty->term_stale = 1;
+#ifdef USE_PACKET
+	pty->stopped = get_num(f);
+#else
+	get_num(f);
+#endif
+	buf = get_bytes(f, &len);
+	if (buf && len == sizeof(struct winsize))
+		memcpy(&pty->ws, buf, len);
+	free(buf);
+	get_ring(f, &pty->replay);
+	get_ring(f, &pty->held);
+	get_ring(f, &pty->inq);
+
+	/* Draw the screen on a new model of it. */
+	if (get_num(f))
+		pty->screen = screen_new(pty->ws.ws_row, pty->ws.ws_col);
+	buf = get_bytes(f, &len);
+	if (pty->screen && buf)
+		screen_feed(pty->screen, (unsigned char *)buf, len);
+	free(buf);
+
+	pty->waitattach = get_num(f);
+	pty->started = get_num(f);
+	pty->active = get_num(f);
+	pty->bytes_in = get_num(f);
+	pty->bytes_out = get_num(f);
+
+	if (!upgrade_failed && !pty->inq.buf &&
+		ring_alloc(&pty->inq, INQ_SIZE) < 0)
+		upgrade_failed = 1;
+	if (upgrade_broken)
+	{
+		pty->fd = -1;
+#ifdef BROKEN_MASTER
+		pty->slave = -1;
+#endif
+	}
+}
+
+/* Restore a client from its record. Returns whether it asked for the
+** upgrade. */
+static int
+get_client(FILE *f, struct client *p)
+{
+	size_t len;
+	char *buf;
+	int i, ask;
+
+	memset(p, 0, sizeof(struct client));
+#ifdef USE_EPOLL
+	p->kind = KIND_CLIENT;
+	p->writable = 1;
+#endif
+#ifdef USE_SPLICE
+	p->pipe[0] = p->pipe[1] = -1;
+#endif
+	p->fd = get_num(f);
+	p->attached = get_num(f);
+	get_ring(f, &p->outq);
+	p->overflow = get_num(f);
+	p->blocking = get_num(f);
+	p->resync = get_num(f);
+	p->redraw = get_num(f);
+	buf = get_bytes(f, &len);
+	if (buf && len == sizeof(struct winsize))
+		memcpy(&p->ws, buf, len);
+	free(buf);
+	p->has_ws = get_num(f);
+	p->replayed = get_num(f);
+	p->waiting = get_num(f);
+	p->version = get_num(f);
+	p->codec = get_num(f);
+#ifdef USE_DIRECT
+	p->direct = get_num(f);
+#else
+	get_num(f);
+#endif
+	p->id = get_num(f);
+	for (i = 0; i < CLIENT_COUNTS; ++i)
+		p->counts[i] = get_num(f);
+	p->in = (unsigned char *)get_bytes(f, &p->inlen);
+	p->insize = get_num(f);
+	ask = get_num(f);
+
+	if (upgrade_broken)
+		p->fd = -1;
+	else if (p->insize < p->inlen ||
+		!(buf = realloc(p->in, p->insize)))
+		upgrade_failed = 1;
+	else
+		p->in = (unsigned char *)buf;
+	return ask;
+}
+
+/* Take over from the master that executed us in a live upgrade, with the
+** state it saved in the file open on fd. */
+static int
+master_resume(int fd)
+{
+	unsigned char ack[FRAME_HDR];
+	struct pty *pty, **ptys, **tail = &sessions, rec;
+	struct client *p, *asker = NULL, crec;
+	uint64_t session;
+	size_t n, i, len;
+	char *buf;
+	FILE *f;
+	int s, ask, failed;
+
+	f = fdopen(fd, "rb");
+	if (!f || get_num(f) != UPGRADE_VERSION)
+		return 1;
+	s = get_num(f);
+	redraw_method = get_num(f);
+	overflow_policy = get_num(f);
+	outq_size = get_num(f);
+	replay_size = get_num(f);
+	detach_policy = get_num(f);
+	held_size = get_num(f);
+	observe_size = get_num(f);
+	multisession = get_num(f);
+	metrics_path = get_bytes(f, &len);
+	if (metrics_path && len == 0)
+	{
+		free(metrics_path);
+		metrics_path = NULL;
+	}
+	record_path = get_bytes(f, &len);
+	if (record_path && len == 0)
+	{
+		free(record_path);
+		record_path = NULL;
+	}
+	record_limit = get_num(f);
+	record_compress = get_num(f);
+	settle_ms = get_num(f);
+	size_policy = get_num(f);
+	buf = get_bytes(f, &len);
+	if (buf && len == sizeof(struct termios))
+		memcpy(&orig_term, buf, len);
+	free(buf);
+	dont_have_tty = get_num(f);
+
+	metrics.wakeups = get_num(f);
+	get_histogram(f, &metrics.reads);
+	metrics.input_msgs = get_num(f);
+	metrics.input_bytes = get_num(f);
+	metrics.pty_writes = get_num(f);
+	metrics.pty_written = get_num(f);
+	for (i = 0; i < CLIENT_COUNTS; ++i)
+		metrics.client[i] = get_num(f);
+	metrics.clients = get_num(f);
+	get_histogram(f, &metrics.latency);
+	metrics.compress_in = get_num(f);
+	metrics.compress_out = get_num(f);
+	metrics.direct = get_num(f);
+	metrics.resize_requests = get_num(f);
+	metrics.resizes = get_num(f);
+	metrics.redraw_requests = get_num(f);
+	metrics.redraws = get_num(f);
+	get_histogram(f, &metrics.input_latency);
+	metrics.slices = get_num(f);
+
+	n = get_num(f);
+	if (upgrade_failed || n == 0)
+		return 1;
+	ptys = calloc(n, sizeof(struct pty *));
+	if (!ptys)
+		return 1;
+
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+	atexit(unlink_socket);
+	metrics_init();
+	master_signals();
+#ifdef USE_SIGNALFD
+	/* The mask we started with already has these blocked, but the
+	** programs shouldn't. */
+	sigdelset(&orig_sigmask, SIGINT);
+	sigdelset(&orig_sigmask, SIGTERM);
+	sigdelset(&orig_sigmask, SIGCHLD);
+	sigdelset(&orig_sigmask, SIGUSR1);
+#endif
+
+	/* A session or client that can't be restored is still read, to close
+	** the descriptors in it, so that nobody waits on it forever. The rest
+	** carry on, but the failure is remembered. */
+	for (i = 0; i < n && !upgrade_broken; ++i)
+	{
+		failed = upgrade_failed;
+		upgrade_failed = 0;
+		get_pty(f, &rec);
+		pty = NULL;
+		if (!upgrade_failed && !(pty = malloc(sizeof(struct pty))))
+			upgrade_failed = 1;
+		upgrade_failed |= failed;
+		if (!pty)
+		{
+			pty_release(&rec);
+			continue;
+		}
+		*pty = rec;
+#ifdef USE_OBSERVERS
+		if (observe_size)
+			obs_create(pty, observe_size);
+#endif
+#ifdef USE_RECORDING
+		pty_record(pty);
+#endif
+		pty_setup(pty);
+		ptys[i] = pty;
+		*tail = pty;
+		tail = &pty->next;
+		pty_touch(pty);
+	}
+
+	/* Clients of the sessions that are gone are hung up. */
+	while (!upgrade_broken && (session = get_num(f)) != 0)
+	{
+		failed = upgrade_failed;
+		upgrade_failed = 0;
+		ask = get_client(f, &crec);
+		pty = (session >= 2 && session - 2 < n) ?
+			ptys[session - 2] : NULL;
+		p = NULL;
+		if (!upgrade_failed && (session < 2 || pty) &&
+			!(p = client_alloc()))
+			upgrade_failed = 1;
+		upgrade_failed |= failed;
+		if (!p)
+		{
+			if (crec.fd >= 0)
+				close(crec.fd);
+			free(crec.outq.buf);
+			free(crec.in);
+			continue;
+		}
+		free(p->in);
+		*p = crec;
+		if (ask)
+			asker = p;
+		fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+
+		p->pty = pty;
+		if (p->blocking && p->pty)
+			p->pty->nblocking++;
+		else
+			p->blocking = 0;
+#ifdef USE_DIRECT
+		/* The client still has the pty, and we don't read it until it
+		** gives it back. */
+		if (p->direct && p->pty)
+			p->pty->direct = p;
+		else
+			p->direct = 0;
+#endif
+		client_link(p, p->pty ? &p->pty->clients : &unbound);
+	}
+	fclose(f);
+	free(ptys);
+
+	/* Let whoever asked know that we have taken over. */
+	if (asker)
+	{
+		ack[0] = MSG_UPGRADE;
+		ack[1] = 1;
+		ack[2] = ack[3] = 0;
+		client_write(asker, ack, sizeof(ack));
+	}
+	return master_serve(s);
 }
 
 /* The master process - It watches over the pty process and the attached */
@@ -454,9 +4092,6 @@ client_activity(struct client *p)
 static int
 master_process(int s, char **argv, int waitattach, int nofork, int statusfd)
 {
-	struct client *p, *next;
-	fd_set readfds;
-	int highest_fd;
 	int nullfd;
 
 	/* Okay, disassociate ourselves from the original terminal if
@@ -466,27 +4101,12 @@ master_process(int s, char **argv, int waitattach, int nofork, int statusfd)
 
 	/* Set a trap to unlink the socket when we die. */
 	atexit(unlink_socket);
-
-	/* Set up some signals. */
-	struct sigaction sa;
-	sa.sa_flags = SA_NOCLDSTOP;
-	sigemptyset(&sa.sa_mask);
-
-	sa.sa_handler = SIG_IGN;
-	sigaction(SIGPIPE, &sa, NULL);
-	sigaction(SIGXFSZ, &sa, NULL);
-	sigaction(SIGHUP, &sa, NULL);
-	sigaction(SIGTTIN, &sa, NULL);
-	sigaction(SIGTTOU, &sa, NULL);
-
-	sa.sa_handler = die;
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGCHLD, &sa, NULL);
-
+	metrics_init();
+	master_signals();
 
 	/* Create a pty in which the process is running. */
-	if (init_pty(argv, statusfd) < 0)
+	if (!pty_new(multisession ? session_name : NULL, argv, NULL, waitattach,
+		statusfd))
 	{
 		if (statusfd != -1)
 			dup2(statusfd, 1);
@@ -510,61 +4130,238 @@ master_process(int s, char **argv, int waitattach, int nofork, int statusfd)
 			close(nullfd);
 	}
 
+	return master_serve(s);
+}
+
+/* Serve the clients of the sessions until the last one ends. */
+static int
+master_serve(int s)
+{
+	struct pty *pty;
+#ifdef USE_EPOLL
+	struct client *p;
+#else
+	struct pty *next;
+	fd_set readfds, writefds, readwant, writewant;
+	struct timeval tv;
+	int highest_fd;
+#endif
+	int n, timeout, slept;
+	uint64_t now, looked, until;
+
+#ifdef USE_EPOLL
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0 || watch_fd(s, EPOLLIN|EPOLLET, &control_tag) < 0)
+		return 1;
+#ifdef USE_SIGNALFD
+	if (sigfd >= 0 && watch_fd(sigfd, EPOLLIN, &signal_tag) < 0)
+		return 1;
+#endif
+	/* Pick up anyone who connected before we started watching. */
+	control_ready = 1;
+
+	/* Watch the clients that we took over in a live upgrade. */
+	for (pty = sessions; pty; pty = pty->next)
+		for (p = pty->clients; p; p = p->next)
+			if (watch_fd(p->fd, EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET,
+				p) < 0)
+				client_hangup(p);
+	for (p = unbound; p; p = p->next)
+		if (watch_fd(p->fd, EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET, p) < 0)
+			client_hangup(p);
+
 	/* Main loop. */
 	stop = 0;
+	looked = now_usec();
 	while (!stop)
 	{
-		/* Re-initialize the file descriptor set for select. */
-		FD_ZERO(&readfds);
-		FD_SET(s, &readfds);
-		highest_fd = s;
+		if (dump_metrics)
+			metrics_dump();
+		if (upgrade_pending)
+			master_upgrade(s);
+		timeout = settle_due();
 
-		/*
-		** When waitattach is set, wait until the client attaches
-		** before trying to read from the pty.
-		*/
-		if (waitattach)
+		/* The clients' input goes out first, so that it doesn't wait
+		** on the output of another session. */
+		for (pty = pending; pty; pty = pty->pending_next)
+			if (pty->inq.len > 0)
+				pty_flush(pty);
+
+		/* Look at the ptys that need it: write out any input that came
+		** in since, read the program's output, and catch up on which
+		** events to watch for. Output that is left once the slice runs
+		** out is still there after the clients have been seen to. */
+		until = now_usec() + OUTPUT_SLICE;
+		while (pending)
 		{
-			if (clients && clients->attached)
-				waitattach = 0;
+			pty = pending;
+			pending = pty->pending_next;
+			pty->on_pending = 0;
+
+			if (pty->inq.len > 0)
+				pty_flush(pty);
+			n = 0;
+			if (pty->readable)
+			{
+				pty->readable = 0;
+				if (pty_reading(pty))
+					n = pty_drain(pty, until);
+			}
+			if (n == 0 && pty_watch(pty) < 0)
+				n = -1;
+
+			/* Only this session is affected, unless it's the only
+			** one we have. */
+			if (n < 0 && !multisession)
+				return 1;
+			else if (n != 0)
+				pty_close(pty);
 		}
-		else
+		if (stop)
+			break;
+
+		/* Wait for something to happen, unless something already
+		** has, or for the next requests to settle. Only sleep once
+		** nothing is waiting, so we know what woke us. */
+		slept = 0;
+		if (!control_ready && !ready && !signal_ready)
+		{
+			n = poll_events(0);
+			if (n == 0 && timeout != 0)
+			{
+				n = poll_events(timeout);
+				slept = 1;
+			}
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return 1;
+			}
+			metrics.wakeups++;
+		}
+		now = now_usec();
+		input_since = slept ? now : looked;
+		looked = now;
+
+#ifdef USE_SIGNALFD
+		if (signal_ready)
+			signal_activity();
+#endif
+		/* New client? */
+		if (control_ready)
+			control_activity(s);
+		/* Activity on a client? */
+		while (ready)
 		{
-			FD_SET(the_pty.fd, &readfds);
-			if (the_pty.fd > highest_fd)
-				highest_fd = the_pty.fd;
+			p = ready;
+			ready = p->ready_next;
+			p->on_ready = 0;
+			if (p->writable && p->outq.len > 0)
+				client_flush(p);
+			if (p->readable)
+			{
+				p->readable = 0;
+				client_activity(p);
+			}
 		}
+	}
+#else
+	/* Main loop. */
+	stop = 0;
+	looked = now_usec();
+	while (!stop)
+	{
+		if (dump_metrics)
+			metrics_dump();
+		if (upgrade_pending)
+			master_upgrade(s);
+		timeout = settle_due();
+
+		/* Re-initialize the file descriptor sets for select. */
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_SET(s, &readfds);
+		highest_fd = s;
 
-		for (p = clients; p; p = p->next)
+		for (pty = sessions; pty; pty = pty->next)
 		{
-			FD_SET(p->fd, &readfds);
-			if (p->fd > highest_fd)
-				highest_fd = p->fd;
+			/* Only read from the pty when we should. */
+			if (pty_reading(pty))
+				FD_SET(pty->fd, &readfds);
+
+			/* Wait for the pty to take more input if it has some
+			** queued. */
+			if (pty->inq.len > 0)
+				FD_SET(pty->fd, &writefds);
+			if (pty->fd > highest_fd)
+				highest_fd = pty->fd;
 		}
 
-		/* Wait for something to happen. */
-		if (select(highest_fd + 1, &readfds, NULL, NULL, NULL) < 0)
+		highest_fd = select_clients(unbound, &readfds, &writefds,
+			highest_fd);
+		for (pty = sessions; pty; pty = pty->next)
+			highest_fd = select_clients(pty->clients, &readfds,
+				&writefds, highest_fd);
+
+		/* Wait for something to happen, or for the next requests to
+		** settle. Only sleep once nothing is waiting, so we know what
+		** woke us. */
+		readwant = readfds;
+		writewant = writefds;
+		tv.tv_sec = tv.tv_usec = 0;
+		n = select(highest_fd + 1, &readfds, &writefds, NULL, &tv);
+		slept = 0;
+		if (n == 0 && timeout != 0)
+		{
+			readfds = readwant;
+			writefds = writewant;
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+			n = select(highest_fd + 1, &readfds, &writefds, NULL,
+				timeout < 0 ? NULL : &tv);
+			slept = 1;
+		}
+		if (n < 0)
 		{
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
 			return 1;
 		}
+		metrics.wakeups++;
+		now = now_usec();
+		input_since = slept ? now : looked;
+		looked = now;
 
 		/* New client? */
 		if (FD_ISSET(s, &readfds))
 			control_activity(s);
 		/* Activity on a client? */
-		for (p = clients; p; p = next)
+		serve_clients(unbound, &readfds, &writefds);
+		for (pty = sessions; pty; pty = pty->next)
+			serve_clients(pty->clients, &readfds, &writefds);
+
+		/* Input for the programs goes out before any of their output
+		** is read, and output is only read for a slice of time. */
+		for (pty = sessions; pty; pty = pty->next)
+			if (pty->inq.len > 0)
+				pty_flush(pty);
+		until = now_usec() + OUTPUT_SLICE;
+		for (pty = sessions; pty; pty = next)
 		{
-			next = p->next;
-			if (FD_ISSET(p->fd, &readfds))
-				client_activity(p);
-		}
-		/* pty activity? */
-		if (FD_ISSET(the_pty.fd, &readfds))
-			if (pty_activity(s))
+			next = pty->next;
+
+			/* pty activity? */
+			if (!FD_ISSET(pty->fd, &readfds))
+				continue;
+			n = pty_drain(pty, until);
+			if (n < 0 && !multisession)
 				return 1;
+			else if (n != 0)
+				pty_close(pty);
+		}
 	}
+#endif
 	return 0;
 }
 
@@ -638,24 +4435,241 @@ master_main(char **argv, int waitattach, int nofork)
 				close(fd[0]);
 			}
 #endif
-			close(s);
-			return 0;
-		}
-		/* Child - this becomes the master */
-		if (fd[0] != -1)
-			close(fd[0]);
+			close(s);
+			return 0;
+		}
+		/* Child - this becomes the master */
+		if (fd[0] != -1)
+			close(fd[0]);
+	}
+	else /* Not forking, send status to stderr */
+		fd[1] = dup(2);
+
+	/* A pool has no program to start, so it is ready already. */
+	if (pool_size)
+	{
+		if (fd[1] != -1)
+			close(fd[1]);
+		return pool_main(s, pool_size, nofork);
+	}
+	return master_process(s, argv, waitattach, nofork, fd[1]);
+}
+
+/* Answer the pool with a MSG_POOL frame. */
+static int
+pool_reply(int fd, int arg, const char *msg)
+{
+	unsigned char hdr[FRAME_HDR];
+	size_t len = msg ? strlen(msg) : 0;
+
+	hdr[0] = MSG_POOL;
+	hdr[1] = arg;
+	hdr[2] = len >> 8;
+	hdr[3] = len & 0xff;
+	if (write_all(fd, hdr, sizeof(hdr)) < 0 ||
+		write_all(fd, msg, len) < 0)
+		return -1;
+	return 0;
+}
+
+/* A master in the pool. It gets the pty and the program's process going,
+** tells the pool it is ready over fd, and waits to be handed a session.
+** Only then does it create the socket and tell the program what to run. */
+int
+warm_master(int fd)
+{
+	unsigned char hdr[FRAME_HDR];
+	char msg[1024], *buf, *sock, *cwd, *end;
+	struct termios term;
+	struct pty *pty;
+	size_t len, off = 0;
+	ssize_t n;
+	int status[2], flags, s;
+
+	/* There is no socket to unlink until we get one. */
+	sockname = NULL;
+	setsid();
+	master_signals();
+
+	if (pipe(status) < 0)
+		return 1;
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	fcntl(status[0], F_SETFD, FD_CLOEXEC);
+	fcntl(status[1], F_SETFD, FD_CLOEXEC);
+#endif
+	pty = pty_new(NULL, NULL, NULL, 0, status[1]);
+	close(status[1]);
+	buf = malloc(FRAME_MAX + 1);
+	if (!pty || !buf || pool_reply(fd, SESSION_OK, NULL) < 0)
+		return 1;
+
+	/* Wait for a session. The pool going away just means we aren't
+	** needed anymore. */
+	if (read_all(fd, hdr, sizeof(hdr)) < 0 || hdr[0] != MSG_POOL)
+		return 0;
+	flags = hdr[1];
+	len = (hdr[2] << 8) | hdr[3];
+	if (read_all(fd, buf, len) < 0)
+		return 0;
+	buf[len] = 0;
+	end = buf + len;
+
+	if (flags & POOL_TERM)
+	{
+		if (len >= sizeof(struct termios))
+			memcpy(&term, buf, sizeof(struct termios));
+		off = sizeof(struct termios);
+	}
+	sock = buf + off;
+	cwd = sock + strlen(sock) + 1;
+	if (off >= len || cwd >= end || cwd + strlen(cwd) + 1 >= end ||
+		end[-1] != 0 || !*sock)
+	{
+		snprintf(msg, sizeof(msg), "%s: The request was garbled.\n",
+			progname);
+		pool_reply(fd, SESSION_FAILED, msg);
+		return 1;
+	}
+
+	if (*cwd && chdir(cwd) < 0)
+	{
+		snprintf(msg, sizeof(msg), "%s: %s: %s\n", progname, cwd,
+			strerror(errno));
+		pool_reply(fd, SESSION_FAILED, msg);
+		return 1;
+	}
+	s = create_socket(sock);
+	if (s < 0)
+	{
+		snprintf(msg, sizeof(msg), "%s: %s: %s\n", progname, sock,
+			strerror(errno));
+		pool_reply(fd, SESSION_FAILED, msg);
+		return 1;
+	}
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+#endif
+	sockname = sock;
+	atexit(unlink_socket);
+	metrics_init();
+
+	/* The pty was set up with the pool's terminal settings, so switch
+	** to the client's. */
+	if (flags & POOL_TERM)
+	{
+		pty->term = term;
+#ifdef BROKEN_MASTER
+		tcsetattr(pty->slave, TCSANOW, &term);
+#else
+		tcsetattr(pty->fd, TCSANOW, &term);
+#endif
 	}
-	else /* Not forking, send status to stderr */
-		fd[1] = dup(2);
+	pty->waitattach = flags & POOL_WAIT;
 
-	return master_process(s, argv, waitattach, nofork, fd[1]);
+	/* Tell the program what to run, and wait to hear whether it could.
+	** The status pipe closes when it does. */
+	n = write_all(warm_cmd[1], cwd, end - cwd);
+	close(warm_cmd[1]);
+	if (n < 0)
+	{
+		snprintf(msg, sizeof(msg), "%s: The program went away.\n",
+			progname);
+		pool_reply(fd, SESSION_FAILED, msg);
+		return 1;
+	}
+	len = 0;
+	while (len < sizeof(msg) - 1)
+	{
+		n = read(status[0], msg + len, sizeof(msg) - 1 - len);
+		if (n == 0 || (n < 0 && errno != EINTR))
+			break;
+		else if (n > 0)
+			len += n;
+	}
+	close(status[0]);
+	if (len > 0)
+	{
+		msg[len] = 0;
+		pool_reply(fd, SESSION_FAILED, msg);
+		return 1;
+	}
+
+	pool_reply(fd, SESSION_OK, NULL);
+	close(fd);
+	return master_serve(s);
+}
+
+/* Ask the master already running on the socket to start the session, in
+** the current directory. */
+static int
+session_request(int s, char **argv)
+{
+	char cwd[PATH_MAX], *buf, *end;
+	size_t len;
+	int i, n;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		cwd[0] = 0;
+	len = strlen(session_name) + 1 + strlen(cwd) + 1;
+	for (i = 0; argv[i]; ++i)
+		len += strlen(argv[i]) + 1;
+	if (len > FRAME_MAX)
+	{
+		fprintf(stderr, "%s: The command is too long.\n", progname);
+		return 1;
+	}
+	buf = malloc(len);
+	if (!buf)
+	{
+		fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+
+	end = buf;
+	strcpy(end, session_name);
+	end += strlen(end) + 1;
+	strcpy(end, cwd);
+	end += strlen(end) + 1;
+	for (i = 0; argv[i]; ++i)
+	{
+		strcpy(end, argv[i]);
+		end += strlen(end) + 1;
+	}
+
+	if (negotiate(s) < 3)
+	{
+		fprintf(stderr, "%s: %s: The master does not host named "
+			"sessions.\n", progname, sockname);
+		n = 1;
+	}
+	else if ((n = request_session(s, session_flags, buf, len)) ==
+		SESSION_OK)
+		n = 0;
+	else if (n == SESSION_EXISTS)
+	{
+		fprintf(stderr, "%s: %s: There is already a session named "
+			"'%s'.\n", progname, sockname, session_name);
+		n = 1;
+	}
+	else
+	{
+		fprintf(stderr, "%s: %s: Could not start the session '%s'.\n",
+			progname, sockname, session_name);
+		n = 1;
+	}
+	free(buf);
+	close(s);
+	return n;
 }
 
 int
 main(int argc, char **argv)
 {
+	char *pool = NULL;
+	int resume = -1;
 	int nofork = 0;
 	int waitattach = 0;
+	int n;
 
 	/* Save the program name */
 	progname = argv[0];
@@ -680,6 +4694,12 @@ main(int argc, char **argv)
 		printf("%s", copyright);
 		return 0;
 	}
+	/* For live upgrades, say how the state is saved. */
+	else if (strcmp(*argv, "--upgrade-version") == 0)
+	{
+		printf("%d\n", UPGRADE_VERSION);
+		return 0;
+	}
 	sockname = *argv;
 	++argv; --argc;
 
@@ -711,6 +4731,8 @@ main(int argc, char **argv)
 					redraw_method = REDRAW_CTRL_L;
 				else if (strcmp(argv[0], "winch") == 0)
 					redraw_method = REDRAW_WINCH;
+				else if (strcmp(argv[0], "screen") == 0)
+					redraw_method = REDRAW_SCREEN;
 				else
 				{
 					fprintf(stderr, "%s: Invalid redraw "
@@ -723,6 +4745,289 @@ main(int argc, char **argv)
 				}
 				break;
 			}
+			else if (*p == 'q')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No overflow policy "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "block") == 0)
+					overflow_policy = OVERFLOW_BLOCK;
+				else if (strcmp(argv[0], "drop") == 0)
+					overflow_policy = OVERFLOW_DROP;
+				else if (strcmp(argv[0], "disconnect") == 0)
+					overflow_policy = OVERFLOW_DISCONNECT;
+				else
+				{
+					fprintf(stderr, "%s: Invalid overflow "
+						"policy specified.\n",
+						progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'Q')
+			{
+				++argv; --argc;
+				if (argc < 1 || parse_size(argv[0], &outq_size) < 0
+					|| outq_size < 2 * BUFSIZE)
+				{
+					fprintf(stderr, "%s: Invalid queue size "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'o')
+			{
+				++argv; --argc;
+				if (argc < 1 || parse_size(argv[0], &observe_size) < 0
+					|| observe_size < 16 * BUFSIZE)
+				{
+					fprintf(stderr, "%s: Invalid ring size "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+#ifndef USE_OBSERVERS
+				fprintf(stderr, "%s: Observers are not supported "
+					"on this system.\n", progname);
+				return 1;
+#endif
+				break;
+			}
+			else if (*p == 'd')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No detached policy "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "drop") == 0)
+					detach_policy = DETACH_DROP;
+				else if (strcmp(argv[0], "buffer") == 0)
+					detach_policy = DETACH_BUFFER;
+				else if (strcmp(argv[0], "pause") == 0)
+					detach_policy = DETACH_PAUSE;
+				else
+				{
+					fprintf(stderr, "%s: Invalid detached "
+						"policy specified.\n",
+						progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'D')
+			{
+				++argv; --argc;
+				if (argc < 1 || parse_size(argv[0], &held_size) < 0
+					|| held_size < 2 * BUFSIZE)
+				{
+					fprintf(stderr, "%s: Invalid detached "
+						"buffer size specified.\n",
+						progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'W')
+			{
+				++argv; --argc;
+				if (argc < 1 || *argv[0] < '0' || *argv[0] > '9'
+					|| (settle_ms = atoi(argv[0])) > SETTLE_MAX)
+				{
+					fprintf(stderr, "%s: Invalid settle time "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'g')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No size policy "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "latest") == 0)
+					size_policy = SIZE_LATEST;
+				else if (strcmp(argv[0], "smallest") == 0)
+					size_policy = SIZE_SMALLEST;
+				else
+				{
+					fprintf(stderr, "%s: Invalid size "
+						"policy specified.\n",
+						progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 's' || *p == 'S')
+			{
+				session_flags = SESSION_CREATE;
+				if (*p == 's')
+					session_flags |= SESSION_EXCL;
+				++argv; --argc;
+				if (argc < 1 || !session_name_ok(argv[0]))
+				{
+					fprintf(stderr, "%s: Invalid session "
+						"name specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				session_name = argv[0];
+				break;
+			}
+			else if (*p == 'M')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No metrics file "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				metrics_path = argv[0];
+				break;
+			}
+			else if (*p == 'L')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No recording file "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+#ifndef USE_RECORDING
+				fprintf(stderr, "%s: Recording is not supported "
+					"on this system.\n", progname);
+				return 1;
+#endif
+				record_path = argv[0];
+				break;
+			}
+			else if (*p == 'G')
+			{
+				++argv; --argc;
+				if (argc < 1 || parse_size(argv[0], &record_limit) < 0)
+				{
+					fprintf(stderr, "%s: Invalid recording size "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'C')
+			{
+#ifndef USE_ZLIB
+				fprintf(stderr, "%s: Compression is not supported "
+					"on this system.\n", progname);
+				return 1;
+#endif
+				record_compress = 1;
+			}
+			else if (*p == 'R')
+			{
+				++argv; --argc;
+				if (argc < 1 || parse_size(argv[0], &replay_size) < 0)
+				{
+					fprintf(stderr, "%s: Invalid replay size "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'P')
+			{
+				++argv; --argc;
+				if (argc < 1 || (pool_size = atoi(argv[0])) < 1
+					|| pool_size > POOL_MAX)
+				{
+					fprintf(stderr, "%s: Invalid pool size "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'p')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					fprintf(stderr, "%s: No pool socket "
+						"specified.\n", progname);
+					fprintf(stderr, "Try '%s --help' for "
+						"more information.\n",
+						progname);
+					return 1;
+				}
+				pool = argv[0];
+				break;
+			}
+			/* Taking over in a live upgrade. */
+			else if (*p == 'U')
+			{
+				++argv; --argc;
+				if (argc < 1)
+					return 1;
+				resume = atoi(argv[0]);
+				break;
+			}
 			else if (*p == '?')
 			{
 				usage();
@@ -740,7 +5045,42 @@ main(int argc, char **argv)
 		++argv; --argc;
 	}
 
-	if (argc < 1)
+	if (resume >= 0)
+		return master_resume(resume);
+	/* The replay and the held output are handed over in one go. */
+	if (held_size > outq_size)
+	{
+		fprintf(stderr, "%s: The detached buffer can't be bigger than "
+			"the output queue.\n", progname);
+		fprintf(stderr, "Try '%s --help' for more information.\n",
+			progname);
+		return 1;
+	}
+	if (replay_size > outq_size -
+		(detach_policy == DETACH_DROP ? 0 : held_size))
+	{
+		fprintf(stderr, "%s: The replay buffer can't be bigger than "
+			"the output queue%s.\n", progname,
+			detach_policy == DETACH_DROP ? "" :
+			", less the detached buffer");
+		fprintf(stderr, "Try '%s --help' for more information.\n",
+			progname);
+		return 1;
+	}
+	if (pool_size)
+	{
+		/* Every session in the pool would share these. */
+		if (argc > 0 || session_name || record_path || metrics_path)
+		{
+			fprintf(stderr, "%s: A pool can't have a command, named "
+				"sessions, recordings or a metrics file.\n",
+				progname);
+			fprintf(stderr, "Try '%s --help' for more "
+				"information.\n", progname);
+			return 1;
+		}
+	}
+	else if (argc < 1)
 	{
 		fprintf(stderr, "%s: No command was specified.\n", progname);
 		fprintf(stderr, "Try '%s --help' for more information.\n",
@@ -748,6 +5088,21 @@ main(int argc, char **argv)
 		return 1;
 	}
 
+	/* If there is a master hosting sessions already, it can start this
+	** one. Otherwise, we become that master. */
+	if (session_name)
+	{
+		int s = connect_socket(sockname);
+
+		if (s >= 0)
+		{
+			if (waitattach)
+				session_flags |= SESSION_WAIT;
+			return session_request(s, argv);
+		}
+		multisession = 1;
+	}
+
 	/* Save the original terminal settings. */
 	if (tcgetattr(0, &orig_term) < 0)
 	{
@@ -755,6 +5110,12 @@ main(int argc, char **argv)
 		dont_have_tty = 1;
 	}
 
+	/* Have the pool start the session, if there is one. Otherwise we
+	** start it ourselves. */
+	if (pool && !session_name &&
+		(n = pool_request(pool, argv, waitattach)) >= 0)
+		return n;
+
 	return master_main(argv, waitattach, nofork);
 }
 
@@ -0,0 +1,447 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+/*
+** A pool of masters that are ready to start sessions. Each is a child of
+** the pool, talking to it over a socket pair, and has already forked and
+** set up its pty, so starting a session only takes creating the socket and
+** executing the program. When a client asks for a session, the pool hands
+** its request to a ready master and starts another to take its place. If
+** none is ready, the client waits for a new one.
+**
+** The pool serves one client at a time, and gives up on clients and masters
+** that take longer than POOL_TIMEOUT milliseconds to answer.
+*/
+#define POOL_TIMEOUT 2000
+
+struct warm
+{
+	/* The master's process, and our end of the socket pair. */
+	pid_t pid;
+	int fd;
+	/* Set once it has said it is ready. */
+	int ready;
+};
+
+static struct warm warm[POOL_MAX + 1];
+static int nwarm;
+/* Requests that found a master ready, and ones that had to wait for one.
+** Masters started, and ones that died before starting a session. */
+static uint64_t hits, misses, spawned, failed;
+/* When to try starting masters again, after one failed. */
+static time_t retry;
+static volatile sig_atomic_t pool_stop;
+
+/* Signal */
+static RETSIGTYPE
+pool_die(int sig)
+{
+	(void)sig;
+	pool_stop = 1;
+}
+
+/* Don't wait forever on the other end of fd. */
+static void
+set_timeout(int fd, int ms)
+{
+	struct timeval tv;
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Send a frame. */
+static int
+send_frame(int fd, int type, int arg, const void *buf, size_t len)
+{
+	unsigned char hdr[FRAME_HDR];
+
+	hdr[0] = type;
+	hdr[1] = arg;
+	hdr[2] = len >> 8;
+	hdr[3] = len & 0xff;
+	if (write_all(fd, hdr, sizeof(hdr)) < 0 ||
+		write_all(fd, buf, len) < 0)
+		return -1;
+	return 0;
+}
+
+/* Start another master. The client being served, if any, is closed in
+** the child along with the pool's other sockets. */
+static int
+spawn(int s, int client)
+{
+	struct warm *w = &warm[nwarm];
+	int sv[2], i;
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+#endif
+	w->pid = fork();
+	if (w->pid < 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	else if (w->pid == 0)
+	{
+		close(s);
+		close(sv[0]);
+		if (client >= 0)
+			close(client);
+		for (i = 0; i < nwarm; ++i)
+			close(warm[i].fd);
+		exit(warm_master(sv[1]));
+	}
+	close(sv[1]);
+	set_timeout(sv[0], POOL_TIMEOUT);
+	w->fd = sv[0];
+	w->ready = 0;
+	++nwarm;
+	++spawned;
+	return 0;
+}
+
+/* Forget about a master. If it is still waiting for a session, it goes
+** away when it notices. */
+static void
+forget(int i)
+{
+	close(warm[i].fd);
+	warm[i] = warm[--nwarm];
+}
+
+/* Hear from a master that is starting up, or has died. */
+static void
+master_ready(int i)
+{
+	unsigned char hdr[FRAME_HDR];
+
+	if (!warm[i].ready && read_all(warm[i].fd, hdr, sizeof(hdr)) == 0 &&
+		hdr[0] == MSG_POOL && hdr[1] == SESSION_OK &&
+		hdr[2] == 0 && hdr[3] == 0)
+	{
+		warm[i].ready = 1;
+		return;
+	}
+	++failed;
+	retry = time(NULL) + 1;
+	forget(i);
+}
+
+/* Say how the pool is doing, as text in the Prometheus exposition
+** format. */
+static void
+pool_metrics(int fd, int size)
+{
+	static const struct
+	{
+		const char *type, *name, *help;
+	} names[] =
+	{
+		{ "gauge", "pool_size", "Masters the pool keeps ready." },
+		{ "gauge", "pool_ready", "Masters ready right now." },
+		{ "counter", "pool_hits_total",
+			"Sessions started by a master that was ready." },
+		{ "counter", "pool_misses_total",
+			"Sessions that had to wait for a master." },
+		{ "counter", "pool_spawned_total", "Masters started." },
+		{ "counter", "pool_failed_total",
+			"Masters and sessions that failed to start." },
+	};
+	char buf[FRAME_MAX];
+	uint64_t v[6];
+	size_t len = 0;
+	int i, n;
+
+	v[0] = size;
+	v[1] = 0;
+	for (i = 0; i < nwarm; ++i)
+		v[1] += warm[i].ready;
+	v[2] = hits;
+	v[3] = misses;
+	v[4] = spawned;
+	v[5] = failed;
+	for (i = 0; i < 6; ++i)
+	{
+		n = snprintf(buf + len, sizeof(buf) - len,
+			"# HELP dtach_%s %s\n# TYPE dtach_%s %s\n"
+			"dtach_%s %llu\n", names[i].name, names[i].help,
+			names[i].name, names[i].type, names[i].name,
+			(unsigned long long)v[i]);
+		if (n > 0)
+			len += n;
+	}
+	send_frame(fd, MSG_STATS, 0, buf, len);
+}
+
+/* Hand a request for a session to a master, starting one if none is
+** ready, and pass its answer back to the client. */
+static void
+pool_session(int s, int fd, int arg, unsigned char *buf, size_t len)
+{
+	unsigned char hdr[FRAME_HDR];
+	const char *why = NULL;
+	char msg[256];
+	int i;
+
+	for (i = 0; i < nwarm && !warm[i].ready; ++i)
+		;
+	if (i < nwarm)
+		++hits;
+	else
+	{
+		++misses;
+		why = "Could not start a master";
+		if (spawn(s, fd) < 0)
+		{
+			++failed;
+			goto fail;
+		}
+		i = nwarm - 1;
+		master_ready(i);
+		if (i >= nwarm || !warm[i].ready)
+			goto fail;
+	}
+
+	why = "The master went away";
+	if (send_frame(warm[i].fd, MSG_POOL, arg, buf, len) < 0 ||
+		read_all(warm[i].fd, hdr, sizeof(hdr)) < 0 ||
+		hdr[0] != MSG_POOL ||
+		read_all(warm[i].fd, buf, (hdr[2] << 8) | hdr[3]) < 0)
+	{
+		++failed;
+		forget(i);
+		goto fail;
+	}
+	len = (hdr[2] << 8) | hdr[3];
+	if (hdr[1] != SESSION_OK)
+		++failed;
+	forget(i);
+	send_frame(fd, MSG_POOL, hdr[1], buf, len);
+	return;
+
+fail:
+	snprintf(msg, sizeof(msg), "%s: %s: %s.\n", progname, sockname, why);
+	send_frame(fd, MSG_POOL, SESSION_FAILED, msg, strlen(msg));
+}
+
+/* Serve a client: agree on a version, and answer the one thing it asks
+** for. */
+static void
+pool_client(int s, int fd, int size)
+{
+	static unsigned char buf[FRAME_MAX];
+	unsigned char hdr[FRAME_HDR];
+	struct packet pkt;
+	size_t len;
+	int version;
+
+	set_timeout(fd, POOL_TIMEOUT);
+	if (read_all(fd, &pkt, sizeof(struct packet)) < 0 ||
+		pkt.type != MSG_HELLO || pkt.len == 0)
+		return;
+	version = pkt.len < PROTOCOL_VERSION ? pkt.len : PROTOCOL_VERSION;
+	if (send_frame(fd, MSG_HELLO, version, NULL, 0) < 0 ||
+		read_all(fd, hdr, sizeof(hdr)) < 0)
+		return;
+	len = (hdr[2] << 8) | hdr[3];
+	if (read_all(fd, buf, len) < 0)
+		return;
+
+	if (hdr[0] == MSG_POOL && version >= 7)
+		pool_session(s, fd, hdr[1], buf, len);
+	else if (hdr[0] == MSG_STATS && hdr[1] == STATS_METRICS &&
+		version >= 5)
+		pool_metrics(fd, size);
+	/* The pool has no sessions of its own to list. */
+	else if (hdr[0] == MSG_STATS && version >= 4)
+		send_frame(fd, MSG_STATS, 0, NULL, 0);
+}
+
+/* The pool process. It keeps size masters ready, and hands them out to
+** the clients that connect to s. */
+int
+pool_main(int s, int size, int nofork)
+{
+	struct sigaction sa;
+	struct timeval tv;
+	fd_set readfds;
+	int fd, highest_fd, i, n;
+
+	if (!nofork)
+	{
+		setsid();
+		fd = open("/dev/null", O_RDWR);
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (fd > 2)
+			close(fd);
+	}
+
+	/* The masters are reaped as they exit, and we stop when told to. */
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDWAIT;
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGCHLD, &sa, NULL);
+	sa.sa_flags = 0;
+	sigaction(SIGPIPE, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = pool_die;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	while (!pool_stop)
+	{
+		if (time(NULL) >= retry)
+			while (nwarm < size && spawn(s, -1) == 0)
+				;
+
+		FD_ZERO(&readfds);
+		FD_SET(s, &readfds);
+		highest_fd = s;
+		for (i = 0; i < nwarm; ++i)
+		{
+			FD_SET(warm[i].fd, &readfds);
+			if (warm[i].fd > highest_fd)
+				highest_fd = warm[i].fd;
+		}
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		n = select(highest_fd + 1, &readfds, NULL, NULL, &tv);
+		if (n < 0 && errno != EINTR)
+			break;
+		else if (n <= 0)
+			continue;
+
+		/* Going backwards, so that the masters moved into the places
+		** of forgotten ones have been looked at already. */
+		for (i = nwarm - 1; i >= 0; --i)
+			if (FD_ISSET(warm[i].fd, &readfds))
+				master_ready(i);
+
+		if (FD_ISSET(s, &readfds))
+		{
+			fd = accept(s, NULL, NULL);
+			if (fd >= 0)
+			{
+				pool_client(s, fd, size);
+				close(fd);
+			}
+		}
+	}
+
+	unlink(sockname);
+	while (nwarm > 0)
+		forget(nwarm - 1);
+	return 0;
+}
+
+/* Ask the pool on the socket to start the session. Returns -1 without
+** printing anything if there is no pool to ask, so that the caller can
+** start the session itself. */
+int
+pool_request(char *pool, char **argv, int waitattach)
+{
+	unsigned char hdr[FRAME_HDR];
+	char cwd[PATH_MAX], *buf, *end;
+	size_t len, off = 0;
+	int s, i, flags = 0;
+
+	s = connect_socket(pool);
+	if (s < 0)
+		return -1;
+	if (negotiate(s) < 7)
+	{
+		close(s);
+		return -1;
+	}
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		cwd[0] = 0;
+	if (waitattach)
+		flags |= POOL_WAIT;
+	if (!dont_have_tty)
+	{
+		flags |= POOL_TERM;
+		off = sizeof(struct termios);
+	}
+	len = off + strlen(sockname) + 1 + strlen(cwd) + 1;
+	for (i = 0; argv[i]; ++i)
+		len += strlen(argv[i]) + 1;
+	if (len > FRAME_MAX)
+	{
+		fprintf(stderr, "%s: The command is too long.\n", progname);
+		close(s);
+		return 1;
+	}
+	buf = malloc(FRAME_MAX);
+	if (!buf)
+	{
+		fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+		close(s);
+		return 1;
+	}
+
+	memcpy(buf, &orig_term, off);
+	end = buf + off;
+	strcpy(end, sockname);
+	end += strlen(end) + 1;
+	strcpy(end, cwd);
+	end += strlen(end) + 1;
+	for (i = 0; argv[i]; ++i)
+	{
+		strcpy(end, argv[i]);
+		end += strlen(end) + 1;
+	}
+
+	/* The pool might have to wait for a master before it can ask it. */
+	set_timeout(s, 3 * POOL_TIMEOUT);
+	if (send_frame(s, MSG_POOL, flags, buf, len) < 0 ||
+		read_all(s, hdr, sizeof(hdr)) < 0 || hdr[0] != MSG_POOL ||
+		read_all(s, buf, (hdr[2] << 8) | hdr[3]) < 0)
+	{
+		fprintf(stderr, "%s: %s: The pool went away.\n", progname,
+			pool);
+		i = 1;
+	}
+	else if (hdr[1] != SESSION_OK)
+	{
+		len = (hdr[2] << 8) | hdr[3];
+		if (len > 0)
+			write_all(2, buf, len);
+		else
+			fprintf(stderr, "%s: %s: Could not start the "
+				"session.\n", progname, pool);
+		i = 1;
+	}
+	else
+		i = 0;
+	free(buf);
+	close(s);
+	return i;
+}
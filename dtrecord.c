@@ -0,0 +1,445 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+#ifdef USE_RECORDING
+/*
+** Recordings of what the sessions' programs output, in the format ttyrec
+** uses: every chunk of output comes after a header of the time it was read,
+** in seconds and microseconds, and its length, as 32-bit little-endian
+** numbers. The times come from the monotonic clock, counted from the wall
+** clock time the recording started, so they never go backwards.
+**
+** The master only copies each chunk into a buffer. A thread for each
+** recording writes the buffer out while the master fills the other one, so
+** a slow disk never holds up a session. Chunks that don't fit because the
+** thread has fallen behind are dropped, and counted.
+*/
+
+/* How much output can wait to be written, for each recording. */
+#define REC_BUFSIZE (1024 * 1024)
+/* The size of the header before each chunk. */
+#define REC_HEADER 12
+
+struct recorder
+{
+	/* The next recording in the list of them. */
+	struct recorder *next;
+	/* The thread that writes this one. */
+	pthread_t thread;
+	/* Guards the buffer and the flags. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Output waiting to be written, and the buffer that the thread is
+	** writing out or will swap in next. */
+	unsigned char *buf, *spare;
+	size_t len;
+	/* Set once the session has ended, and once the thread is done. */
+	int closing, done;
+
+	/* The rest only the thread touches, after it starts. */
+	/* The file, and whether it is compressed. */
+	char *path;
+	int fd, compress;
+#ifdef USE_ZLIB
+	gzFile gz;
+#endif
+	/* Start a new file once this many bytes are written, or never if 0. */
+	uint64_t limit;
+	/* How much has been written to the current file. */
+	uint64_t written;
+	/* The number to try first for the next file that is rotated out. */
+	unsigned int seq;
+	/* What to add to the monotonic clock to get the time of day. */
+	uint64_t offset;
+};
+
+/* Every recording whose thread hasn't been joined yet. */
+static struct recorder *recorders;
+/* Totals for the metrics. The threads add to these as they go. */
+static uint64_t total_written, total_dropped, total_rotations;
+
+/* Open the recording's file, adding to whatever is already in it. */
+static int
+rec_file_open(struct recorder *rec)
+{
+	struct stat st;
+
+	rec->fd = open(rec->path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (rec->fd < 0)
+		return -1;
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	/* The programs in the sessions have no business with it. */
+	fcntl(rec->fd, F_SETFD, FD_CLOEXEC);
+#endif
+	rec->written = (fstat(rec->fd, &st) == 0) ? st.st_size : 0;
+#ifdef USE_ZLIB
+	rec->gz = NULL;
+	if (rec->compress)
+	{
+		/* Another gzip member after the old ones is still one
+		** file to gzip. The fastest level keeps up with most
+		** programs, and output is repetitive enough anyway. */
+		rec->gz = gzdopen(rec->fd, "ab1");
+		if (!rec->gz)
+		{
+			close(rec->fd);
+			rec->fd = -1;
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/* Close the recording's file. */
+static void
+rec_file_close(struct recorder *rec)
+{
+#ifdef USE_ZLIB
+	if (rec->gz)
+	{
+		gzclose(rec->gz);
+		rec->gz = NULL;
+		rec->fd = -1;
+	}
+#endif
+	if (rec->fd >= 0)
+		close(rec->fd);
+	rec->fd = -1;
+}
+
+/* Move the full file out of the way as <path>.<n>, and start a new one. */
+static void
+rec_rotate(struct recorder *rec)
+{
+	char *name;
+
+	name = malloc(strlen(rec->path) + 16);
+	if (!name)
+		return;
+	do
+		sprintf(name, "%s.%u", rec->path, rec->seq++);
+	while (access(name, F_OK) == 0);
+
+	rec_file_close(rec);
+	if (rename(rec->path, name) == 0)
+		__atomic_add_fetch(&total_rotations, 1, __ATOMIC_RELAXED);
+	free(name);
+	rec_file_open(rec);
+}
+
+/* Write out part of a batch. What can't be written is counted as dropped. */
+static void
+rec_put(struct recorder *rec, const unsigned char *buf, size_t len)
+{
+	ssize_t n = -1;
+
+	if (len == 0)
+		return;
+#ifdef USE_ZLIB
+	if (rec->gz)
+		n = (gzwrite(rec->gz, buf, len) == (int)len) ?
+			(ssize_t)len : -1;
+	else
+#endif
+	if (rec->fd >= 0)
+		n = (write_all(rec->fd, buf, len) < 0) ? -1 : (ssize_t)len;
+
+	if (n < 0)
+	{
+		__atomic_add_fetch(&total_dropped, len, __ATOMIC_RELAXED);
+		return;
+	}
+	rec->written += len;
+	__atomic_add_fetch(&total_written, len, __ATOMIC_RELAXED);
+}
+
+/* Write out a batch of chunks, starting a new file between two of them
+** whenever the current one is full. */
+static void
+rec_write(struct recorder *rec, const unsigned char *buf, size_t len)
+{
+	size_t pos = 0, start = 0, n;
+#ifdef USE_ZLIB
+	struct stat st;
+
+	/* A compressed file is measured on the disk, so it is only started
+	** anew between batches, once it holds the limit. */
+	if (rec->gz)
+	{
+		if (rec->limit && rec->written >= rec->limit)
+			rec_rotate(rec);
+		rec_put(rec, buf, len);
+		/* Compress each batch as a block of its own, so that what is
+		** on the disk can always be read back. */
+		if (rec->gz)
+			gzflush(rec->gz, Z_SYNC_FLUSH);
+		if (rec->fd >= 0 && fstat(rec->fd, &st) == 0)
+			rec->written = st.st_size;
+		return;
+	}
+#endif
+
+	while (pos + REC_HEADER <= len)
+	{
+		n = REC_HEADER + (buf[pos + 8] | buf[pos + 9] << 8 |
+			buf[pos + 10] << 16 | (size_t)buf[pos + 11] << 24);
+		if (rec->limit && rec->written + (pos - start) > 0 &&
+			rec->written + (pos - start) + n > rec->limit)
+		{
+			rec_put(rec, buf + start, pos - start);
+			rec_rotate(rec);
+			start = pos;
+		}
+		pos += n;
+	}
+	rec_put(rec, buf + start, len - start);
+}
+
+/* The thread that writes out a recording, until its session ends and
+** everything is written. */
+static void *
+rec_thread(void *arg)
+{
+	struct recorder *rec = arg;
+	unsigned char *buf;
+	size_t len;
+
+	pthread_mutex_lock(&rec->lock);
+	for (;;)
+	{
+		while (rec->len == 0 && !rec->closing)
+			pthread_cond_wait(&rec->cond, &rec->lock);
+		if (rec->len == 0)
+			break;
+
+		/* Let the master fill the other buffer meanwhile. */
+		buf = rec->buf;
+		len = rec->len;
+		rec->buf = rec->spare;
+		rec->spare = buf;
+		rec->len = 0;
+		pthread_mutex_unlock(&rec->lock);
+
+		rec_write(rec, buf, len);
+
+		pthread_mutex_lock(&rec->lock);
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	rec_file_close(rec);
+	pthread_mutex_lock(&rec->lock);
+	rec->done = 1;
+	pthread_mutex_unlock(&rec->lock);
+	return NULL;
+}
+
+/* Free a recording whose thread has finished. */
+static void
+rec_free(struct recorder *rec)
+{
+	pthread_join(rec->thread, NULL);
+	pthread_mutex_destroy(&rec->lock);
+	pthread_cond_destroy(&rec->cond);
+	free(rec->buf);
+	free(rec->spare);
+	free(rec->path);
+	free(rec);
+}
+
+/* Join the threads of recordings that have been written out. */
+static void
+rec_reap(void)
+{
+	struct recorder **pp = &recorders, *rec;
+	int done;
+
+	while ((rec = *pp))
+	{
+		pthread_mutex_lock(&rec->lock);
+		done = rec->done;
+		pthread_mutex_unlock(&rec->lock);
+		if (done)
+		{
+			*pp = rec->next;
+			rec_free(rec);
+		}
+		else
+			pp = &rec->next;
+	}
+}
+
+/* Finish writing every recording before the master exits. */
+static void
+rec_finish(void)
+{
+	struct recorder *rec;
+
+	for (rec = recorders; rec; rec = rec->next)
+	{
+		pthread_mutex_lock(&rec->lock);
+		rec->closing = 1;
+		pthread_cond_signal(&rec->cond);
+		pthread_mutex_unlock(&rec->lock);
+	}
+	while ((rec = recorders))
+	{
+		recorders = rec->next;
+		rec_free(rec);
+	}
+}
+
+/* Start recording to a file. now is the time on the monotonic clock, in
+** microseconds. Returns NULL with errno set if it can't be done. */
+struct recorder *
+rec_open(const char *path, uint64_t limit, int compress, uint64_t now)
+{
+	static int registered;
+	struct recorder *rec;
+	sigset_t all, old;
+	struct timeval tv;
+	int err;
+
+	rec_reap();
+	if (!registered)
+	{
+		if (atexit(rec_finish) != 0)
+			return NULL;
+		registered = 1;
+	}
+
+	rec = calloc(1, sizeof(struct recorder));
+	if (!rec)
+		return NULL;
+	rec->fd = -1;
+	rec->limit = limit;
+	rec->seq = 1;
+	rec->compress = compress;
+	gettimeofday(&tv, NULL);
+	rec->offset = tv.tv_sec * (uint64_t)1000000 + tv.tv_usec - now;
+	rec->path = strdup(path);
+	rec->buf = malloc(REC_BUFSIZE);
+	rec->spare = malloc(REC_BUFSIZE);
+	if (!rec->path || !rec->buf || !rec->spare ||
+		rec_file_open(rec) < 0)
+		goto fail;
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+
+	/* Signals are for the master to handle, not the thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&rec->thread, NULL, rec_thread, rec);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0)
+	{
+		pthread_mutex_destroy(&rec->lock);
+		pthread_cond_destroy(&rec->cond);
+		rec_file_close(rec);
+		errno = err;
+		goto fail;
+	}
+
+	rec->next = recorders;
+	recorders = rec;
+	return rec;
+
+fail:
+	err = errno;
+	free(rec->buf);
+	free(rec->spare);
+	free(rec->path);
+	free(rec);
+	errno = err;
+	return NULL;
+}
+
+/* Add a chunk of output read at a time on the monotonic clock. It is
+** dropped if there isn't room for it. */
+void
+rec_output(struct recorder *rec, const unsigned char *buf, size_t len,
+	uint64_t now)
+{
+	uint64_t t = now + rec->offset;
+	uint32_t v[3];
+	unsigned char *p;
+	int i;
+
+	v[0] = t / 1000000;
+	v[1] = t % 1000000;
+	v[2] = len;
+
+	pthread_mutex_lock(&rec->lock);
+	if (rec->len + REC_HEADER + len > REC_BUFSIZE)
+	{
+		pthread_mutex_unlock(&rec->lock);
+		__atomic_add_fetch(&total_dropped, len, __ATOMIC_RELAXED);
+		return;
+	}
+	p = rec->buf + rec->len;
+	for (i = 0; i < 3; ++i, p += 4)
+	{
+		p[0] = v[i];
+		p[1] = v[i] >> 8;
+		p[2] = v[i] >> 16;
+		p[3] = v[i] >> 24;
+	}
+	memcpy(p, buf, len);
+	rec->len += REC_HEADER + len;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+}
+
+/* Stop recording when a session ends. The thread finishes writing on its
+** own, and is joined later. */
+void
+rec_close(struct recorder *rec)
+{
+	pthread_mutex_lock(&rec->lock);
+	rec->closing = 1;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+}
+
+/* Stop recording, and wait for the thread to write out everything it has
+** been given and close the file. */
+void
+rec_stop(struct recorder *rec)
+{
+	struct recorder **pp;
+
+	rec_close(rec);
+	for (pp = &recorders; *pp != rec; pp = &(*pp)->next)
+		;
+	*pp = rec->next;
+	rec_free(rec);
+}
+
+/* The totals of what has been recorded, what has been dropped, and how
+** many files have been rotated out. */
+void
+rec_totals(uint64_t *written, uint64_t *dropped, uint64_t *rotations)
+{
+	*written = __atomic_load_n(&total_written, __ATOMIC_RELAXED);
+	*dropped = __atomic_load_n(&total_dropped, __ATOMIC_RELAXED);
+	*rotations = __atomic_load_n(&total_rotations, __ATOMIC_RELAXED);
+}
+#endif
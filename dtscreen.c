@@ -0,0 +1,1569 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2008 Ned T. Crigler, 2011 Devin J. Pohly
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "dtach.h"
+
+/*
+** A model of the terminal screen the program is drawing on. The master feeds
+** it the program's output, and can then describe the current screen to a
+** newly attached client without having to ask the program to redraw.
+**
+** This understands the usual xterm-compatible subset of ECMA-48: cursor
+** movement, erasing, insertion and deletion, scrolling regions, SGR
+** attributes with 256 and 24-bit colors, the alternate screen, and the modes
+** that change how the terminal reports input. Anything else is ignored.
+** Output is assumed to be UTF-8, and combining characters are dropped.
+*/
+
+/* Cell attributes. */
+#define ATTR_BOLD	0x001
+#define ATTR_DIM	0x002
+#define ATTR_ITALIC	0x004
+#define ATTR_UNDERLINE	0x008
+#define ATTR_BLINK	0x010
+#define ATTR_REVERSE	0x020
+#define ATTR_INVISIBLE	0x040
+#define ATTR_STRIKE	0x080
+/* The right half of a double-width character. */
+#define ATTR_WIDE	0x100
+
+/* Colors are the default, a palette index, or 24-bit RGB. */
+#define COLOR_DEFAULT	0
+#define COLOR_PALETTE	0x1000000
+#define COLOR_RGB	0x2000000
+
+/* Parser states. */
+enum
+{
+	S_GROUND,
+	S_ESC,
+	S_ESC_INTER,
+	S_CSI,
+	S_OSC,
+	S_OSC_ESC,
+	S_STR,
+	S_STR_ESC,
+};
+
+#define MAX_PARAMS 16
+#define MAX_OSC 256
+
+/* The biggest screen that is modelled. The size comes from the clients, and
+** a bigger one is cut down to this, so a bogus size can't make the master
+** allocate gigabytes. */
+#define MAX_ROWS 512
+#define MAX_COLS 1024
+
+/* A character cell. A blank cell has ch == 0. */
+struct cell
+{
+	unsigned int ch;
+	unsigned int fg, bg;
+	unsigned int attr;
+};
+
+/* The cursor, and the state that DECSC saves along with it. */
+struct cursor
+{
+	int x, y;
+	/* The attributes for new characters. */
+	struct cell pen;
+	/* Set when the next character wraps to the next line. */
+	int wrapnext;
+	/* DECOM - positions are relative to the scrolling region. */
+	int origin;
+	/* The G0 and G1 character sets, and which one is in use. */
+	unsigned char charset[2];
+	int gl;
+};
+
+/* DEC private modes that only matter to the terminal, not to the screen
+** contents, but have to be set up again on a new terminal. */
+static const struct
+{
+	int mode;
+	int dflt;
+} private_modes[] =
+{
+	{ 1, 0 },	/* Application cursor keys */
+	{ 5, 0 },	/* Reverse video */
+	{ 9, 0 },	/* X10 mouse reporting */
+	{ 12, 0 },	/* Blinking cursor */
+	{ 25, 1 },	/* Visible cursor */
+	{ 1000, 0 },	/* Mouse button reporting */
+	{ 1002, 0 },	/* Mouse motion reporting */
+	{ 1003, 0 },	/* All mouse motion reporting */
+	{ 1004, 0 },	/* Focus reporting */
+	{ 1005, 0 },	/* UTF-8 mouse coordinates */
+	{ 1006, 0 },	/* SGR mouse coordinates */
+	{ 1015, 0 },	/* urxvt mouse coordinates */
+	{ 2004, 0 },	/* Bracketed paste */
+};
+#define NPRIVATE (sizeof(private_modes) / sizeof(private_modes[0]))
+
+struct screen
+{
+	int rows, cols;
+	/* The primary and alternate screens, and which one is in use. */
+	struct cell *grid[2];
+	int alt;
+	struct cursor cur;
+	/* The cursor saved by DECSC for each screen. */
+	struct cursor saved[2];
+	int saved_valid[2];
+	/* The scrolling region, inclusive. */
+	int top, bottom;
+	/* DECAWM, IRM and DECKPAM. */
+	int autowrap, insert, keypad;
+	/* The state of the private_modes. */
+	unsigned char private[NPRIVATE];
+	/* DECSCUSR cursor style. */
+	int cursor_style;
+	/* Tab stops, one flag per column. */
+	unsigned char *tabs;
+	/* The window title, if the program set one. */
+	char title[MAX_OSC];
+
+	/* Parser state. */
+	int state;
+	int params[MAX_PARAMS];
+	int nparams;
+	/* The private marker and intermediate byte of an escape sequence. */
+	int marker, inter;
+	/* A partially decoded UTF-8 character. */
+	unsigned int utf8;
+	int utf8_left;
+	/* The last printed character, for REP. */
+	unsigned int last;
+	char osc[MAX_OSC];
+	size_t osclen;
+};
+
+/* A growable output buffer for snapshots. */
+struct sbuf
+{
+	unsigned char *buf;
+	size_t len, size;
+	int failed;
+};
+
+/* DEC special graphics, for 0x5f-0x7e in the '0' character set. */
+static const unsigned short dec_graphics[] =
+{
+	0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+	0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+	0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+	0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+/* Ranges of zero-width and double-width characters. */
+static const unsigned int zero_width[][2] =
+{
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+	{ 0x0610, 0x061a }, { 0x064b, 0x065f }, { 0x0900, 0x0903 },
+	{ 0x093a, 0x094f }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+	{ 0x200b, 0x200f }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+	{ 0xfe20, 0xfe2f }, { 0xe0100, 0xe01ef },
+};
+static const unsigned int double_width[][2] =
+{
+	{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+	{ 0x23e9, 0x23ec }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+	{ 0x2648, 0x2653 }, { 0x26aa, 0x26ab }, { 0x26bd, 0x26be },
+	{ 0x26c4, 0x26c5 }, { 0x26f2, 0x26f5 }, { 0x2705, 0x2705 },
+	{ 0x270a, 0x270b }, { 0x2753, 0x2755 }, { 0x2795, 0x2797 },
+	{ 0x2b1b, 0x2b1c }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff },
+	{ 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+	{ 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff },
+	{ 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 },
+	{ 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f }, { 0x1f900, 0x1f9ff },
+	{ 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+static int
+in_ranges(unsigned int ch, const unsigned int (*r)[2], size_t n)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+
+		if (ch < r[mid][0])
+			hi = mid;
+		else if (ch > r[mid][1])
+			lo = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+/* The number of columns a character takes up. */
+static int
+char_width(unsigned int ch)
+{
+	if (ch < 0x300)
+		return 1;
+	if (in_ranges(ch, zero_width,
+		sizeof(zero_width) / sizeof(zero_width[0])))
+		return 0;
+	if (in_ranges(ch, double_width,
+		sizeof(double_width) / sizeof(double_width[0])))
+		return 2;
+	return 1;
+}
+
+static struct cell *
+row_of(struct screen *scr, int y)
+{
+	return scr->grid[scr->alt] + y * scr->cols;
+}
+
+/* A blank cell in the current background color. */
+static struct cell
+blank_cell(struct screen *scr)
+{
+	struct cell c;
+
+	memset(&c, 0, sizeof(c));
+	c.bg = scr->cur.pen.bg;
+	return c;
+}
+
+static void
+clear_cells(struct screen *scr, int y, int x0, int x1)
+{
+	struct cell *row = row_of(scr, y);
+	struct cell c = blank_cell(scr);
+	int x;
+
+	for (x = x0; x < x1; ++x)
+		row[x] = c;
+}
+
+static void
+clear_rows(struct screen *scr, int y0, int y1)
+{
+	int y;
+
+	for (y = y0; y < y1; ++y)
+		clear_cells(scr, y, 0, scr->cols);
+}
+
+/* Scroll the lines from top to bottom up by n, blanking the new ones. */
+static void
+scroll_up(struct screen *scr, int top, int bottom, int n)
+{
+	struct cell *g = scr->grid[scr->alt];
+
+	if (n > bottom - top + 1)
+		n = bottom - top + 1;
+	memmove(g + top * scr->cols, g + (top + n) * scr->cols,
+		(bottom - top + 1 - n) * scr->cols * sizeof(struct cell));
+	clear_rows(scr, bottom + 1 - n, bottom + 1);
+}
+
+/* Scroll the lines from top to bottom down by n, blanking the new ones. */
+static void
+scroll_down(struct screen *scr, int top, int bottom, int n)
+{
+	struct cell *g = scr->grid[scr->alt];
+
+	if (n > bottom - top + 1)
+		n = bottom - top + 1;
+	memmove(g + (top + n) * scr->cols, g + top * scr->cols,
+		(bottom - top + 1 - n) * scr->cols * sizeof(struct cell));
+	clear_rows(scr, top, top + n);
+}
+
+/* Move down a line, scrolling if we are at the bottom of the region. */
+static void
+linefeed(struct screen *scr)
+{
+	if (scr->cur.y == scr->bottom)
+		scroll_up(scr, scr->top, scr->bottom, 1);
+	else if (scr->cur.y < scr->rows - 1)
+		scr->cur.y++;
+}
+
+/* Move up a line, scrolling if we are at the top of the region. */
+static void
+reverse_index(struct screen *scr)
+{
+	if (scr->cur.y == scr->top)
+		scroll_down(scr, scr->top, scr->bottom, 1);
+	else if (scr->cur.y > 0)
+		scr->cur.y--;
+}
+
+/* Move the cursor, honoring origin mode for the row. */
+static void
+move_to(struct screen *scr, int y, int x)
+{
+	int miny = 0, maxy = scr->rows - 1;
+
+	if (scr->cur.origin)
+	{
+		y += scr->top;
+		miny = scr->top;
+		maxy = scr->bottom;
+	}
+	scr->cur.y = y < miny ? miny : y > maxy ? maxy : y;
+	scr->cur.x = x < 0 ? 0 : x >= scr->cols ? scr->cols - 1 : x;
+	scr->cur.wrapnext = 0;
+}
+
+/* Blank out the other half of any double-width character at (y, x). */
+static void
+break_wide(struct screen *scr, int y, int x)
+{
+	struct cell *row = row_of(scr, y);
+	struct cell c = blank_cell(scr);
+
+	if (row[x].attr & ATTR_WIDE)
+	{
+		if (x > 0)
+			row[x - 1] = c;
+		row[x] = c;
+	}
+	else if (x + 1 < scr->cols && (row[x + 1].attr & ATTR_WIDE))
+		row[x + 1] = c;
+}
+
+static void
+reset_tabs(struct screen *scr)
+{
+	int x;
+
+	for (x = 0; x < scr->cols; ++x)
+		scr->tabs[x] = (x % 8 == 0);
+}
+
+static void
+reset_cursor(struct cursor *cur)
+{
+	memset(cur, 0, sizeof(*cur));
+	cur->charset[0] = cur->charset[1] = 'B';
+}
+
+/* Reset everything but the size, like RIS. */
+static void
+reset(struct screen *scr)
+{
+	size_t i;
+
+	scr->alt = 1;
+	reset_cursor(&scr->cur);
+	clear_rows(scr, 0, scr->rows);
+	scr->alt = 0;
+	clear_rows(scr, 0, scr->rows);
+	scr->saved_valid[0] = scr->saved_valid[1] = 0;
+	scr->top = 0;
+	scr->bottom = scr->rows - 1;
+	scr->autowrap = 1;
+	scr->insert = scr->keypad = 0;
+	for (i = 0; i < NPRIVATE; ++i)
+		scr->private[i] = private_modes[i].dflt;
+	scr->cursor_style = 0;
+	scr->title[0] = '\0';
+	reset_tabs(scr);
+}
+
+/* Allocate a grid of cells, or return NULL if it can't be done. */
+static struct cell *
+grid_alloc(int rows, int cols)
+{
+	size_t n = (size_t)rows * cols;
+
+	if (n > SIZE_MAX / sizeof(struct cell))
+		return NULL;
+	return malloc(n * sizeof(struct cell));
+}
+
+struct screen *
+screen_new(int rows, int cols)
+{
+	struct screen *scr;
+
+	if (rows < 1 || cols < 1)
+	{
+		rows = 24;
+		cols = 80;
+	}
+	if (rows > MAX_ROWS)
+		rows = MAX_ROWS;
+	if (cols > MAX_COLS)
+		cols = MAX_COLS;
+
+	scr = calloc(1, sizeof(*scr));
+	if (!scr)
+		return NULL;
+	scr->rows = rows;
+	scr->cols = cols;
+	scr->grid[0] = grid_alloc(rows, cols);
+	scr->grid[1] = grid_alloc(rows, cols);
+	scr->tabs = malloc(cols);
+	if (!scr->grid[0] || !scr->grid[1] || !scr->tabs)
+	{
+		screen_free(scr);
+		return NULL;
+	}
+	reset(scr);
+	return scr;
+}
+
+void
+screen_free(struct screen *scr)
+{
+	if (!scr)
+		return;
+	free(scr->grid[0]);
+	free(scr->grid[1]);
+	free(scr->tabs);
+	free(scr);
+}
+
+/* Change the size of the screen. Lines that no longer fit are lost from the
+** top if the cursor would otherwise end up off the screen. */
+void
+screen_resize(struct screen *scr, int rows, int cols)
+{
+	struct cell *grid[2];
+	unsigned char *tabs;
+	int i, y, shift, ncols;
+	struct cell *c;
+
+	if (rows > MAX_ROWS)
+		rows = MAX_ROWS;
+	if (cols > MAX_COLS)
+		cols = MAX_COLS;
+	if (rows < 1 || cols < 1 || (rows == scr->rows && cols == scr->cols))
+		return;
+
+	grid[0] = grid_alloc(rows, cols);
+	grid[1] = grid_alloc(rows, cols);
+	tabs = malloc(cols);
+	if (!grid[0] || !grid[1] || !tabs)
+	{
+		free(grid[0]);
+		free(grid[1]);
+		free(tabs);
+		return;
+	}
+
+	shift = scr->cur.y - (rows - 1);
+	if (shift < 0)
+		shift = 0;
+	ncols = cols < scr->cols ? cols : scr->cols;
+	for (i = 0; i < 2; ++i)
+	{
+		memset(grid[i], 0, (size_t)rows * cols * sizeof(struct cell));
+		for (y = 0; y < rows && y + shift < scr->rows; ++y)
+			memcpy(grid[i] + y * cols,
+				scr->grid[i] + (y + shift) * scr->cols,
+				ncols * sizeof(struct cell));
+		free(scr->grid[i]);
+		scr->grid[i] = grid[i];
+	}
+	free(scr->tabs);
+	scr->tabs = tabs;
+
+	scr->rows = rows;
+	scr->cols = cols;
+	reset_tabs(scr);
+	scr->top = 0;
+	scr->bottom = rows - 1;
+	scr->cur.y -= shift;
+	if (scr->cur.x >= cols)
+		scr->cur.x = cols - 1;
+	scr->cur.wrapnext = 0;
+	for (i = 0; i < 2; ++i)
+	{
+		if (scr->saved[i].y >= rows)
+			scr->saved[i].y = rows - 1;
+		if (scr->saved[i].x >= cols)
+			scr->saved[i].x = cols - 1;
+	}
+
+	/* A double-width character may have lost its right half. */
+	for (i = 0; i < 2; ++i)
+		for (y = 0; y < rows; ++y)
+		{
+			c = scr->grid[i] + y * cols + ncols - 1;
+			if (c->ch && !(c->attr & ATTR_WIDE) &&
+				char_width(c->ch) == 2 && ncols == cols)
+				memset(c, 0, sizeof(struct cell));
+		}
+}
+
+/* Put a printable character at the cursor. */
+static void
+put_char(struct screen *scr, unsigned int ch)
+{
+	struct cursor *cur = &scr->cur;
+	struct cell *row;
+	int width;
+
+	/* Translate the DEC line drawing characters. */
+	if (ch >= 0x5f && ch <= 0x7e && cur->charset[cur->gl] == '0')
+		ch = dec_graphics[ch - 0x5f];
+
+	width = char_width(ch);
+	if (width == 0)
+		return;
+	if (width > scr->cols)
+		return;
+	scr->last = ch;
+
+	if (cur->wrapnext && scr->autowrap)
+	{
+		cur->x = 0;
+		linefeed(scr);
+	}
+	cur->wrapnext = 0;
+
+	/* A double-width character that doesn't fit goes on the next line. */
+	if (width == 2 && cur->x == scr->cols - 1)
+	{
+		if (!scr->autowrap)
+			return;
+		break_wide(scr, cur->y, cur->x);
+		clear_cells(scr, cur->y, cur->x, cur->x + 1);
+		cur->x = 0;
+		linefeed(scr);
+	}
+
+	row = row_of(scr, cur->y);
+	if (scr->insert)
+	{
+		memmove(row + cur->x + width, row + cur->x,
+			(scr->cols - cur->x - width) * sizeof(struct cell));
+		if (row[scr->cols - 1].ch && char_width(row[scr->cols - 1].ch)
+			== 2 && !(row[scr->cols - 1].attr & ATTR_WIDE))
+			row[scr->cols - 1] = blank_cell(scr);
+	}
+
+	break_wide(scr, cur->y, cur->x);
+	if (width == 2)
+		break_wide(scr, cur->y, cur->x + 1);
+	row[cur->x] = cur->pen;
+	row[cur->x].ch = ch;
+	row[cur->x].attr &= ~ATTR_WIDE;
+	if (width == 2)
+	{
+		row[cur->x + 1] = row[cur->x];
+		row[cur->x + 1].attr |= ATTR_WIDE;
+	}
+
+	if (cur->x + width >= scr->cols)
+	{
+		cur->x = scr->cols - 1;
+		cur->wrapnext = scr->autowrap;
+	}
+	else
+		cur->x += width;
+}
+
+static void
+save_cursor(struct screen *scr)
+{
+	scr->saved[scr->alt] = scr->cur;
+	scr->saved_valid[scr->alt] = 1;
+}
+
+static void
+restore_cursor(struct screen *scr)
+{
+	if (scr->saved_valid[scr->alt])
+		scr->cur = scr->saved[scr->alt];
+	else
+		reset_cursor(&scr->cur);
+	if (scr->cur.y >= scr->rows)
+		scr->cur.y = scr->rows - 1;
+	if (scr->cur.x >= scr->cols)
+		scr->cur.x = scr->cols - 1;
+}
+
+static void
+set_alt(struct screen *scr, int alt)
+{
+	scr->alt = alt;
+	scr->cur.wrapnext = 0;
+}
+
+static int
+param(struct screen *scr, int i, int dflt)
+{
+	if (i >= scr->nparams || scr->params[i] <= 0)
+		return dflt;
+	return scr->params[i];
+}
+
+/* Parse the color in an extended SGR 38 or 48 sequence. */
+static int
+sgr_color(struct screen *scr, int *i, unsigned int *color)
+{
+	int j = *i;
+
+	if (j + 1 < scr->nparams && scr->params[j + 1] == 5 &&
+		j + 2 < scr->nparams)
+	{
+		*color = COLOR_PALETTE | (scr->params[j + 2] & 0xff);
+		*i = j + 2;
+		return 1;
+	}
+	if (j + 1 < scr->nparams && scr->params[j + 1] == 2 &&
+		j + 4 < scr->nparams)
+	{
+		*color = COLOR_RGB | ((scr->params[j + 2] & 0xff) << 16) |
+			((scr->params[j + 3] & 0xff) << 8) |
+			(scr->params[j + 4] & 0xff);
+		*i = j + 4;
+		return 1;
+	}
+	*i = scr->nparams;
+	return 0;
+}
+
+/* Select Graphic Rendition. */
+static void
+sgr(struct screen *scr)
+{
+	struct cell *pen = &scr->cur.pen;
+	int i, n;
+
+	if (scr->nparams == 0)
+		scr->nparams = 1, scr->params[0] = 0;
+	for (i = 0; i < scr->nparams; ++i)
+	{
+		n = scr->params[i] < 0 ? 0 : scr->params[i];
+		if (n == 0)
+		{
+			pen->attr = 0;
+			pen->fg = pen->bg = COLOR_DEFAULT;
+		}
+		else if (n == 1)
+			pen->attr |= ATTR_BOLD;
+		else if (n == 2)
+			pen->attr |= ATTR_DIM;
+		else if (n == 3)
+			pen->attr |= ATTR_ITALIC;
+		else if (n == 4)
+			pen->attr |= ATTR_UNDERLINE;
+		else if (n == 5 || n == 6)
+			pen->attr |= ATTR_BLINK;
+		else if (n == 7)
+			pen->attr |= ATTR_REVERSE;
+		else if (n == 8)
+			pen->attr |= ATTR_INVISIBLE;
+		else if (n == 9)
+			pen->attr |= ATTR_STRIKE;
+		else if (n == 21 || n == 22)
+			pen->attr &= ~(ATTR_BOLD|ATTR_DIM);
+		else if (n == 23)
+			pen->attr &= ~ATTR_ITALIC;
+		else if (n == 24)
+			pen->attr &= ~ATTR_UNDERLINE;
+		else if (n == 25)
+			pen->attr &= ~ATTR_BLINK;
+		else if (n == 27)
+			pen->attr &= ~ATTR_REVERSE;
+		else if (n == 28)
+			pen->attr &= ~ATTR_INVISIBLE;
+		else if (n == 29)
+			pen->attr &= ~ATTR_STRIKE;
+		else if (n >= 30 && n <= 37)
+			pen->fg = COLOR_PALETTE | (n - 30);
+		else if (n == 38)
+			sgr_color(scr, &i, &pen->fg);
+		else if (n == 39)
+			pen->fg = COLOR_DEFAULT;
+		else if (n >= 40 && n <= 47)
+			pen->bg = COLOR_PALETTE | (n - 40);
+		else if (n == 48)
+			sgr_color(scr, &i, &pen->bg);
+		else if (n == 49)
+			pen->bg = COLOR_DEFAULT;
+		else if (n >= 90 && n <= 97)
+			pen->fg = COLOR_PALETTE | (n - 90 + 8);
+		else if (n >= 100 && n <= 107)
+			pen->bg = COLOR_PALETTE | (n - 100 + 8);
+	}
+}
+
+/* DECSET and DECRST. */
+static void
+private_mode(struct screen *scr, int mode, int set)
+{
+	size_t i;
+
+	switch (mode)
+	{
+	case 6:
+		scr->cur.origin = set;
+		move_to(scr, 0, 0);
+		return;
+	case 7:
+		scr->autowrap = set;
+		if (!set)
+			scr->cur.wrapnext = 0;
+		return;
+	case 47:
+		set_alt(scr, set);
+		return;
+	case 1047:
+		if (!set && scr->alt)
+			clear_rows(scr, 0, scr->rows);
+		set_alt(scr, set);
+		return;
+	case 1048:
+		if (set)
+			save_cursor(scr);
+		else
+			restore_cursor(scr);
+		return;
+	case 1049:
+		if (set && !scr->alt)
+		{
+			save_cursor(scr);
+			set_alt(scr, 1);
+			clear_rows(scr, 0, scr->rows);
+		}
+		else if (!set && scr->alt)
+		{
+			set_alt(scr, 0);
+			restore_cursor(scr);
+		}
+		return;
+	}
+
+	for (i = 0; i < NPRIVATE; ++i)
+		if (private_modes[i].mode == mode)
+			scr->private[i] = set;
+}
+
+static void
+set_modes(struct screen *scr, int set)
+{
+	int i;
+
+	for (i = 0; i < scr->nparams; ++i)
+	{
+		if (scr->marker == '?')
+			private_mode(scr, scr->params[i], set);
+		else if (scr->marker == 0 && scr->params[i] == 4)
+			scr->insert = set;
+	}
+}
+
+static void
+erase_display(struct screen *scr, int how)
+{
+	struct cursor *cur = &scr->cur;
+
+	if (how == 0)
+	{
+		clear_cells(scr, cur->y, cur->x, scr->cols);
+		clear_rows(scr, cur->y + 1, scr->rows);
+	}
+	else if (how == 1)
+	{
+		clear_rows(scr, 0, cur->y);
+		clear_cells(scr, cur->y, 0, cur->x + 1);
+	}
+	else if (how == 2)
+		clear_rows(scr, 0, scr->rows);
+}
+
+static void
+erase_line(struct screen *scr, int how)
+{
+	struct cursor *cur = &scr->cur;
+
+	if (how == 0)
+		clear_cells(scr, cur->y, cur->x, scr->cols);
+	else if (how == 1)
+		clear_cells(scr, cur->y, 0, cur->x + 1);
+	else if (how == 2)
+		clear_cells(scr, cur->y, 0, scr->cols);
+}
+
+/* Insert (n > 0) or delete (n < 0) characters at the cursor. */
+static void
+shift_chars(struct screen *scr, int n)
+{
+	struct cursor *cur = &scr->cur;
+	struct cell *row = row_of(scr, cur->y);
+	int left = scr->cols - cur->x;
+
+	break_wide(scr, cur->y, cur->x);
+	if (n > 0)
+	{
+		if (n > left)
+			n = left;
+		memmove(row + cur->x + n, row + cur->x,
+			(left - n) * sizeof(struct cell));
+		clear_cells(scr, cur->y, cur->x, cur->x + n);
+	}
+	else
+	{
+		n = -n;
+		if (n > left)
+			n = left;
+		memmove(row + cur->x, row + cur->x + n,
+			(left - n) * sizeof(struct cell));
+		clear_cells(scr, cur->y, scr->cols - n, scr->cols);
+	}
+	cur->wrapnext = 0;
+}
+
+static void
+tab_forward(struct screen *scr, int n)
+{
+	struct cursor *cur = &scr->cur;
+
+	while (n-- > 0 && cur->x < scr->cols - 1)
+		do
+			cur->x++;
+		while (cur->x < scr->cols - 1 && !scr->tabs[cur->x]);
+}
+
+static void
+tab_backward(struct screen *scr, int n)
+{
+	struct cursor *cur = &scr->cur;
+
+	while (n-- > 0 && cur->x > 0)
+		do
+			cur->x--;
+		while (cur->x > 0 && !scr->tabs[cur->x]);
+}
+
+/* Dispatch a complete control sequence. */
+static void
+csi_dispatch(struct screen *scr, unsigned char c)
+{
+	struct cursor *cur = &scr->cur;
+	int n = param(scr, 0, 1);
+	int y;
+
+	/* Things with intermediates we care about. */
+	if (scr->inter == ' ' && c == 'q')
+	{
+		scr->cursor_style = param(scr, 0, 0);
+		return;
+	}
+	if (scr->inter == '!' && c == 'p')
+	{
+		/* DECSTR - soft reset. */
+		scr->insert = scr->keypad = 0;
+		scr->autowrap = 1;
+		scr->cur.origin = 0;
+		scr->top = 0;
+		scr->bottom = scr->rows - 1;
+		memset(&cur->pen, 0, sizeof(cur->pen));
+		return;
+	}
+	if (scr->inter)
+		return;
+
+	if (scr->marker && c != 'h' && c != 'l')
+		return;
+
+	switch (c)
+	{
+	case '@':
+		shift_chars(scr, n);
+		break;
+	case 'A':
+		y = cur->y - n;
+		if (cur->y >= scr->top && y < scr->top)
+			y = scr->top;
+		cur->y = y < 0 ? 0 : y;
+		cur->wrapnext = 0;
+		break;
+	case 'B':
+	case 'e':
+		y = cur->y + n;
+		if (cur->y <= scr->bottom && y > scr->bottom)
+			y = scr->bottom;
+		cur->y = y >= scr->rows ? scr->rows - 1 : y;
+		cur->wrapnext = 0;
+		break;
+	case 'C':
+	case 'a':
+		cur->x = cur->x + n >= scr->cols ? scr->cols - 1 : cur->x + n;
+		cur->wrapnext = 0;
+		break;
+	case 'D':
+		cur->x = cur->x - n < 0 ? 0 : cur->x - n;
+		cur->wrapnext = 0;
+		break;
+	case 'E':
+		csi_dispatch(scr, 'B');
+		cur->x = 0;
+		break;
+	case 'F':
+		csi_dispatch(scr, 'A');
+		cur->x = 0;
+		break;
+	case 'G':
+	case '`':
+		cur->x = n > scr->cols ? scr->cols - 1 : n - 1;
+		cur->wrapnext = 0;
+		break;
+	case 'H':
+	case 'f':
+		move_to(scr, n - 1, param(scr, 1, 1) - 1);
+		break;
+	case 'I':
+		tab_forward(scr, n);
+		break;
+	case 'J':
+		erase_display(scr, param(scr, 0, 0));
+		break;
+	case 'K':
+		erase_line(scr, param(scr, 0, 0));
+		break;
+	case 'L':
+	case 'M':
+		if (cur->y < scr->top || cur->y > scr->bottom)
+			break;
+		if (c == 'L')
+			scroll_down(scr, cur->y, scr->bottom, n);
+		else
+			scroll_up(scr, cur->y, scr->bottom, n);
+		cur->x = 0;
+		cur->wrapnext = 0;
+		break;
+	case 'P':
+		shift_chars(scr, -n);
+		break;
+	case 'S':
+		scroll_up(scr, scr->top, scr->bottom, n);
+		break;
+	case 'T':
+		scroll_down(scr, scr->top, scr->bottom, n);
+		break;
+	case 'X':
+		break_wide(scr, cur->y, cur->x);
+		clear_cells(scr, cur->y, cur->x,
+			cur->x + n > scr->cols ? scr->cols : cur->x + n);
+		cur->wrapnext = 0;
+		break;
+	case 'Z':
+		tab_backward(scr, n);
+		break;
+	case 'b':
+		if (scr->last)
+			while (n-- > 0)
+				put_char(scr, scr->last);
+		break;
+	case 'd':
+		y = n - 1 + (cur->origin ? scr->top : 0);
+		cur->y = y >= scr->rows ? scr->rows - 1 : y;
+		cur->wrapnext = 0;
+		break;
+	case 'g':
+		if (param(scr, 0, 0) == 0)
+			scr->tabs[cur->x] = 0;
+		else if (param(scr, 0, 0) == 3)
+			memset(scr->tabs, 0, scr->cols);
+		break;
+	case 'h':
+		set_modes(scr, 1);
+		break;
+	case 'l':
+		set_modes(scr, 0);
+		break;
+	case 'm':
+		sgr(scr);
+		break;
+	case 'r':
+		y = param(scr, 1, scr->rows);
+		if (y > scr->rows)
+			y = scr->rows;
+		if (n < y)
+		{
+			scr->top = n - 1;
+			scr->bottom = y - 1;
+			move_to(scr, 0, 0);
+		}
+		break;
+	case 's':
+		save_cursor(scr);
+		break;
+	case 'u':
+		restore_cursor(scr);
+		break;
+	}
+}
+
+/* Dispatch an escape sequence. */
+static void
+esc_dispatch(struct screen *scr, unsigned char c)
+{
+	struct cursor *cur = &scr->cur;
+
+	if (scr->inter == '(' || scr->inter == ')')
+	{
+		cur->charset[scr->inter == ')'] = c;
+		return;
+	}
+	if (scr->inter)
+		return;
+
+	switch (c)
+	{
+	case '7':
+		save_cursor(scr);
+		break;
+	case '8':
+		restore_cursor(scr);
+		break;
+	case 'D':
+		linefeed(scr);
+		cur->wrapnext = 0;
+		break;
+	case 'E':
+		cur->x = 0;
+		linefeed(scr);
+		cur->wrapnext = 0;
+		break;
+	case 'H':
+		scr->tabs[cur->x] = 1;
+		break;
+	case 'M':
+		reverse_index(scr);
+		cur->wrapnext = 0;
+		break;
+	case 'c':
+		reset(scr);
+		break;
+	case '=':
+		scr->keypad = 1;
+		break;
+	case '>':
+		scr->keypad = 0;
+		break;
+	}
+}
+
+/* Dispatch an operating system command. Only the title is kept. */
+static void
+osc_dispatch(struct screen *scr)
+{
+	scr->osc[scr->osclen] = '\0';
+	if ((scr->osc[0] == '0' || scr->osc[0] == '2') && scr->osc[1] == ';')
+		strcpy(scr->title, scr->osc + 2);
+}
+
+static void
+control(struct screen *scr, unsigned char c)
+{
+	struct cursor *cur = &scr->cur;
+
+	switch (c)
+	{
+	case '\b':
+		if (cur->x > 0)
+			cur->x--;
+		cur->wrapnext = 0;
+		break;
+	case '\t':
+		tab_forward(scr, 1);
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		linefeed(scr);
+		cur->wrapnext = 0;
+		break;
+	case '\r':
+		cur->x = 0;
+		cur->wrapnext = 0;
+		break;
+	case 016:
+		cur->gl = 1;
+		break;
+	case 017:
+		cur->gl = 0;
+		break;
+	}
+}
+
+/* Feed the program's output through the parser. */
+void
+screen_feed(struct screen *scr, const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+	{
+		unsigned char c = buf[i];
+
+		/* These abort any sequence, and work anywhere. */
+		if (c == 030 || c == 032)
+		{
+			scr->state = S_GROUND;
+			continue;
+		}
+		if (c == 033 && scr->state != S_OSC && scr->state != S_STR)
+		{
+			scr->state = S_ESC;
+			scr->inter = 0;
+			scr->utf8_left = 0;
+			continue;
+		}
+
+		switch (scr->state)
+		{
+		case S_GROUND:
+			if (scr->utf8_left > 0)
+			{
+				if ((c & 0xc0) == 0x80)
+				{
+					scr->utf8 = (scr->utf8 << 6) | (c & 0x3f);
+					if (--scr->utf8_left == 0)
+						put_char(scr, scr->utf8);
+					continue;
+				}
+				/* A broken sequence. */
+				scr->utf8_left = 0;
+				put_char(scr, 0xfffd);
+			}
+			if (c < 0x20 || c == 0x7f)
+				control(scr, c);
+			else if (c < 0x80)
+				put_char(scr, c);
+			else if ((c & 0xe0) == 0xc0)
+				scr->utf8 = c & 0x1f, scr->utf8_left = 1;
+			else if ((c & 0xf0) == 0xe0)
+				scr->utf8 = c & 0x0f, scr->utf8_left = 2;
+			else if ((c & 0xf8) == 0xf0)
+				scr->utf8 = c & 0x07, scr->utf8_left = 3;
+			else
+				put_char(scr, 0xfffd);
+			break;
+
+		case S_ESC:
+			if (c == '[')
+			{
+				scr->state = S_CSI;
+				scr->nparams = 0;
+				scr->marker = 0;
+				scr->params[0] = -1;
+			}
+			else if (c == ']')
+			{
+				scr->state = S_OSC;
+				scr->osclen = 0;
+			}
+			else if (c == 'P' || c == 'X' || c == '^' || c == '_')
+				scr->state = S_STR;
+			else if (c >= 0x20 && c < 0x30)
+			{
+				scr->inter = c;
+				scr->state = S_ESC_INTER;
+			}
+			else if (c < 0x20)
+				control(scr, c);
+			else
+			{
+				esc_dispatch(scr, c);
+				scr->state = S_GROUND;
+			}
+			break;
+
+		case S_ESC_INTER:
+			if (c < 0x20)
+				control(scr, c);
+			else if (c >= 0x30)
+			{
+				esc_dispatch(scr, c);
+				scr->state = S_GROUND;
+			}
+			break;
+
+		case S_CSI:
+			if (c < 0x20)
+				control(scr, c);
+			else if (c >= '0' && c <= '9')
+			{
+				int *p;
+
+				if (scr->nparams == 0)
+					scr->nparams = 1;
+				p = &scr->params[scr->nparams - 1];
+				if (*p < 0)
+					*p = 0;
+				if (*p < 100000)
+					*p = *p * 10 + (c - '0');
+			}
+			else if (c == ';' || c == ':')
+			{
+				if (scr->nparams == 0)
+					scr->nparams = 1;
+				if (scr->nparams < MAX_PARAMS)
+					scr->params[scr->nparams++] = -1;
+			}
+			else if (c >= '<' && c <= '?')
+				scr->marker = c;
+			else if (c >= 0x20 && c < 0x30)
+				scr->inter = c;
+			else if (c >= 0x40 && c < 0x7f)
+			{
+				csi_dispatch(scr, c);
+				scr->state = S_GROUND;
+			}
+			break;
+
+		case S_OSC:
+			if (c == 007)
+			{
+				osc_dispatch(scr);
+				scr->state = S_GROUND;
+			}
+			else if (c == 033)
+				scr->state = S_OSC_ESC;
+			else if (scr->osclen < MAX_OSC - 1)
+				scr->osc[scr->osclen++] = c;
+			break;
+
+		case S_OSC_ESC:
+			if (c == '\\')
+				osc_dispatch(scr);
+			scr->state = S_GROUND;
+			break;
+
+		case S_STR:
+			if (c == 033)
+				scr->state = S_STR_ESC;
+			else if (c == 007)
+				scr->state = S_GROUND;
+			break;
+
+		case S_STR_ESC:
+			scr->state = c == '\\' ? S_GROUND : S_STR;
+			break;
+		}
+	}
+}
+
+static void
+sb_add(struct sbuf *sb, const void *data, size_t len)
+{
+	if (sb->failed)
+		return;
+	if (sb->len + len > sb->size)
+	{
+		size_t size = sb->size ? sb->size : 4096;
+		unsigned char *buf;
+
+		while (size < sb->len + len)
+			size *= 2;
+		buf = realloc(sb->buf, size);
+		if (!buf)
+		{
+			sb->failed = 1;
+			return;
+		}
+		sb->buf = buf;
+		sb->size = size;
+	}
+	memcpy(sb->buf + sb->len, data, len);
+	sb->len += len;
+}
+
+static void
+sb_printf(struct sbuf *sb, const char *fmt, ...)
+{
+	char tmp[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		sb_add(sb, tmp, n < (int)sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+static void
+sb_utf8(struct sbuf *sb, unsigned int ch)
+{
+	unsigned char tmp[4];
+	size_t n;
+
+	if (ch < 0x80)
+		tmp[0] = ch, n = 1;
+	else if (ch < 0x800)
+	{
+		tmp[0] = 0xc0 | (ch >> 6);
+		tmp[1] = 0x80 | (ch & 0x3f);
+		n = 2;
+	}
+	else if (ch < 0x10000)
+	{
+		tmp[0] = 0xe0 | (ch >> 12);
+		tmp[1] = 0x80 | ((ch >> 6) & 0x3f);
+		tmp[2] = 0x80 | (ch & 0x3f);
+		n = 3;
+	}
+	else
+	{
+		tmp[0] = 0xf0 | (ch >> 18);
+		tmp[1] = 0x80 | ((ch >> 12) & 0x3f);
+		tmp[2] = 0x80 | ((ch >> 6) & 0x3f);
+		tmp[3] = 0x80 | (ch & 0x3f);
+		n = 4;
+	}
+	sb_add(sb, tmp, n);
+}
+
+static void
+sb_color(struct sbuf *sb, unsigned int color, int base)
+{
+	unsigned int n = color & 0xffffff;
+
+	if (color & COLOR_RGB)
+		sb_printf(sb, ";%d;2;%u;%u;%u", base + 8, n >> 16,
+			(n >> 8) & 0xff, n & 0xff);
+	else if ((color & COLOR_PALETTE) && n < 8)
+		sb_printf(sb, ";%u", base + n);
+	else if ((color & COLOR_PALETTE) && n < 16)
+		sb_printf(sb, ";%u", base + 60 + n - 8);
+	else if (color & COLOR_PALETTE)
+		sb_printf(sb, ";%d;5;%u", base + 8, n);
+}
+
+/* Switch to the attributes of a cell, if they differ from the last. */
+static void
+sb_sgr(struct sbuf *sb, const struct cell *c, struct cell *last)
+{
+	static const char codes[] = "12345789";
+	int i;
+
+	if (last && (c->attr & ~ATTR_WIDE) == (last->attr & ~ATTR_WIDE) &&
+		c->fg == last->fg && c->bg == last->bg)
+		return;
+
+	sb_add(sb, "\033[0", 3);
+	for (i = 0; codes[i]; ++i)
+		if (c->attr & (1 << i))
+			sb_printf(sb, ";%c", codes[i]);
+	sb_color(sb, c->fg, 30);
+	sb_color(sb, c->bg, 40);
+	sb_add(sb, "m", 1);
+	if (last)
+		*last = *c;
+}
+
+static int
+is_plain_blank(const struct cell *c)
+{
+	return c->ch == 0 && !(c->attr & ~ATTR_WIDE) &&
+		c->fg == COLOR_DEFAULT && c->bg == COLOR_DEFAULT;
+}
+
+/* Draw a grid on a cleared screen with autowrap turned off. */
+static void
+draw_grid(struct screen *scr, struct sbuf *sb, struct cell *grid)
+{
+	struct cell pen;
+	int x, y, end, run;
+
+	memset(&pen, 0, sizeof(pen));
+	for (y = 0; y < scr->rows; ++y)
+	{
+		struct cell *row = grid + y * scr->cols;
+
+		for (end = scr->cols - 1; end >= 0; --end)
+			if (!is_plain_blank(&row[end]))
+				break;
+		if (end < 0)
+			continue;
+
+		sb_printf(sb, "\033[%dH", y + 1);
+		for (x = 0; x <= end; ++x)
+		{
+			if (row[x].attr & ATTR_WIDE)
+				continue;
+
+			/* Skip over runs of plain blanks. */
+			for (run = 0; x + run <= end &&
+				is_plain_blank(&row[x + run]); ++run)
+				;
+			if (run >= 4 || (run > 0 && !is_plain_blank(&pen)))
+			{
+				if (run == 1)
+					sb_add(sb, "\033[C", 3);
+				else
+					sb_printf(sb, "\033[%dC", run);
+				x += run - 1;
+				continue;
+			}
+
+			sb_sgr(sb, &row[x], &pen);
+			sb_utf8(sb, row[x].ch ? row[x].ch : ' ');
+		}
+	}
+	memset(&pen, 0, sizeof(pen));
+	sb_sgr(sb, &pen, NULL);
+}
+
+/* Position the cursor, taking origin mode into account. */
+static void
+sb_cursor(struct screen *scr, struct sbuf *sb, const struct cursor *cur)
+{
+	int y = cur->y;
+
+	if (cur->origin)
+		y -= scr->top;
+	sb_printf(sb, "\033[%d;%dH", y + 1, cur->x + 1);
+}
+
+/*
+** Set things up so that a DECSC/DECRC pair sees the saved cursor. The
+** scrolling region is still the whole screen at this point, so origin mode
+** doesn't change what the coordinates mean.
+*/
+static void
+sb_saved(struct sbuf *sb, const struct cursor *cur, int save)
+{
+	if (save && cur->origin)
+		sb_add(sb, "\033[?6h", 5);
+	sb_printf(sb, "\033[%d;%dH", cur->y + 1, cur->x + 1);
+	if (save)
+	{
+		sb_sgr(sb, &cur->pen, NULL);
+		sb_add(sb, "\0337\033[0m", 6);
+		if (cur->origin)
+			sb_add(sb, "\033[?6l", 5);
+	}
+}
+
+/*
+** Describe the current screen as a sequence of bytes that recreates it on a
+** terminal in its initial state. Returns a malloc'd buffer, or NULL.
+*/
+unsigned char *
+screen_snapshot(struct screen *scr, size_t *len)
+{
+	struct sbuf sb;
+	struct cell *row;
+	size_t i;
+	int x;
+
+	memset(&sb, 0, sizeof(sb));
+
+	/* Start from a known state, with the cursor hidden while drawing. */
+	sb_printf(&sb, "\033[?25l\033[0m\033[r\033[?6l\033[?7l\033[H\033[2J");
+
+	if (scr->alt)
+	{
+		/* Draw the primary screen underneath, so it's there when the
+		** program leaves the alternate screen. */
+		draw_grid(scr, &sb, scr->grid[0]);
+		if (scr->saved_valid[0])
+			sb_saved(&sb, &scr->saved[0], 0);
+		sb_printf(&sb, "\033[?1049h\033[H\033[2J");
+	}
+	draw_grid(scr, &sb, scr->grid[scr->alt]);
+
+	/* Tab stops, if they've been changed. This has to come before the
+	** DECSC below, and the cursor gets positioned afterwards anyway. */
+	for (x = 0; x < scr->cols; ++x)
+		if (scr->tabs[x] != (x % 8 == 0))
+			break;
+	if (x < scr->cols)
+	{
+		sb_add(&sb, "\033[3g", 4);
+		for (x = 0; x < scr->cols; ++x)
+			if (scr->tabs[x])
+				sb_printf(&sb, "\033[1;%dH\033H", x + 1);
+	}
+
+	/* The cursor saved with DECSC. */
+	if (scr->saved_valid[scr->alt] && !scr->alt)
+		sb_saved(&sb, &scr->saved[0], 1);
+
+	/* Scrolling region and origin mode, which both home the cursor. */
+	if (scr->top != 0 || scr->bottom != scr->rows - 1)
+		sb_printf(&sb, "\033[%d;%dr", scr->top + 1, scr->bottom + 1);
+	if (scr->cur.origin)
+		sb_add(&sb, "\033[?6h", 5);
+
+	/* Put the cursor back. If a wrap is pending, get the terminal into
+	** the same state by writing the last character on the line again. */
+	if (scr->cur.wrapnext && scr->autowrap)
+	{
+		row = scr->grid[scr->alt] + scr->cur.y * scr->cols;
+		x = scr->cols - 1;
+		if ((row[x].attr & ATTR_WIDE) && x > 0)
+			x--;
+		sb_printf(&sb, "\033[%d;%dH\033[?7h",
+			scr->cur.y + 1 - (scr->cur.origin ? scr->top : 0),
+			x + 1);
+		sb_sgr(&sb, &row[x], NULL);
+		sb_utf8(&sb, row[x].ch ? row[x].ch : ' ');
+	}
+	else
+	{
+		sb_cursor(scr, &sb, &scr->cur);
+		if (scr->autowrap)
+			sb_add(&sb, "\033[?7h", 5);
+	}
+
+	/* Modes. */
+	if (scr->cur.charset[0] != 'B')
+		sb_printf(&sb, "\033(%c", scr->cur.charset[0]);
+	if (scr->cur.charset[1] != 'B')
+		sb_printf(&sb, "\033)%c", scr->cur.charset[1]);
+	if (scr->cur.gl)
+		sb_add(&sb, "\016", 1);
+	if (scr->insert)
+		sb_add(&sb, "\033[4h", 4);
+	if (scr->keypad)
+		sb_add(&sb, "\033=", 2);
+	if (scr->cursor_style)
+		sb_printf(&sb, "\033[%d q", scr->cursor_style);
+	for (i = 0; i < NPRIVATE; ++i)
+		if (scr->private[i] != private_modes[i].dflt ||
+			private_modes[i].mode == 25)
+			sb_printf(&sb, "\033[?%d%c", private_modes[i].mode,
+				scr->private[i] ? 'h' : 'l');
+	/* sb_printf would cut a long title short, and the BEL with it. */
+	if (scr->title[0])
+	{
+		sb_add(&sb, "\033]2;", 4);
+		sb_add(&sb, scr->title, strlen(scr->title));
+		sb_add(&sb, "\007", 1);
+	}
+
+	sb_sgr(&sb, &scr->cur.pen, NULL);
+
+	if (sb.failed)
+	{
+		free(sb.buf);
+		return NULL;
+	}
+	*len = sb.len;
+	return sb.buf;
+}